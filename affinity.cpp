@@ -0,0 +1,145 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/socket.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "affinity.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+// Parse a sysfs cpulist like 0-3,8-11
+static std::vector<int> parse_cpulist(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::istringstream is(list);
+    std::string item;
+
+    while (std::getline(is, item, ','))
+    {
+        if (item.empty() || item == "\n")
+            continue;
+
+        size_t dash = item.find('-');
+        int first = std::atoi(item.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(item.c_str() + dash + 1);
+        for (int c = first; c <= last; ++c)
+            cpus.push_back(c);
+    }
+    return cpus;
+}
+
+// ------------------ CpuPlacement ------------------
+CpuPlacement::CpuPlacement() :
+    mode(none)
+{
+}
+
+void CpuPlacement::parse(const std::string &str)
+{
+    if (str == "cpu")
+        mode = cpu;
+    else if (str == "node")
+    {
+        mode = node;
+        load_topology();
+    }
+    else
+        throw AffinityError("Unknown CPU affinity mode '" + str + "'");
+}
+
+void CpuPlacement::load_topology()
+{
+    cpu_node.assign(cpu_count(), -1);
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (!dir)
+        throw AffinityError("No NUMA topology in /sys/devices/system/node");
+
+    while (dirent *ent = readdir(dir))
+    {
+        int n;
+        if (std::sscanf(ent->d_name, "node%d", &n) != 1)
+            continue;
+
+        std::ifstream f(std::string("/sys/devices/system/node/") + ent->d_name + "/cpulist");
+        std::string list;
+        std::getline(f, list);
+
+        if (node_cpus.size() <= static_cast<size_t>(n))
+            node_cpus.resize(n + 1);
+        node_cpus[n] = parse_cpulist(list);
+
+        for (int c : node_cpus[n])
+            if (c < static_cast<int>(cpu_node.size()))
+                cpu_node[c] = n;
+    }
+    closedir(dir);
+}
+
+bool CpuPlacement::cpuset_for(int c, cpu_set_t &set) const
+{
+    if (mode == none || c < 0 || c >= CPU_SETSIZE)
+        return false;
+
+    CPU_ZERO(&set);
+
+    if (mode == cpu)
+    {
+        CPU_SET(c, &set);
+        return true;
+    }
+
+    if (c >= static_cast<int>(cpu_node.size()) || cpu_node[c] < 0)
+        return false;
+
+    for (int n : node_cpus[cpu_node[c]])
+        if (n < CPU_SETSIZE)
+            CPU_SET(n, &set);
+    return true;
+}
+
+// ------------------ Sockets ------------------
+int incoming_cpu(int fd)
+{
+    int cpu;
+    socklen_t len = sizeof(cpu);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+        return -1;
+    return cpu;
+}
+
+int cpu_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_CONF);
+    return n > 0 ? static_cast<int>(n) : 1;
+}
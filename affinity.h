@@ -0,0 +1,89 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <sched.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @file affinity.h
+ * @brief run handlers near the CPU that received their connection
+ *
+ * The kernel records the CPU a socket's packets were processed on
+ * (SO_INCOMING_CPU). Pinning the handler to that CPU, or to the CPUs of its
+ * NUMA node, keeps the socket buffers warm in its caches.
+ */
+
+/**
+ * @brief The AffinityError class
+ */
+class AffinityError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+struct CpuPlacement
+{
+    enum Mode { none, cpu, node };
+
+    Mode mode;
+
+    CpuPlacement();
+
+    /**
+     * @brief select the mode from "cpu" or "node"
+     * Reads the NUMA topology from sysfs for node mode.
+     * @throws AffinityError
+     */
+    void parse(const std::string &mode);
+
+    bool empty() const { return mode == none; }
+
+    /**
+     * @brief the CPUs a handler for a connection received on cpu may run on
+     * @return false if there's nothing to restrict
+     */
+    bool cpuset_for(int cpu, cpu_set_t &set) const;
+
+private:
+    std::vector<int> cpu_node;              // node of every CPU, -1: unknown
+    std::vector<std::vector<int>> node_cpus;
+
+    void load_topology();
+};
+
+/**
+ * @brief the CPU that processed an accepted socket's packets
+ * @return the CPU or -1 if unknown
+ */
+int incoming_cpu(int fd);
+
+/**
+ * @brief number of configured CPUs, i.e. the range of CPU numbers
+ */
+int cpu_count();
+
@@ -0,0 +1,150 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <iostream>
+
+#include "breaker.h"
+
+using namespace std;
+
+// Cool-downs stop doubling here
+static const unsigned max_backoff = 64;
+
+CircuitBreaker::CircuitBreaker(unsigned max_failures, uint64_t window, uint64_t quick, uint64_t cool_down) :
+    opened(0), rejected(0),
+    threshold(max_failures), window_ms(window), quick_ms(quick), base_open_ms(cool_down),
+    current(closed), open_ms(cool_down), opened_at(0), probing(false), probe_at(0)
+{
+}
+
+bool CircuitBreaker::allow(uint64_t now)
+{
+    switch (current)
+    {
+    case closed:
+        return true;
+
+    case open:
+        if (now < opened_at + open_ms)
+            break;
+        cerr << "\033[33mCircuit half-open, probing the handler\033[0m" << endl;
+        current = half_open;
+        probing = true;
+        probe_at = now;
+        return true;
+
+    case half_open:
+        // A probe that has been running for a while is as good as a success
+        if (probing && now >= probe_at + quick_ms)
+        {
+            reset();
+            return true;
+        }
+        if (!probing)
+        {
+            probing = true;
+            probe_at = now;
+            return true;
+        }
+        break;
+    }
+
+    ++rejected;
+    return false;
+}
+
+void CircuitBreaker::record(uint64_t now, uint64_t lifetime_ms, bool failed)
+{
+    if (!enabled())
+        return;
+
+    bool quick_failure = failed && lifetime_ms < quick_ms;
+
+    if (current == half_open && probing)
+    {
+        // Either the probe or a handler from before the circuit opened
+        // that ran all this time; both tell whether the handler works
+        if (quick_failure)
+        {
+            open_ms = std::min(open_ms * 2, base_open_ms * max_backoff);
+            trip(now);
+        }
+        else
+            reset();
+        return;
+    }
+
+    if (current != closed || !quick_failure)
+        return;
+
+    failures.push_back(now);
+    while (!failures.empty() && failures.front() + window_ms < now)
+        failures.pop_front();
+
+    if (failures.size() >= threshold)
+        trip(now);
+}
+
+bool CircuitBreaker::blocked(uint64_t now) const
+{
+    switch (current)
+    {
+    case closed:
+        return false;
+    case open:
+        return now < opened_at + open_ms;
+    case half_open:
+        return probing && now < probe_at + quick_ms;
+    }
+    return false;
+}
+
+uint64_t CircuitBreaker::retry_at() const
+{
+    if (current == open)
+        return opened_at + open_ms;
+    if (current == half_open && probing)
+        return probe_at + quick_ms;
+    return 0;
+}
+
+void CircuitBreaker::trip(uint64_t now)
+{
+    cerr << "\033[31mHandler keeps failing, circuit open for \033[35m" << open_ms << "\033[31mms\033[0m" << endl;
+    current = open;
+    opened_at = now;
+    probing = false;
+    failures.clear();
+    ++opened;
+}
+
+void CircuitBreaker::reset()
+{
+    if (current != closed)
+        cerr << "\033[32mHandler recovered, circuit closed\033[0m" << endl;
+    current = closed;
+    open_ms = base_open_ms;
+    probing = false;
+    failures.clear();
+}
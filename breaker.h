@@ -0,0 +1,98 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+
+/**
+ * @file breaker.h
+ * @brief crash-loop circuit breaker
+ *
+ * A broken handler dies within milliseconds of every connection, turning
+ * a connection storm into a fork storm. After enough quick failures in a
+ * window the circuit opens and connections are turned away without
+ * spawning anything. Once the cool-down has passed a single probe
+ * connection is let through; the circuit closes if it survives and opens
+ * again, for twice as long, if it doesn't.
+ */
+
+class CircuitBreaker
+{
+public:
+    enum State { closed, open, half_open };
+
+    /**
+     * @param failures quick failures that open the circuit, 0 to disable
+     * @param window_ms the window they have to happen in
+     * @param quick_ms handlers that ran longer than this count as healthy
+     * @param open_ms the initial cool-down
+     */
+    CircuitBreaker(unsigned failures, uint64_t window_ms, uint64_t quick_ms, uint64_t open_ms);
+
+    bool enabled() const { return threshold > 0; }
+    State state() const { return current; }
+
+    /**
+     * @brief whether a new connection may spawn a handler
+     * Makes it the probe when half-open.
+     */
+    bool allow(uint64_t now_ms);
+
+    /**
+     * @brief whether allow() would refuse, without taking the probe
+     */
+    bool blocked(uint64_t now_ms) const;
+
+    /**
+     * @brief account for a finished handler
+     * @param lifetime_ms how long it ran
+     * @param failed exited unsuccessfully or by a signal
+     */
+    void record(uint64_t now_ms, uint64_t lifetime_ms, bool failed);
+
+    /**
+     * @brief when allow() might change its mind
+     */
+    uint64_t retry_at() const;
+
+    uint64_t opened;    // times the circuit opened
+    uint64_t rejected;  // connections turned away
+
+private:
+    unsigned threshold;
+    uint64_t window_ms;
+    uint64_t quick_ms;
+    uint64_t base_open_ms;
+
+    State current;
+    std::deque<uint64_t> failures;  // times of recent quick failures
+    uint64_t open_ms;               // current cool-down, doubles on failed probes
+    uint64_t opened_at;
+    bool probing;
+    uint64_t probe_at;
+
+    void trip(uint64_t now_ms);
+    void reset();
+};
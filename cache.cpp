@@ -0,0 +1,225 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+
+#include "cache.h"
+#include "reactor.h"
+
+// Bookkeeping per entry, roughly a list node and a hash node
+static const size_t entry_overhead = 128;
+
+ResponseCache::ResponseCache(size_t cache_budget, uint64_t cache_ttl_ms) :
+    hits(0), misses(0), coalesced(0), evicted(0), budget(cache_budget), ttl_ms(cache_ttl_ms), used(0)
+{
+}
+
+size_t ResponseCache::cost(const Entry &e)
+{
+    // The key is held twice, by the entry and by the index
+    return 2 * e.key.size() + e.response->size() + entry_overhead;
+}
+
+void ResponseCache::erase(Lru::iterator it)
+{
+    used -= cost(*it);
+    entries.erase(it->key);
+    lru.erase(it);
+}
+
+ResponseCache::Response ResponseCache::find(const std::string &key, uint64_t now_ms)
+{
+    auto it = entries.find(key);
+    if (it == entries.end())
+    {
+        ++misses;
+        return nullptr;
+    }
+
+    if (it->second->expires_ms <= now_ms)
+    {
+        erase(it->second);
+        ++misses;
+        return nullptr;
+    }
+
+    lru.splice(lru.begin(), lru, it->second);
+    ++hits;
+    return it->second->response;
+}
+
+bool ResponseCache::join(const std::string &key, Waiter waiter)
+{
+    auto it = pending.find(key);
+    if (it == pending.end())
+    {
+        pending.emplace(key, std::vector<Waiter>());
+        return false;
+    }
+
+    it->second.push_back(std::move(waiter));
+    ++coalesced;
+    return true;
+}
+
+void ResponseCache::fill(const std::string &key, Response response, uint64_t now_ms)
+{
+    if (response)
+    {
+        auto it = entries.find(key);
+        if (it != entries.end())
+            erase(it->second);
+
+        Entry e;
+        e.key = key;
+        e.response = response;
+        e.expires_ms = now_ms + ttl_ms;
+
+        if (cost(e) <= budget)
+        {
+            // Expired entries are only noticed when looked up; the oldest
+            // are the first to go either way
+            while (used + cost(e) > budget)
+            {
+                if (lru.back().expires_ms > now_ms)
+                    ++evicted;
+                erase(std::prev(lru.end()));
+            }
+
+            used += cost(e);
+            lru.push_front(std::move(e));
+            entries.emplace(key, lru.begin());
+        }
+    }
+
+    // The waiters may start handlers of their own, and come back here
+    auto it = pending.find(key);
+    if (it == pending.end())
+        return;
+    std::vector<Waiter> waiters(std::move(it->second));
+    pending.erase(it);
+
+    for (Waiter &waiter : waiters)
+        waiter(response);
+}
+
+int peek_request(int fd, char delimiter, size_t max, bool eof, std::string &key)
+{
+    std::vector<char> buf(max);
+
+    ssize_t n;
+    do
+        n = recv(fd, buf.data(), buf.size(), MSG_PEEK | MSG_DONTWAIT);
+    while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+        return errno == EAGAIN ? 0 : -1;
+
+    const char *end = static_cast<const char*>(memchr(buf.data(), delimiter, n));
+    if (end)
+    {
+        key.assign(buf.data(), end + 1 - buf.data());
+        return 1;
+    }
+
+    if (static_cast<size_t>(n) == max)
+        return -1;
+
+    // Nothing more is coming
+    if (eof && n > 0)
+    {
+        key.assign(buf.data(), n);
+        return 1;
+    }
+    return eof ? -1 : 0;
+}
+
+CachedReply::CachedReply(Reactor &reply_reactor, int reply_sock, ResponseCache::Response reply_response) :
+    bytes_in(0), bytes_out(0), reactor(reply_reactor), sock(reply_sock), response(reply_response), registered(false), finished(false)
+{
+}
+
+CachedReply::~CachedReply()
+{
+    if (registered)
+        reactor.remove(sock);
+}
+
+void CachedReply::start(size_t request_size)
+{
+    // Left unread, the request would make close() send a RST that can
+    // overtake the response
+    std::vector<char> buf(request_size);
+    ssize_t n = recv(sock, buf.data(), buf.size(), MSG_DONTWAIT);
+    if (n > 0)
+        bytes_in = n;
+
+    reactor.add(sock, EPOLLOUT | EPOLLET, [this](uint32_t) {
+        this->send_more();
+    });
+    registered = true;
+
+    // Usually all of it goes out right away
+    send_more();
+}
+
+void CachedReply::send_more()
+{
+    while (!finished && bytes_out < response->size())
+    {
+        ssize_t n = send(sock, response->data() + bytes_out, response->size() - bytes_out, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0)
+            bytes_out += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && errno == EAGAIN)
+            return;
+        else
+            // The peer went away
+            break;
+    }
+
+    finish();
+}
+
+void CachedReply::finish()
+{
+    if (finished)
+        return;
+
+    if (registered)
+    {
+        reactor.remove(sock);
+        registered = false;
+    }
+    shutdown(sock, SHUT_WR);
+    finished = true;
+
+    if (on_done)
+        on_done();
+}
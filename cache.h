@@ -0,0 +1,168 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @file cache.h
+ * @brief response cache for deterministic handlers
+ *
+ * Handlers that are pure functions of their request line don't need to be
+ * spawned for every connection. The request is peeked at, without
+ * consuming it, up to a delimiter; its bytes are the key. A hit is
+ * answered from memory with a single send(). A miss hands the untouched
+ * socket to a handler whose relayed output is recorded and kept for a
+ * while, within a memory budget. Connections that miss on a key another
+ * handler is already producing wait for its output instead of spawning
+ * handlers of their own.
+ */
+
+class Reactor;
+
+class ResponseCache
+{
+public:
+    typedef std::shared_ptr<const std::string> Response;
+
+    /**
+     * @brief called with the response of a coalesced miss
+     * nullptr if the handler producing it failed.
+     */
+    typedef std::function<void(Response)> Waiter;
+
+    /**
+     * @param budget bytes of keys and responses kept at most
+     * @param ttl_ms how long responses stay fresh
+     */
+    ResponseCache(size_t budget, uint64_t ttl_ms);
+
+    /**
+     * @brief look up a fresh response
+     * @return nullptr on a miss
+     */
+    Response find(const std::string &key, uint64_t now_ms);
+
+    /**
+     * @brief wait for a response that's already being produced
+     * @return false if nothing is; the caller is to produce it and
+     *  call fill() once done
+     */
+    bool join(const std::string &key, Waiter waiter);
+
+    /**
+     * @brief a handler produced the response for key
+     * @param response the output, nullptr if the handler failed or its
+     *  output wasn't recorded in full. Only kept if not nullptr.
+     */
+    void fill(const std::string &key, Response response, uint64_t now_ms);
+
+    // Largest response worth recording
+    size_t entry_max() const { return budget / 8; }
+
+    size_t size() const { return entries.size(); }
+    size_t bytes() const { return used; }
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t coalesced;     // misses that waited for another handler
+    uint64_t evicted;       // entries dropped for room before they expired
+
+private:
+    struct Entry
+    {
+        std::string key;
+        Response response;
+        uint64_t expires_ms;
+    };
+
+    typedef std::list<Entry> Lru;   // most recently used first
+
+    size_t budget;
+    uint64_t ttl_ms;
+    size_t used;
+    Lru lru;
+    std::unordered_map<std::string, Lru::iterator> entries;
+    std::unordered_map<std::string, std::vector<Waiter>> pending;
+
+    static size_t cost(const Entry &e);
+    void erase(Lru::iterator it);
+};
+
+/**
+ * @brief peek at a request without consuming it
+ * @param fd the connected socket
+ * @param delimiter the byte that ends the request, included in the key
+ * @param max the longest request worth caching
+ * @param eof the peer has shut down its side, so whatever is there is all of it
+ * @param key the request, once complete
+ * @return 1 if complete, 0 if more is needed, -1 if the request can't be cached
+ */
+int peek_request(int fd, char delimiter, size_t max, bool eof, std::string &key);
+
+class CachedReply
+{
+public:
+    /**
+     * @param reactor the event loop to finish sending from
+     * @param sock the connected socket. It stays owned by the caller.
+     * @param response what to send
+     */
+    CachedReply(Reactor &reactor, int sock, ResponseCache::Response response);
+    ~CachedReply();
+
+    /**
+     * @brief consume the request and send the response
+     * @param request_size bytes of request to consume
+     */
+    void start(size_t request_size);
+
+    bool done() const { return finished; }
+
+    /**
+     * @brief called once the response was sent or the peer went away
+     * The CachedReply may be destroyed from within the callback.
+     */
+    std::function<void()> on_done;
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+private:
+    Reactor &reactor;
+    int sock;
+    ResponseCache::Response response;
+    bool registered;
+    bool finished;
+
+    void send_more();
+    void finish();
+};
@@ -0,0 +1,210 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "cgroup.h"
+#include "metrics.h"
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+// Where the unified hierarchy is mounted
+static std::string cgroup2_mount()
+{
+    std::ifstream f("/proc/self/mountinfo");
+    std::string line;
+
+    while (std::getline(f, line))
+    {
+        // <id> <parent> <dev> <root> <mount point> <options> [<optional>...] - <fstype> ...
+        size_t sep = line.find(" - ");
+        if (sep == std::string::npos || line.compare(sep + 3, 8, "cgroup2 ") != 0)
+            continue;
+
+        std::istringstream is(line);
+        std::string field, mount;
+        is >> field >> field >> field >> field >> mount;
+        return mount;
+    }
+
+    throw CgroupError("No cgroup2 filesystem mounted");
+}
+
+static std::string strerr(const std::string &what)
+{
+    return what + ": " + std::strerror(errno);
+}
+
+// ------------------ Cgroup ------------------
+Cgroup::Cgroup(const std::string &path, const CgroupLimits &limits) :
+    dirfd(-1), procs(-1), use_clone3(true)
+{
+    std::string mount = cgroup2_mount();
+
+    if (path.compare(0, mount.size() + 1, mount + "/") == 0)
+        dir = path;
+    else if (!path.empty() && path[0] == '/')
+        dir = mount + path;
+    else
+        dir = mount + "/" + path;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+        throw CgroupError(strerr("mkdir " + dir));
+
+    // Controllers have to be enabled in the parent for the files to show up
+    std::string parent = dir.substr(0, dir.rfind('/'));
+    const char *controllers[][2] = {
+        {"memory", limits.memory_max.c_str()},
+        {"cpu", limits.cpu_max.c_str()},
+        {"pids", limits.pids_max.c_str()},
+        {"io", limits.io_max.c_str()},
+    };
+    for (auto &c : controllers)
+    {
+        std::ofstream f(parent + "/cgroup.subtree_control");
+        f << "+" << c[0];
+        f.close();
+        // Only the ones with limits are required, the rest are for statistics
+        if (!f && *c[1])
+            throw CgroupError("Can't enable the " + std::string(c[0]) + " controller in " + parent);
+    }
+
+    if (!limits.memory_max.empty())
+        write("memory.max", limits.memory_max);
+    if (!limits.cpu_max.empty())
+        write("cpu.max", limits.cpu_max);
+    if (!limits.pids_max.empty())
+        write("pids.max", limits.pids_max);
+    if (!limits.io_max.empty())
+        write("io.max", limits.io_max);
+
+    dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+        throw CgroupError(strerr("open " + dir));
+
+    procs = openat(dirfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (procs < 0)
+        throw CgroupError(strerr("open " + dir + "/cgroup.procs"));
+}
+
+Cgroup::~Cgroup()
+{
+    if (procs >= 0)
+        close(procs);
+    if (dirfd >= 0)
+        close(dirfd);
+
+    // Fails with EBUSY while handlers are still running
+    rmdir(dir.c_str());
+}
+
+void Cgroup::write(const std::string &file, const std::string &value)
+{
+    std::string path = dir + "/" + file;
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+
+    if (fd < 0 || ::write(fd, value.data(), value.size()) < 0)
+    {
+        std::string err = strerr("Writing '" + value + "' to " + path);
+        if (fd >= 0)
+            close(fd);
+        throw CgroupError(err);
+    }
+    close(fd);
+}
+
+std::string Cgroup::read(const std::string &file) const
+{
+    std::ifstream f(dir + "/" + file);
+    std::ostringstream os;
+    os << f.rdbuf();
+    return os.str();
+}
+
+pid_t Cgroup::fork()
+{
+    if (use_clone3)
+    {
+        clone_args args;
+        std::memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = static_cast<uint64_t>(dirfd);
+
+        // Unlike fork(), this skips glibc's atfork handling: locks held by
+        // other threads stay locked in the child, which may only make
+        // system calls until it execs
+        long pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid >= 0 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL))
+            return static_cast<pid_t>(pid);
+
+        // Remember that this kernel can't
+        use_clone3 = false;
+    }
+
+    pid_t pid = ::fork();
+    if (pid == 0 && ::write(procs, "0", 1) < 0)
+        _exit(126);
+    return pid;
+}
+
+void Cgroup::collect(std::ostream &os) const
+{
+    // Files of controllers that aren't enabled are missing
+    std::istringstream events(read("memory.events"));
+    std::string key;
+    uint64_t value;
+
+    if (events.rdbuf()->in_avail() > 0)
+        Metrics::family(os, "ncs_cgroup_memory_events_total", "counter", "memory.events of the handler cgroup");
+    while (events >> key >> value)
+        os << "ncs_cgroup_memory_events_total{event=\"" << key << "\"} " << value << "\n";
+
+    std::istringstream current(read("memory.current"));
+    if (current >> value)
+        Metrics::sample(os, "ncs_cgroup_memory_bytes", "gauge", "memory.current of the handler cgroup", value);
+
+    std::istringstream pids(read("pids.current"));
+    if (pids >> value)
+        Metrics::sample(os, "ncs_cgroup_pids", "gauge", "pids.current of the handler cgroup", value);
+
+    // usage_usec, user_usec, system_usec and with the cpu controller
+    // nr_periods, nr_throttled, throttled_usec
+    std::istringstream cpu(read("cpu.stat"));
+    if (cpu.rdbuf()->in_avail() > 0)
+        Metrics::family(os, "ncs_cgroup_cpu_stat_total", "counter", "cpu.stat of the handler cgroup");
+    while (cpu >> key >> value)
+        os << "ncs_cgroup_cpu_stat_total{stat=\"" << key << "\"} " << value << "\n";
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+/**
+ * @file cgroup.h
+ * @brief cgroup v2 subtree for a service's handlers
+ *
+ * The server creates the cgroup, enables the controllers its limits need
+ * in the parent and spawns every handler straight into it with
+ * clone3(CLONE_INTO_CGROUP), so there is no window in which a handler runs
+ * unconstrained. The parent must be delegated to the server's user and
+ * must not contain processes itself.
+ */
+
+/**
+ * @brief The CgroupError class
+ */
+class CgroupError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+// Values are written verbatim, see the kernel's cgroup-v2 documentation
+struct CgroupLimits
+{
+    std::string memory_max;     // e.g. 256M
+    std::string cpu_max;        // <quota> [<period>] in us
+    std::string pids_max;
+    std::string io_max;         // <major>:<minor> rbps=... wbps=...
+};
+
+class Cgroup
+{
+public:
+    /**
+     * @brief create or reuse a cgroup and apply limits
+     * @param path absolute or relative to the cgroup2 mount
+     * @throws CgroupError
+     */
+    Cgroup(const std::string &path, const CgroupLimits &limits);
+
+    /**
+     * Removes the cgroup if it is empty by now.
+     */
+    ~Cgroup();
+
+    Cgroup(const Cgroup &) = delete;
+    Cgroup &operator=(const Cgroup &) = delete;
+
+    const std::string &path() const { return dir; }
+
+    /**
+     * @brief fork() a child into the cgroup
+     * Uses clone3(CLONE_INTO_CGROUP). On kernels older than 5.7 it falls
+     * back to fork() and the child moves itself before returning.
+     * The child must stick to async-signal-safe calls until it execs.
+     * @return like fork()
+     */
+    pid_t fork();
+
+    /**
+     * @brief write memory, cpu and pids statistics as Prometheus samples
+     */
+    void collect(std::ostream &os) const;
+
+private:
+    std::string dir;
+    int dirfd;
+    int procs;      // cgroup.procs, for the fork() fallback
+    bool use_clone3;
+
+    void write(const std::string &file, const std::string &value);
+    std::string read(const std::string &file) const;
+};
@@ -0,0 +1,697 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <iterator>
+#include <regex>
+#include <sstream>
+
+#include "cgroup.h"
+#include "client.h"
+#include "env.h"
+#include "logcapture.h"
+#include "probes.h"
+#include "reactor.h"
+#include "relay.h"
+#include "system.h"
+#include "tcpinfo.h"
+#include "tls.h"
+#include "zygote.h"
+
+using namespace std;
+
+
+sigset_t child_sigmask;
+
+static std::string int2s(int i)
+{
+    std::ostringstream os;
+    os << i;
+    return os.str();
+}
+
+static uint64_t timespec2ns(const timespec &ts)
+{
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// -------------------------------------------------------------------
+// Accept a new client
+std::unique_ptr<Client> Client::accept(int fd, const Service &service)
+{
+    sockaddr_inet sa;
+    socklen_t sa_size = sizeof(sa);
+    std::memset(&sa, 0, sizeof(sa));
+    int sock = System::current().accept(fd, reinterpret_cast<sockaddr*>(&sa), &sa_size, SOCK_CLOEXEC);
+
+    if (sock < 0)
+        return nullptr;
+
+    // IPv4 clients of dual-stack sockets
+    unmap_v4(sa);
+
+    NCS_PROBE3(accept, sock, &sa, ntohs(sa.in.sin_port));
+
+    return std::unique_ptr<Client>(new Client(sock, sa, service));
+}
+
+// -------------------------------------------------------------------
+// Take a request in per-datagram mode
+std::unique_ptr<Client> Client::datagram(Reactor &reactor, DatagramSocket &sock, const DatagramSocket::Datagram &dg, const Service &service)
+{
+    // IPv4 clients of dual-stack sockets; the reply keeps the mapped
+    // address the socket needs
+    sockaddr_inet peer = dg.peer;
+    unmap_v4(peer);
+
+    // There is no socket of its own
+    std::unique_ptr<Client> client(new Client(-1, peer, service));
+    client->local = dg.local;
+    unmap_v4(client->local);
+
+    client->reply.reset(new DatagramReply(reactor, sock, dg));
+    if (!client->reply->open(dg.data, dg.size))
+        return nullptr;
+
+    return client;
+}
+
+Client::Client(int client_fd, const sockaddr_inet &client_peer, const Service &client_service) :
+    fd(client_fd), pid(-1), cpu(incoming_cpu(client_fd)), status_slot(-1), listener(-1), peer(client_peer), service(client_service)
+{
+    std::memset(&local, 0, sizeof(local));
+    System::current().clock_gettime(CLOCK_REALTIME, &accepted_real);
+    System::current().clock_gettime(CLOCK_MONOTONIC, &accepted_mono);
+    spawned_mono = reaped_mono = accepted_mono;
+}
+
+Client::~Client()
+{
+    // The relay refers to the socket
+    relay.reset();
+    tls.reset();
+    capture.reset();
+    reply.reset();
+    cached.reset();
+
+    if (fd >= 0)
+        System::current().close(fd);
+}
+
+// -------------------------------------------------------------------
+// Get the client's name (IP address) and port
+char *Client::peername()
+{
+    return ::peername(peer);
+}
+
+uint16_t Client::port()
+{
+    if (peer.family == AF_UNIX)
+        return 0;
+    return ntohs(peer.in.sin_port);
+}
+
+// -------------------------------------------------------------------
+// Get the credentials of a local peer
+bool Client::credentials(ucred &cred)
+{
+    socklen_t size = sizeof(cred);
+    return peer.family == AF_UNIX && fd >= 0 && getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == 0;
+}
+
+// -------------------------------------------------------------------
+// Start/Fork the client process
+int Client::start(Reactor &reactor)
+{
+    if (fd >= 0 && !service.socket_profile.empty())
+        service.socket_profile.apply(fd, peer);
+
+    auto idle = [this]() {
+        if (!this->busy() && this->on_idle)
+            this->on_idle();
+    };
+
+    if (tls)
+    {
+        tls->on_done = idle;
+        if (!tls->open())
+            return -1;
+    }
+
+    if (service.relay)
+    {
+        relay.reset(new Relay(reactor, stream_fd(), service.pass));
+        relay->on_done = idle;
+        if (!relay->open())
+            return -1;
+        if (service.cache && !cache_key.empty())
+            relay->record(service.cache->entry_max());
+    }
+
+    if (reply)
+        reply->on_done = idle;
+
+    if (service.log_sink)
+    {
+        capture.reset(new LogCapture(reactor, *service.log_sink));
+        capture->on_done = idle;
+        if (!capture->open())
+            return -1;
+    }
+
+    if (service.env)
+        service.env->prepare(*this);
+
+    NCS_PROBE2(spawn__begin, fd, &peer);
+
+    if ((pid = spawn()) != 0)
+    {
+        NCS_PROBE2(spawn__end, pid, fd);
+        System::current().clock_gettime(CLOCK_MONOTONIC, &spawned_mono);
+
+        if (pid < 0)
+            return pid;
+
+        arm_timers(reactor);
+
+        if (tls)
+            tls->start(!relay);
+        if (relay)
+            relay->start();
+        if (reply)
+            reply->start();
+        if (capture)
+        {
+            std::ostringstream tag;
+            tag << "\033[36m[\033[35m" << pid << " " << peername() << ":" << port() << "\033[36m]\033[0m ";
+            capture->start(tag.str());
+        }
+        return pid;
+    }
+
+    run();
+}
+
+void Client::exited()
+{
+    System::current().clock_gettime(CLOCK_MONOTONIC, &reaped_mono);
+
+    // The pid may be reused from now on
+    lifetime_timer.cancel();
+    idle_timer.cancel();
+    kill_timer.cancel();
+
+    if (relay)
+        relay->child_exited();
+}
+
+uint64_t Client::lifetime_ms()
+{
+    timespec t;
+    System::current().clock_gettime(CLOCK_MONOTONIC, &t);
+    return (timespec2ns(t) - timespec2ns(accepted_mono)) / 1000000;
+}
+
+int Client::stream_fd() const
+{
+    return tls ? tls->child_fd() : fd;
+}
+
+bool Client::busy()
+{
+    return (relay && !relay->done()) || (reply && !reply->done()) || (cached && !cached->done()) ||
+           (tls && !tls->done()) || (capture && !capture->done());
+}
+
+// -------------------------------------------------------------------
+// Handle the Client process argv
+// NOTE: Memory leaks aren't a problem because we'll be exec()ing soon anyway
+template <typename T>
+std::string Client::ref_var(const T &var)
+{
+    // This is where the variables are defined.
+    if (var[1] == "h") // Peer hostname
+        return peername();
+    if (var[1] == "H") // Peer name, the address if it has none
+        return hostname.empty() ? std::string(peername()) : hostname;
+    if (var[1] == "p") // Peer port
+        return int2s(port());
+    if (var[1] == "i") // PID; a zygote's spare is known before it's running
+        return int2s(pid > 0 ? pid : getpid());
+    if (var[1] == "t") // Connection time
+    {
+        // We pretend now == connection time^^
+        std::time_t t(std::time(NULL));
+        return std::ctime(&t);
+    }
+    if (var[1] == "l" || var[1] == "P") // Local address and port
+    {
+        sockaddr_inet addr = local;
+        socklen_t size = sizeof(addr);
+        if (fd >= 0 && getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &size) == 0)
+            unmap_v4(addr);
+        if (addr.family != AF_INET && addr.family != AF_INET6 && addr.family != AF_UNIX)
+            return std::string();
+        if (var[1] == "l")
+            return ::peername(addr);
+        return addr.family == AF_UNIX ? std::string() : int2s(ntohs(addr.in.sin_port));
+    }
+    if (var[1] == "I" || var[1] == "U" || var[1] == "G") // Local peer's pid, uid and gid
+    {
+        // Empty unless the peer came through a UNIX socket
+        ucred cred;
+        if (!credentials(cred))
+            return std::string();
+        if (var[1] == "I")
+            return int2s(cred.pid);
+        return std::to_string(var[1] == "U" ? cred.uid : cred.gid);
+    }
+    return var.str();
+}
+
+char *Client::regex_replace_var(const std::string &str)
+{
+    static std::regex re("\\%([^\\%])");
+
+    auto i = std::sregex_iterator(str.begin(), str.end(), re);
+    auto i_end = decltype(i)();
+    auto last_i = i;
+
+    if (i == i_end)
+        return const_cast<char*>(str.c_str());
+
+    std::string res;
+    for (; i != i_end; ++i)
+    {
+        res.reserve(res.size() + i->prefix().length());
+        std::copy(i->prefix().first, i->prefix().second, std::back_inserter(res));
+        res += ref_var(*i);
+        last_i = i;
+    }
+    res.reserve(res.size() + last_i->suffix().length());
+    std::copy(last_i->suffix().first, last_i->suffix().second, std::back_inserter(res));
+
+    char *ret = new char[res.size() + 1];
+    std::strncpy(ret, res.c_str(), res.size() + 1);
+    return ret;
+}
+
+void Client::prepare_argv()
+{
+    const std::vector<std::string> &exec_argv = service.exec_argv;
+
+    argv.reserve(exec_argv.size() + 1);
+    std::transform(exec_argv.begin(), exec_argv.end(), std::back_inserter(argv),
+                   [this](const std::string &str){return this->regex_replace_var(str);}
+                   );
+    argv.push_back(NULL);
+}
+
+// -------------------------------------------------------------------
+// Enforce the service's lifetime and idle limits
+void Client::arm_timers(Reactor &reactor)
+{
+    if (service.max_lifetime_ms)
+    {
+        lifetime_timer.callback = [this, &reactor]() {
+            this->terminate(reactor, "lifetime exceeded");
+        };
+        reactor.timers().arm(lifetime_timer, reactor.now_ms(), service.max_lifetime_ms);
+    }
+
+    if (service.idle_timeout_ms)
+    {
+        // Only look at the connection when the timeout could have passed,
+        // then sleep for whatever is left of it
+        idle_timer.callback = [this, &reactor]() {
+            uint64_t idle = this->idle_ms(reactor);
+            if (idle >= this->service.idle_timeout_ms)
+                this->terminate(reactor, "idle timeout");
+            else
+                reactor.timers().arm(this->idle_timer, reactor.now_ms(), this->service.idle_timeout_ms - idle);
+        };
+        reactor.timers().arm(idle_timer, reactor.now_ms(), service.idle_timeout_ms);
+    }
+}
+
+uint64_t Client::idle_ms(Reactor &reactor)
+{
+    if (relay)
+        return reactor.now_ms() - relay->last_active_ms;
+
+    TcpStats st;
+    if (fd >= 0 && tcp_stats(fd, st))
+        return std::min(st.last_data_recv_ms, st.last_data_sent_ms);
+
+    return 0;
+}
+
+void Client::terminate(Reactor &reactor, const char *reason)
+{
+    if (kill_timer.armed())
+        return;
+
+    cerr << "\033[31mTerminating \033[35m" << peername() << "\033[31m [\033[35m" << pid
+         << "\033[31m]: " << reason << "\033[0m" << endl;
+
+    lifetime_timer.cancel();
+    idle_timer.cancel();
+    System::current().kill(pid, SIGTERM);
+
+    kill_timer.callback = [this]() {
+        cerr << "\033[31mKilling [\033[35m" << this->pid << "\033[31m]\033[0m" << endl;
+        System::current().kill(this->pid, SIGKILL);
+    };
+    reactor.timers().arm(kill_timer, reactor.now_ms(), service.kill_grace_ms);
+}
+
+// -------------------------------------------------------------------
+// Describe the finished connection for the trace
+Trace::Record Client::trace_record(int status)
+{
+    Trace::Record r;
+    std::memset(&r, 0, sizeof(r));
+
+    timespec t;
+    System::current().clock_gettime(CLOCK_MONOTONIC, &t);
+
+    r.accepted_ns = timespec2ns(accepted_real);
+    r.duration_ns = timespec2ns(t) - timespec2ns(accepted_mono);
+    r.status = status;
+    r.family = peer.family;
+    r.port = port();
+    if (peer.family == AF_INET6)
+        std::memcpy(r.addr, &peer.in6.sin6_addr, 16);
+    else if (peer.family == AF_INET)
+        std::memcpy(r.addr, &peer.in.sin_addr, 4);
+
+    TcpStats st;
+    if (relay)
+    {
+        r.bytes_in = relay->bytes_in;
+        r.bytes_out = relay->bytes_out;
+    }
+    else if (reply)
+    {
+        r.bytes_in = reply->bytes_in;
+        r.bytes_out = reply->bytes_out;
+    }
+    else if (cached)
+    {
+        r.bytes_in = cached->bytes_in;
+        r.bytes_out = cached->bytes_out;
+    }
+    else if (fd >= 0 && tcp_stats(fd, st))
+    {
+        r.bytes_in = st.bytes_received;
+        r.bytes_out = st.bytes_acked;
+    }
+    return r;
+}
+
+// -------------------------------------------------------------------
+// Where the handler's stdin, stdout and stderr come from
+void Client::stdio(int (&fds)[3])
+{
+    int pass = service.pass;
+    int in = stream_fd(), out = in;
+    if (relay)
+    {
+        in = relay->child_stdin();
+        out = relay->child_stdout();
+    }
+    else if (reply)
+    {
+        in = reply->child_stdin();
+        out = reply->child_stdout();
+    }
+
+    fds[0] = pass & PASS_IN ? in : -1;
+    fds[1] = pass & PASS_OUT ? out : -1;
+    if (pass & PASS_ERR)
+        fds[2] = out;
+    else if (capture)
+        fds[2] = capture->child_stderr();
+    else
+        fds[2] = -1;
+}
+
+// -------------------------------------------------------------------
+// Handlers started straight from clone3(), which skips glibc's fork
+// handling: locks other threads held at the time (malloc's, stdio's)
+// stay locked in the child, so it may only make system calls. The
+// parent prepares everything; only %i is left, to a field of zeros the
+// child writes its pid into.
+static const size_t pid_width = 10;
+
+struct RawExec
+{
+    std::vector<std::string> args;
+    std::vector<std::vector<size_t>> pid_at;    // offsets of the %i fields in args
+    std::vector<char*> argv;
+    char **envp;
+    int stdio[3];
+    bool pin;
+    cpu_set_t cpus;
+};
+
+// Async-signal-safe
+static size_t format_int(long value, char (&digits)[24])
+{
+    char tmp[24];
+    size_t n = 0;
+    bool negative = value < 0;
+    unsigned long v = negative ? -static_cast<unsigned long>(value) : static_cast<unsigned long>(value);
+    do
+        tmp[n++] = static_cast<char>('0' + v % 10);
+    while (v /= 10);
+    if (negative)
+        tmp[n++] = '-';
+    for (size_t i = 0; i < n; ++i)
+        digits[i] = tmp[n - 1 - i];
+    return n;
+}
+
+// Put pid into the %i fields of a NUL terminated arg and close the gaps.
+// Async-signal-safe
+static void fill_pid(char *arg, size_t len, const std::vector<size_t> &at, pid_t pid)
+{
+    char digits[24];
+    size_t n = format_int(pid, digits);
+    size_t shift = 0;
+
+    for (size_t offset : at)
+    {
+        size_t pos = offset - shift;
+        std::memcpy(arg + pos, digits, n);
+        std::memmove(arg + pos + n, arg + pos + pid_width, len + 1 - (pos + pid_width));
+        len -= pid_width - n;
+        shift += pid_width - n;
+    }
+}
+
+static void __attribute__((noreturn)) raw_exec(RawExec &x, const ChildSched &sched)
+{
+    sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+
+    pid_t self = static_cast<pid_t>(syscall(SYS_getpid));
+    for (size_t i = 0; i < x.args.size(); ++i)
+        if (!x.pid_at[i].empty())
+            fill_pid(x.argv[i], x.args[i].size(), x.pid_at[i], self);
+
+    if (x.pin)
+        sched_setaffinity(0, sizeof(x.cpus), &x.cpus);
+
+    static const char sched_error[] = "\033[31mError: scheduling failed\033[0m\n";
+    if (!sched.apply() && write(2, sched_error, sizeof(sched_error) - 1) < 0) {}
+
+    dup2(2, 200);
+    fcntl(200, F_SETFD, FD_CLOEXEC);
+
+    for (int i = 0; i < 3; ++i)
+        if (x.stdio[i] >= 0)
+            dup2(x.stdio[i], i);
+
+    NCS_PROBE2(exec, self, x.argv[0]);
+    execvpe(x.argv[0], x.argv.data(), x.envp);
+
+    // restore stderr
+    char digits[24];
+    size_t n = format_int(errno, digits);
+    static const char exec_error[] = "\033[31mError: exec failed, errno ";
+    dup2(200, 2);
+    if (write(2, exec_error, sizeof(exec_error) - 1) < 0 || write(2, digits, n) < 0 || write(2, "\033[0m\n", 5) < 0) {}
+
+    _exit(1);
+}
+
+pid_t Client::spawn_raw()
+{
+    RawExec x;
+
+    // %i is split out so the rest can be expanded here
+    for (const std::string &arg : service.exec_argv)
+    {
+        std::string expanded;
+        std::vector<size_t> at;
+        size_t begin = 0, end;
+        do
+        {
+            end = arg.find("%i", begin);
+            std::string part = arg.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+            char *replaced = regex_replace_var(part);
+            expanded += replaced;
+            if (replaced != part.c_str())
+                delete[] replaced;
+            if (end != std::string::npos)
+            {
+                at.push_back(expanded.size());
+                expanded.append(pid_width, '0');
+                begin = end + 2;
+            }
+        }
+        while (end != std::string::npos);
+
+        x.args.push_back(expanded);
+        x.pid_at.push_back(at);
+    }
+    for (std::string &arg : x.args)
+        x.argv.push_back(&arg[0]);
+    x.argv.push_back(nullptr);
+
+    x.envp = service.env ? service.env->envp() : environ;
+    stdio(x.stdio);
+    x.pin = service.placement.cpuset_for(cpu, x.cpus);
+
+    pid_t child = service.cgroup->fork();
+    if (child == 0)
+        raw_exec(x, service.child_sched);
+    if (child < 0)
+        return child;
+
+    // What Client::run() logs in the child
+    cerr << "\033[36m[\033[35m" << child << "\033[36m] Calling: \033[35m";
+    for (size_t i = 0; i < x.args.size(); ++i)
+    {
+        if (!x.pid_at[i].empty())
+            fill_pid(x.argv[i], x.args[i].size(), x.pid_at[i], child);
+        cerr << (i ? " " : "") << x.argv[i];
+    }
+    cerr << "\033[0m" << endl;
+    return child;
+}
+
+// -------------------------------------------------------------------
+// Fork the handler, or hand it to a zygote
+pid_t Client::spawn()
+{
+    if (service.cgroup)
+        return spawn_raw();
+    if (!service.zygote || !service.zygote->available())
+        return System::current().spawn(fd);
+
+    // The spare decides %i, so it's picked first
+    pid = service.zygote->reserve();
+    if (pid < 0)
+        return System::current().spawn(fd);
+
+    Zygote::Request request;
+    for (const std::string &arg : service.exec_argv)
+    {
+        char *expanded = regex_replace_var(arg);
+        request.argv.push_back(expanded);
+        if (expanded != arg.c_str())
+            delete[] expanded;
+    }
+    request.envp = service.env ? service.env->envp() : environ;
+    stdio(request.stdio);
+    request.pin = service.placement.cpuset_for(cpu, request.cpus);
+    request.sched = service.child_sched;
+    request.sigmask = child_sigmask;
+
+    pid_t spawned = service.zygote->spawn(request);
+    if (spawned < 0)
+        // e.g. a request too large for the zygote's socket
+        return System::current().spawn(fd);
+    return spawned;
+}
+
+// -------------------------------------------------------------------
+// Execute the client process
+void __attribute__((noreturn)) Client::run()
+{
+    sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+
+    prepare_argv();
+
+    cpu_set_t cpus;
+    if (service.placement.cpuset_for(cpu, cpus))
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    if (!service.child_sched.apply())
+    {
+        cerr << "\033[31mError: ";
+        perror("scheduling");
+        cerr << "\033[0m";
+    }
+
+    cerr << "\033[36m[\033[35m" << getpid() << "\033[36m] Calling: \033[35m";
+    cerr << argv[0];
+    for (size_t i=1; i<argv.size()-1; ++i)
+        cerr << " " << argv[i];
+    cerr << "\033[0m" << endl;
+
+    dup2(2, 200);
+    fcntl(200, F_SETFD, FD_CLOEXEC);
+
+    int fds[3];
+    stdio(fds);
+    for (int i = 0; i < 3; ++i)
+        if (fds[i] >= 0)
+            dup2(fds[i], i);
+
+    NCS_PROBE2(exec, getpid(), argv[0]);
+    execvpe(argv[0], argv.data(), service.env ? service.env->envp() : environ);
+
+    // restore stderr
+    dup2(200, 2);
+
+    cerr << "\033[31mError: ";
+    perror("exec");
+    cerr << "\033[0m";
+
+    exit(1);
+}
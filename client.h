@@ -0,0 +1,193 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <signal.h>
+
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "affinity.h"
+#include "cache.h"
+#include "dgram.h"
+#include "scheduling.h"
+#include "shaping.h"
+#include "sockaddr.h"
+#include "timerwheel.h"
+#include "trace.h"
+
+/**
+ * @file client.h
+ * @brief client connections and their handler processes
+ */
+
+#define PASS_IN 1
+#define PASS_OUT 2
+#define PASS_ERR 4
+
+class Cgroup;
+class Environment;
+class Reactor;
+class Relay;
+class LogSink;
+class LogCapture;
+class TlsSession;
+class Zygote;
+
+// Configuration shared by all clients of a service
+struct Service
+{
+    std::vector<std::string> exec_argv;
+    int pass;
+    bool relay;
+    LogSink *log_sink;      // capture handler stderr into this, if set
+    Cgroup *cgroup;         // spawn handlers into this, if set
+    Zygote *zygote;         // spawn handlers through these, if set
+    ResponseCache *cache;   // answer repeated requests from this, if set
+    Environment *env;       // of the handlers, the server's own if not set
+    SocketProfile socket_profile;
+    CpuPlacement placement;
+    ChildSched child_sched;
+    uint64_t max_lifetime_ms;   // 0 for no limit
+    uint64_t idle_timeout_ms;   // 0 for no limit
+    uint64_t kill_grace_ms;     // between SIGTERM and SIGKILL
+};
+
+// The signal mask children should start out with
+extern sigset_t child_sigmask;
+
+// Represents a Client process
+struct Client
+{
+    // Members
+    int fd;
+    int pid;
+    int cpu;                // that received the connection, -1 if unknown
+    int status_slot;        // in the status file, -1 if not listed
+    int listener;           // the datagram socket the handler owns in wait mode, -1 if none
+    sockaddr_inet peer;
+    sockaddr_inet local;    // the datagram was sent to, AF_UNSPEC if unknown or fd is a socket
+    const Service &service;
+    std::vector<char*> argv;
+    timespec accepted_real;
+    timespec accepted_mono;
+    timespec spawned_mono;
+    timespec reaped_mono;
+    std::unique_ptr<Relay> relay;
+    std::unique_ptr<LogCapture> capture;
+    std::unique_ptr<DatagramReply> reply;
+    std::unique_ptr<CachedReply> cached;
+    std::unique_ptr<TlsSession> tls;    // relaying TLS in userspace, without kernel offload
+    std::string cache_key;  // the request whose response the handler produces, if any
+    std::string hostname;   // of the peer, empty if unknown or not looked up
+    Timer resolve_timer;    // for the reverse DNS lookup
+    Timer handshake_timer;  // for the TLS handshake
+    Timer request_timer;    // for reading the request of a cached service
+    Timer lifetime_timer;
+    Timer idle_timer;
+    Timer kill_timer;
+
+    // Called when the relay, replies and stderr capture are all finished
+    std::function<void()> on_idle;
+
+    // -------------------------------------------------------------------
+    // Accept a new client
+    static std::unique_ptr<Client> accept(int fd, const Service &service);
+
+    // -------------------------------------------------------------------
+    // Take a request in per-datagram mode; the handler's output is the reply
+    static std::unique_ptr<Client> datagram(Reactor &reactor, DatagramSocket &sock, const DatagramSocket::Datagram &dg, const Service &service);
+
+    Client(int client_fd, const sockaddr_inet &client_peer, const Service &client_service);
+    ~Client();
+
+    // -------------------------------------------------------------------
+    // Get the client's name (IP address) and port
+    char *peername();
+    uint16_t port();
+
+    // -------------------------------------------------------------------
+    // Get the credentials of a local peer
+    bool credentials(ucred &cred);
+
+    // -------------------------------------------------------------------
+    // Start/Fork the client process
+    int start(Reactor &reactor);
+
+    // -------------------------------------------------------------------
+    // The client process was reaped
+    void exited();
+
+    // -------------------------------------------------------------------
+    // Time since the connection was accepted
+    uint64_t lifetime_ms();
+
+    // -------------------------------------------------------------------
+    // The socket the handler talks through: the connection, or the
+    // plaintext end of a userspace TLS relay
+    int stream_fd() const;
+
+    // -------------------------------------------------------------------
+    // Whether the relay, replies, TLS or stderr capture still have work to do
+    bool busy();
+
+    // -------------------------------------------------------------------
+    // Describe the finished connection for the trace
+    Trace::Record trace_record(int status);
+
+private:
+    // -------------------------------------------------------------------
+    // Handle the Client process argv
+    template <typename T>
+    std::string ref_var(const T &var);
+    char *regex_replace_var(const std::string &str);
+    void prepare_argv();
+
+    // -------------------------------------------------------------------
+    // Enforce the service's lifetime and idle limits
+    void arm_timers(Reactor &reactor);
+    uint64_t idle_ms(Reactor &reactor);
+    void terminate(Reactor &reactor, const char *reason);
+
+    // -------------------------------------------------------------------
+    // Where the handler's stdin, stdout and stderr come from, -1 to inherit
+    void stdio(int (&fds)[3]);
+
+    // -------------------------------------------------------------------
+    // fork(), or have a zygote start the handler; 0 in the child
+    pid_t spawn();
+
+    // -------------------------------------------------------------------
+    // Start the handler in the cgroup; the child never returns
+    pid_t spawn_raw();
+
+    // -------------------------------------------------------------------
+    // Execute the client process
+    void __attribute__((noreturn)) run();
+};
@@ -22,6 +22,7 @@
 #include "cmdparser.h"
 #include "cmdparser_p.h"
 
+#include <algorithm>
 #include <sstream>
 #include <iterator>
 #include <deque>
@@ -61,11 +62,18 @@ Variant::Variant(long number) :
 {
 }
 
+Variant::Variant(const StringList &list) :
+    type(list_t), list_u(list)
+{
+}
+
 Variant::Variant(const Variant &v) :
     type(v.type)
 {
     if (isString())
         string_u = v.string_u;
+    else if (isList())
+        list_u = v.list_u;
     else if (isBool())
         boolean_u = v.boolean_u;
     else if (isNumber())
@@ -77,6 +85,8 @@ Variant::Variant(Variant &&v) :
 {
     if (isString())
         string_u = std::move(v.string_u);
+    else if (isList())
+        list_u = std::move(v.list_u);
     else if (isBool())
         boolean_u = std::move(v.boolean_u);
     else if (isNumber())
@@ -93,6 +103,8 @@ Variant &Variant::operator=(const Variant &v)
     type = v.type;
     if (isString())
         string_u = v.string_u;
+    else if (isList())
+        list_u = v.list_u;
     else if (isBool())
         boolean_u = v.boolean_u;
     else if (isNumber())
@@ -106,6 +118,8 @@ Variant &Variant::operator=(Variant &&v)
 
     if (isString())
         string_u = std::move(v.string_u);
+    else if (isList())
+        list_u = std::move(v.list_u);
     else if (isBool())
         boolean_u = std::move(v.boolean_u);
     else if (isNumber())
@@ -139,6 +153,11 @@ bool Variant::isNumber()
     return type == number_t;
 }
 
+bool Variant::isList()
+{
+    return type == list_t;
+}
+
 bool Variant::toBool()
 {
     if (isBool())
@@ -147,6 +166,8 @@ bool Variant::toBool()
         return string_u.empty();
     else if (isNumber())
         return number_u != 0;
+    else if (isList())
+        return !list_u.empty();
     else if (isVoid())
         return false;
 }
@@ -163,6 +184,9 @@ String Variant::toString()
         s << number_u;
         return s.str();
     }
+    else if (isList())
+        // The last one wins, like for options that aren't repeatable
+        return list_u.empty() ? String() : list_u.back();
     else if (isVoid())
         return "";
 }
@@ -180,10 +204,32 @@ long Variant::toNumber()
         s >> value;
         return value;
     }
+    else if (isList())
+        return Variant(toString()).toNumber();
     else if (isVoid())
         return -1;
 }
 
+void Variant::append(const String &value)
+{
+    if (!isList())
+    {
+        list_u = toList();
+        type = list_t;
+    }
+    list_u.push_back(value);
+}
+
+StringList Variant::toList()
+{
+    if (isList())
+        return list_u;
+    else if (isVoid())
+        return StringList();
+    else
+        return StringList(1, toString());
+}
+
 
 // ------------------ commandline splitter ------------------
 StringList splitArgs(const String &args)
@@ -254,6 +300,7 @@ ParameterDefinition *ParserPrivate::addDefinition(DefinitionType type, const Str
 	param->meta = type == DefinitionType::Positional ? name : "<" + name + ">";
 	param->defaultValue = def;
 	param->terminal = false;
+	param->repeatable = false;
 
 	m_definitions.push_back(param);
 	m_nameLookup.insert(std::make_pair(name, param));
@@ -323,6 +370,22 @@ static std::string str_join(const T& elements, const char* const separator)
 }
 
 // Parsing
+void ParserPrivate::store(ArgumentMap &map, ParameterDefinition *param, const String &value, const String &prefix)
+{
+	auto it = map.find(param->name);
+
+	if (!param->repeatable)
+	{
+		if (it != map.end())
+			throw ParsingError("Option " + prefix + param->name + " was given multiple times");
+		map.insert(std::make_pair(param->name, Variant(value)));
+	}
+	else if (it == map.end())
+		map.insert(std::make_pair(param->name, Variant(StringList(1, value))));
+	else
+		it->second.append(value);
+}
+
 ArgumentMap ParserPrivate::parse(const StringList &argv)
 {
 	ArgumentMap map;
@@ -348,10 +411,7 @@ ArgumentMap ParserPrivate::parse(const StringList &argv)
 		{
 			String name = expecting.front();
 
-			if (map.find(name) != map.end())
-				throw ParsingError("Option " + optionPrefix + name + " was given multiple times");
-
-			map.insert(std::make_pair(name, Variant(arg)));
+			store(map, m_nameLookup[name], arg, optionPrefix);
 
 			expecting.pop_front();
 			continue;
@@ -378,7 +438,7 @@ ArgumentMap ParserPrivate::parse(const StringList &argv)
 			{
 				ParameterDefinition *param = m_longLookup[name];
 
-				if (map.find(param->name) != map.end())
+				if (!param->repeatable && map.find(param->name) != map.end())
 					throw ParsingError("Option " + optionPrefix + param->name + " was given multiple times");
 
 				if (param->type == DefinitionType::Switch)
@@ -388,7 +448,7 @@ ArgumentMap ParserPrivate::parse(const StringList &argv)
 					if (m_argStyle == ArgumentStyle::Space)
 						expecting.push_back(param->name);
 					else if (!equals.empty())
-						map.insert(std::make_pair(param->name, equals));
+						store(map, param, equals, optionPrefix);
 					else if (m_argStyle == ArgumentStyle::SpaceAndEquals)
 						expecting.push_back(param->name);
 					else
@@ -435,7 +495,7 @@ ArgumentMap ParserPrivate::parse(const StringList &argv)
 
 				ParameterDefinition *param = m_flagLookup[flag];
 
-				if (map.find(param->name) != map.end())
+				if (!param->repeatable && map.find(param->name) != map.end())
 					throw ParsingError("Option " + optionPrefix + param->name + " was given multiple times");
 
 				if (param->type == DefinitionType::Switch)
@@ -446,7 +506,7 @@ ArgumentMap ParserPrivate::parse(const StringList &argv)
 						expecting.push_back(param->name);
 					else if (!equals.empty())
 						if (i == flags.size() - 1)
-							map.insert(std::make_pair(param->name, equals));
+							store(map, param, equals, optionPrefix);
 						else
 							throw ParsingError("Flag " + flagPrefix + flag + " of Argument-requiring Option "
 													    + param->name + " not last flag in " + flagPrefix + flags);
@@ -578,6 +638,12 @@ void Parser::setTerminal(const String &name)
     param->terminal = true;
 }
 
+void Parser::setRepeatable(const String &name)
+{
+	ParameterDefinition *param = d_ptr->lookup(name);
+	param->repeatable = true;
+}
+
 // ---------- Generating Help messages ----------
 String Parser::compileHelp(const String &progName, int helpIndent, bool useFlags)
 {
@@ -592,7 +658,7 @@ String Parser::compileHelp(const String &progName, int helpIndent, bool useFlags
 		for (ParameterDefinition *param : d_ptr->m_positionals)
 		{
 			help << "  " << param->meta;
-			help << " " << String(helpIndent - param->meta.size() - 1, ' ');
+			help << " " << String(std::max<int>(0, helpIndent - param->meta.size() - 1), ' ');
 			help << param->desc << "\r\n";
 		}
 	}
@@ -631,7 +697,8 @@ String Parser::compileHelp(const String &progName, int helpIndent, bool useFlags
 				help << arg;
 			}
 
-			help << " " << String(helpIndent - nameLength - 1, ' ');
+			// Names longer than the indent just get the one space
+			help << " " << String(std::max(0, helpIndent - nameLength - 1), ' ');
 			help << param->desc << "\r\n";
 		}
 	}
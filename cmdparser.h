@@ -94,7 +94,8 @@ class Variant
         required_t,
         boolean_t,
         number_t,
-        string_t
+        string_t,
+        list_t
     };
 
     Type type;
@@ -105,6 +106,7 @@ class Variant
     };
 
     String string_u;
+    StringList list_u;
 
     explicit Variant(Type tp);
 
@@ -116,6 +118,7 @@ public:
     Variant(bool boolean);
     Variant(const String &str);
     Variant(long number);
+    Variant(const StringList &list);
 
     Variant(const Variant &v);
     Variant(Variant &&v);
@@ -129,11 +132,16 @@ public:
     bool isBool();
     bool isString();
     bool isNumber();
+    bool isList();
 
     // Get
     bool toBool();
     String toString();
     long toNumber();
+    StringList toList();
+
+    // Modify
+    void append(const String &value);
 };
 
 // ------------------ Exception class ------------------
@@ -249,6 +257,13 @@ public:
      */
 	void setTerminal(const String &name);
 
+	/**
+	 * @brief allow an option to be given more than once
+	 * @param name the (existing) parameter name
+	 * The values are collected into a list, see Variant::toList.
+	 */
+	void setRepeatable(const String &name);
+
 	// ---------- Generating Help messages ----------
 	/**
 	 * @brief generate a help message
@@ -45,6 +45,7 @@ struct ParameterDefinition
     String desc;
 
     bool terminal;
+    bool repeatable;
 
     Variant defaultValue;
 };
@@ -76,6 +77,8 @@ class ParserPrivate
 
     void getPrefix(String &opt, String &flag);
 
+    void store(ArgumentMap &map, ParameterDefinition *param, const String &value, const String &prefix);
+
     ArgumentMap parse(const StringList &argv);
 
     void clear();
@@ -0,0 +1,374 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "dgram.h"
+#include "reactor.h"
+
+// Room for the UDP_GRO and packet info control messages of a buffer
+static const size_t control_size = CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(in6_pktinfo));
+
+// Room for the source address of a reply
+static const size_t pktinfo_size = CMSG_SPACE(sizeof(in6_pktinfo));
+
+// A GRO buffer holds up to 64k of coalesced datagrams
+static const size_t buffer_size = 65536;
+
+// The recvmmsg() buffers, shared by all sockets since receive() is done
+// with them by the time it returns. Per socket they'd be megabytes for
+// every port of a range.
+struct ReceiveBatch
+{
+    std::vector<char> buffers;
+    std::vector<char> controls;
+    std::vector<sockaddr_inet> addrs;
+    std::vector<iovec> iovecs;
+    std::vector<mmsghdr> msgs;
+
+    explicit ReceiveBatch(size_t size) :
+        buffers(size * buffer_size), controls(size * control_size), addrs(size), iovecs(size), msgs(size)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            iovecs[i].iov_base = &buffers[i * buffer_size];
+            iovecs[i].iov_len = buffer_size;
+        }
+    }
+};
+
+// Allocated with the first receive(), not for servers without datagrams
+static ReceiveBatch &receive_batch(size_t size)
+{
+    static ReceiveBatch shared(size);
+    return shared;
+}
+
+// The address a datagram was sent to, from IP_PKTINFO or IPV6_PKTINFO,
+// and the port the socket is bound to
+static void read_pktinfo(msghdr &hdr, in_port_t port, sockaddr_inet &local)
+{
+    std::memset(&local, 0, sizeof(local));
+    for (cmsghdr *c = CMSG_FIRSTHDR(&hdr); c; c = CMSG_NXTHDR(&hdr, c))
+    {
+        if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO)
+        {
+            in_pktinfo info;
+            std::memcpy(&info, CMSG_DATA(c), sizeof(info));
+            local.in.sin_family = AF_INET;
+            local.in.sin_port = port;
+            local.in.sin_addr = info.ipi_addr;
+        }
+        else if (c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_PKTINFO)
+        {
+            in6_pktinfo info;
+            std::memcpy(&info, CMSG_DATA(c), sizeof(info));
+            local.in6.sin6_family = AF_INET6;
+            local.in6.sin6_port = port;
+            local.in6.sin6_addr = info.ipi6_addr;
+            // Only link-local addresses need the interface to be routed
+            if (IN6_IS_ADDR_LINKLOCAL(&info.ipi6_addr))
+                local.in6.sin6_scope_id = info.ipi6_ifindex;
+        }
+    }
+}
+
+// Send from local: the address goes into a packet info control message
+static size_t write_pktinfo(const sockaddr_inet &local, char *control)
+{
+    std::memset(control, 0, pktinfo_size);
+    cmsghdr *c = reinterpret_cast<cmsghdr*>(control);
+
+    if (local.family == AF_INET)
+    {
+        in_pktinfo info = in_pktinfo();
+        info.ipi_spec_dst = local.in.sin_addr;
+        c->cmsg_level = IPPROTO_IP;
+        c->cmsg_type = IP_PKTINFO;
+        c->cmsg_len = CMSG_LEN(sizeof(info));
+        std::memcpy(CMSG_DATA(c), &info, sizeof(info));
+        return CMSG_SPACE(sizeof(info));
+    }
+    if (local.family == AF_INET6)
+    {
+        // IPv4 requests to a dual-stack socket come with a mapped address,
+        // which works here just as well
+        in6_pktinfo info = in6_pktinfo();
+        info.ipi6_addr = local.in6.sin6_addr;
+        info.ipi6_ifindex = local.in6.sin6_scope_id;
+        c->cmsg_level = IPPROTO_IPV6;
+        c->cmsg_type = IPV6_PKTINFO;
+        c->cmsg_len = CMSG_LEN(sizeof(info));
+        std::memcpy(CMSG_DATA(c), &info, sizeof(info));
+        return CMSG_SPACE(sizeof(info));
+    }
+    return 0;
+}
+
+static void close_fd(int &fd)
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
+// -------------------------------------------------------------------
+// Shared socket
+DatagramSocket::DatagramSocket(Reactor &socket_reactor, int socket_fd) :
+    received(0), sent(0), dropped(0), reactor(socket_reactor), sock(socket_fd), port(0), gro(false),
+    flush_posted(false)
+{
+    // Without this, replies on a wildcard bind leave from whatever
+    // address the route to the peer prefers
+    sockaddr_inet addr;
+    socklen_t size = sizeof(addr);
+    int one = 1;
+    bool bound = getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &size) == 0;
+    if (bound)
+        port = addr.family == AF_INET6 ? addr.in6.sin6_port : addr.in.sin_port;
+    if (bound && addr.family == AF_INET6)
+        setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+    else
+        setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one));
+}
+
+bool DatagramSocket::enable_gro()
+{
+    int one = 1;
+    if (setsockopt(sock, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+        return false;
+    gro = true;
+    return true;
+}
+
+const std::vector<DatagramSocket::Datagram> &DatagramSocket::receive(size_t max)
+{
+    datagrams.clear();
+
+    ReceiveBatch &b = receive_batch(batch);
+    std::vector<char> &buffers = b.buffers;
+    std::vector<sockaddr_inet> &addrs = b.addrs;
+    std::vector<mmsghdr> &msgs = b.msgs;
+
+    size_t n = std::min(max, batch);
+    for (size_t i = 0; i < n; ++i)
+    {
+        msghdr &hdr = msgs[i].msg_hdr;
+        hdr.msg_name = &addrs[i];
+        hdr.msg_namelen = sizeof(addrs[i]);
+        hdr.msg_iov = &b.iovecs[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = &b.controls[i * control_size];
+        hdr.msg_controllen = control_size;
+        hdr.msg_flags = 0;
+    }
+
+    int got;
+    do
+        got = recvmmsg(sock, msgs.data(), static_cast<unsigned>(n), MSG_DONTWAIT, NULL);
+    while (got < 0 && errno == EINTR);
+
+    for (int i = 0; i < got; ++i)
+    {
+        const char *data = &buffers[i * buffer_size];
+        size_t size = msgs[i].msg_len;
+
+        sockaddr_inet local;
+        read_pktinfo(msgs[i].msg_hdr, port, local);
+
+        // A coalesced buffer is a train of segment sized datagrams,
+        // the last one possibly shorter
+        size_t segment = size;
+        if (gro)
+            for (cmsghdr *c = CMSG_FIRSTHDR(&msgs[i].msg_hdr); c; c = CMSG_NXTHDR(&msgs[i].msg_hdr, c))
+                if (c->cmsg_level == IPPROTO_UDP && c->cmsg_type == UDP_GRO)
+                    segment = static_cast<size_t>(*reinterpret_cast<int*>(CMSG_DATA(c)));
+
+        if (!segment || size == 0)
+        {
+            datagrams.push_back(Datagram{addrs[i], local, data, 0});
+            continue;
+        }
+
+        for (size_t offset = 0; offset < size; offset += segment)
+            datagrams.push_back(Datagram{addrs[i], local, data + offset, std::min(segment, size - offset)});
+    }
+
+    received += datagrams.size();
+    return datagrams;
+}
+
+void DatagramSocket::send(const sockaddr_inet &peer, const sockaddr_inet &local, std::string data)
+{
+    replies.push_back(Reply{peer, local, std::move(data)});
+
+    if (!flush_posted)
+    {
+        flush_posted = true;
+        reactor.post([this]() {
+            this->flush();
+        });
+    }
+}
+
+void DatagramSocket::flush()
+{
+    flush_posted = false;
+
+    std::vector<mmsghdr> out(std::min(replies.size(), batch));
+    std::vector<iovec> iov(out.size());
+    std::vector<char> controls(out.size() * pktinfo_size);
+
+    size_t done = 0;
+    while (done < replies.size())
+    {
+        size_t n = std::min(replies.size() - done, batch);
+        for (size_t i = 0; i < n; ++i)
+        {
+            Reply &r = replies[done + i];
+            iov[i].iov_base = &r.data[0];
+            iov[i].iov_len = r.data.size();
+
+            msghdr &hdr = out[i].msg_hdr;
+            hdr = msghdr();
+            hdr.msg_name = &r.peer;
+            hdr.msg_namelen = r.peer.family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+            hdr.msg_iov = &iov[i];
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = &controls[i * pktinfo_size];
+            hdr.msg_controllen = write_pktinfo(r.local, &controls[i * pktinfo_size]);
+            if (!hdr.msg_controllen)
+                hdr.msg_control = NULL;
+        }
+
+        int n_sent = sendmmsg(sock, out.data(), static_cast<unsigned>(n), MSG_DONTWAIT);
+        if (n_sent > 0)
+        {
+            sent += n_sent;
+            done += n_sent;
+        }
+        else if (n_sent < 0 && errno == EINTR)
+            continue;
+        else if (n_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            // The send buffer is full; like the network, drop rather than queue
+            dropped += replies.size() - done;
+            break;
+        }
+        else
+        {
+            // This one is undeliverable, try the rest
+            ++dropped;
+            ++done;
+        }
+    }
+
+    replies.clear();
+}
+
+// -------------------------------------------------------------------
+// Per-datagram handler
+DatagramReply::DatagramReply(Reactor &reply_reactor, DatagramSocket &reply_sock, const DatagramSocket::Datagram &dg) :
+    bytes_in(0), bytes_out(0), reactor(reply_reactor), sock(reply_sock), peer(dg.peer), local(dg.local), request(-1)
+{
+    out[0] = out[1] = -1;
+}
+
+DatagramReply::~DatagramReply()
+{
+    if (out[0] >= 0)
+        reactor.remove(out[0]);
+
+    close_fd(request);
+    close_fd(out[0]);
+    close_fd(out[1]);
+}
+
+bool DatagramReply::open(const char *data, size_t size)
+{
+    // A memfd takes any size without a reader, and the handler sees a plain file
+    request = memfd_create("ncs-request", MFD_CLOEXEC);
+    if (request < 0)
+        return false;
+    if (size && write(request, data, size) != static_cast<ssize_t>(size))
+        return false;
+    lseek(request, 0, SEEK_SET);
+    bytes_in = size;
+
+    if (pipe2(out, O_CLOEXEC) < 0)
+        return false;
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+void DatagramReply::start()
+{
+    close_fd(request);
+    close_fd(out[1]);
+
+    reactor.add(out[0], EPOLLIN, [this](uint32_t){
+        this->collect();
+    });
+}
+
+void DatagramReply::collect()
+{
+    char buf[buffer_size];
+
+    for (;;)
+    {
+        ssize_t n = read(out[0], buf, sizeof(buf));
+        if (n > 0)
+        {
+            // Whatever doesn't fit into a datagram is cut off
+            bytes_out += n;
+            reply.append(buf, std::min(static_cast<size_t>(n), DatagramSocket::max_size - reply.size()));
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        break;
+    }
+
+    // The handler closed its stdout
+    reactor.remove(out[0]);
+    close_fd(out[0]);
+
+    if (!reply.empty())
+        sock.send(peer, local, std::move(reply));
+
+    if (on_done)
+        on_done();
+}
@@ -0,0 +1,165 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "sockaddr.h"
+
+/**
+ * @file dgram.h
+ * @brief datagram services
+ *
+ * Datagrams are read from the shared socket in batches with recvmmsg(),
+ * optionally with UDP GRO coalescing a burst from one peer into a single
+ * buffer. In per-datagram mode every request gets a handler of its own;
+ * its output becomes the reply, and the replies of an iteration are sent
+ * from the shared socket with a single sendmmsg(). Each reply leaves from
+ * the address its request was sent to, which a wildcard bind would
+ * otherwise leave to the routing table.
+ */
+
+class Reactor;
+
+class DatagramSocket
+{
+public:
+    struct Datagram
+    {
+        sockaddr_inet peer;
+        sockaddr_inet local;    // sent to, AF_UNSPEC if unknown; link-local scope in sin6_scope_id, the bound port
+        const char *data;
+        size_t size;
+    };
+
+    // Largest UDP payload
+    static const size_t max_size = 65507;
+
+    /**
+     * @param reactor the event loop replies are flushed from
+     * @param fd a bound datagram socket. It stays owned by the caller.
+     * Turns on IP_PKTINFO or IPV6_RECVPKTINFO.
+     */
+    DatagramSocket(Reactor &reactor, int fd);
+
+    /**
+     * @brief have the kernel coalesce bursts with UDP_GRO
+     * @return false on failure, with errno set
+     */
+    bool enable_gro();
+
+    /**
+     * @brief read up to max datagrams without blocking
+     * The data stays valid until the next call on any socket: the
+     * buffers are shared.
+     */
+    const std::vector<Datagram> &receive(size_t max);
+
+    /**
+     * @brief queue a reply
+     * Replies are sent in one batch after the current iteration's events.
+     * @param local the source address, a Datagram's local
+     */
+    void send(const sockaddr_inet &peer, const sockaddr_inet &local, std::string data);
+
+    int fd() const { return sock; }
+
+    uint64_t received;
+    uint64_t sent;
+    uint64_t dropped;   // replies that didn't fit the socket's send buffer
+
+private:
+    struct Reply
+    {
+        sockaddr_inet peer;
+        sockaddr_inet local;
+        std::string data;
+    };
+
+    static const size_t batch = 64;
+
+    Reactor &reactor;
+    int sock;
+    in_port_t port;     // bound to, in network byte order
+    bool gro;
+    std::vector<Datagram> datagrams;
+    std::vector<Reply> replies;
+    bool flush_posted;
+
+    void flush();
+};
+
+class DatagramReply
+{
+public:
+    /**
+     * @param reactor the event loop to collect the output from
+     * @param sock the socket to reply through
+     * @param dg the request, for where to send the reply from and to
+     */
+    DatagramReply(Reactor &reactor, DatagramSocket &sock, const DatagramSocket::Datagram &dg);
+    ~DatagramReply();
+
+    /**
+     * @brief put the request into a memfd and create the output pipe
+     * @return false on failure, with errno set
+     */
+    bool open(const char *data, size_t size);
+
+    // The handler's stdin and stdout
+    int child_stdin() const { return request; }
+    int child_stdout() const { return out[1]; }
+
+    /**
+     * @brief start collecting the output
+     * Call in the parent after fork(); closes the handler's ends.
+     */
+    void start();
+
+    bool done() const { return out[0] < 0; }
+
+    /**
+     * @brief called once the reply was queued
+     * The DatagramReply may be destroyed from within the callback.
+     */
+    std::function<void()> on_done;
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+private:
+    Reactor &reactor;
+    DatagramSocket &sock;
+    sockaddr_inet peer;
+    sockaddr_inet local;
+    int request;
+    int out[2];
+    std::string reply;
+
+    void collect();
+};
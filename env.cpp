@@ -0,0 +1,172 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include "client.h"
+#include "env.h"
+
+// The variables set per connection, without their protocol prefix
+static const char *const ucspi_names[] = {
+    "LOCALIP", "LOCALPORT", "LOCALHOST", "LOCALPATH",
+    "REMOTEIP", "REMOTEPORT", "REMOTEHOST", "REMOTEINFO",
+    "REMOTEPID", "REMOTEEUID", "REMOTEEGID",
+};
+
+static const char *const ucspi_protos[] = {
+    "TCP6", "TCP", "UDP6", "UDP", "UNIX",
+};
+
+// Inherited values would be mistaken for those of the connection
+static bool per_connection(const char *var)
+{
+    const char *eq = std::strchr(var, '=');
+    std::string name(var, eq ? eq - var : std::strlen(var));
+
+    if (name == "PROTO" || name == "NCS_CPU")
+        return true;
+
+    for (const char *proto : ucspi_protos)
+        if (!name.compare(0, std::strlen(proto), proto))
+            for (const char *suffix : ucspi_names)
+                if (!name.compare(std::strlen(proto), std::string::npos, suffix))
+                    return true;
+    return false;
+}
+
+// Meant for the server; a handler using them would speak for it to systemd
+static bool server_only(const char *var)
+{
+    static const char *const names[] = { "NOTIFY_SOCKET=", "WATCHDOG_USEC=", "WATCHDOG_PID=" };
+    for (const char *name : names)
+        if (!std::strncmp(var, name, std::strlen(name)))
+            return true;
+    return false;
+}
+
+Environment::Environment(char **vars, bool is_datagram) :
+    datagram(is_datagram), used(0), count(0)
+{
+    for (char **var = vars; *var; ++var)
+        if (!per_connection(*var) && !server_only(*var))
+            base.push_back(*var);
+
+    block.assign(max_vars, nullptr);
+    for (std::string &var : base)
+        block.push_back(&var[0]);
+    block.push_back(nullptr);
+}
+
+void Environment::set(const char *proto, const char *name, const char *value)
+{
+    if (count >= max_vars)
+        return;
+
+    int n = std::snprintf(arena + used, arena_size - used, "%s%s=%s", proto, name, value);
+    if (n < 0 || static_cast<size_t>(n) >= arena_size - used)
+        return;
+
+    // Filled back to front, so the slots in use end right before the base
+    block[max_vars - ++count] = arena + used;
+    used += n + 1;
+}
+
+void Environment::set(const char *proto, const char *name, unsigned long value)
+{
+    char buf[24];
+    std::snprintf(buf, sizeof(buf), "%lu", value);
+    set(proto, name, buf);
+}
+
+// The bare address, without brackets
+static void format_ip(const sockaddr_inet &addr, char *buf, size_t size)
+{
+    if (addr.family == AF_INET6)
+        inet_ntop(AF_INET6, &addr.in6.sin6_addr, buf, size);
+    else
+        inet_ntop(AF_INET, &addr.in.sin_addr, buf, size);
+}
+
+static unsigned port_of(const sockaddr_inet &addr)
+{
+    return ntohs(addr.family == AF_INET6 ? addr.in6.sin6_port : addr.in.sin_port);
+}
+
+void Environment::prepare(Client &client)
+{
+    used = 0;
+    count = 0;
+
+    // A datagram's client has no socket but knows where it was sent to
+    sockaddr_inet local = client.local;
+    socklen_t local_size = sizeof(local);
+    bool have_local = client.fd >= 0 ?
+        getsockname(client.fd, reinterpret_cast<sockaddr*>(&local), &local_size) == 0 :
+        local.family != AF_UNSPEC;
+    if (have_local)
+        unmap_v4(local);
+
+    char ip[INET6_ADDRSTRLEN];
+
+    if (client.peer.family == AF_UNIX)
+    {
+        const char *proto = "UNIX";
+        set("", "PROTO", proto);
+
+        ucred cred;
+        if (client.credentials(cred))
+        {
+            set(proto, "REMOTEPID", static_cast<unsigned long>(cred.pid));
+            set(proto, "REMOTEEUID", static_cast<unsigned long>(cred.uid));
+            set(proto, "REMOTEEGID", static_cast<unsigned long>(cred.gid));
+        }
+        if (have_local && local.family == AF_UNIX)
+            set(proto, "LOCALPATH", ::peername(local));
+    }
+    else
+    {
+        bool v6 = client.peer.family == AF_INET6;
+        const char *proto = datagram ? (v6 ? "UDP6" : "UDP") : (v6 ? "TCP6" : "TCP");
+        set("", "PROTO", proto);
+
+        format_ip(client.peer, ip, sizeof(ip));
+        set(proto, "REMOTEIP", ip);
+        set(proto, "REMOTEPORT", port_of(client.peer));
+        if (!client.hostname.empty())
+            set(proto, "REMOTEHOST", client.hostname.c_str());
+
+        if (have_local && local.family != AF_UNIX)
+        {
+            format_ip(local, ip, sizeof(ip));
+            set(proto, "LOCALIP", ip);
+            set(proto, "LOCALPORT", port_of(local));
+        }
+    }
+
+    if (client.cpu >= 0)
+        set("", "NCS_CPU", static_cast<unsigned long>(client.cpu));
+}
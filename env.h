@@ -0,0 +1,77 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * @file env.h
+ * @brief UCSPI environment of the handlers
+ *
+ * Handlers learn about their connection from PROTO and the
+ * <PROTO>LOCALIP, <PROTO>REMOTEIP, ... variables, like under tcpserver.
+ * The server's own environment is copied once, at startup, into the tail
+ * of a single envp block. Before each fork only the handful of per
+ * connection variables are formatted into a fixed arena and pointed to
+ * from the slots reserved in front of the base, so neither the parent nor
+ * the forked child copy the environment per connection.
+ */
+
+struct Client;
+
+class Environment
+{
+public:
+    /**
+     * @param vars the base environment, usually the server's own
+     * @param datagram whether the service speaks UDP
+     */
+    Environment(char **vars, bool datagram);
+
+    /**
+     * @brief set up the variables of a connection
+     * Call in the parent right before fork(); envp() is valid until the
+     * next call.
+     */
+    void prepare(Client &client);
+
+    char **envp() { return block.data() + max_vars - count; }
+
+private:
+    static const size_t max_vars = 16;
+    static const size_t arena_size = 1024;
+
+    bool datagram;
+    std::vector<std::string> base;  // owns the strings the block points to
+    std::vector<char*> block;       // max_vars slots, the base, NULL
+
+    char arena[arena_size];
+    size_t used;
+    size_t count;
+
+    void set(const char *proto, const char *name, const char *value);
+    void set(const char *proto, const char *name, unsigned long value);
+};
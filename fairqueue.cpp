@@ -0,0 +1,328 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "client.h"
+#include "fairqueue.h"
+#include "metrics.h"
+
+const uint64_t FairQueue::bounds_ms[Histogram::nbuckets] = {
+    1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000,
+};
+
+static std::vector<std::string> split(const std::string &str, char sep)
+{
+    std::vector<std::string> parts;
+    std::istringstream is(str);
+    std::string part;
+    while (std::getline(is, part, sep))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+static unsigned parse_number(const std::string &str, unsigned max, const std::string &what)
+{
+    char *end;
+    unsigned long value = std::strtoul(str.c_str(), &end, 10);
+    if (str.empty() || *end || value > max)
+        throw FairQueueError("Invalid " + what + " '" + str + "'");
+    return static_cast<unsigned>(value);
+}
+
+FairQueue::FairQueue(size_t queue_capacity, uint64_t queue_timeout_ms) :
+    dropped(0), timed_out(0), mode(single), v4_bits(24), v6_bits(64),
+    capacity(queue_capacity), timeout_ms(queue_timeout_ms), count(0),
+    waits(bounds_ms, 1000)
+{
+}
+
+FairQueue::~FairQueue()
+{
+}
+
+void FairQueue::parse_mode(const std::string &spec)
+{
+    if (spec == "port")
+    {
+        mode = port;
+        return;
+    }
+
+    if (spec.compare(0, 6, "source") || (spec.size() > 6 && spec[6] != '/'))
+        throw FairQueueError("Expected source[/<v4 bits>[:<v6 bits>]] or port, got '" + spec + "'");
+
+    mode = source;
+    if (spec.size() > 7)
+    {
+        std::vector<std::string> bits = split(spec.substr(7), ':');
+        if (bits.empty() || bits.size() > 2)
+            throw FairQueueError("Expected source[/<v4 bits>[:<v6 bits>]], got '" + spec + "'");
+        v4_bits = parse_number(bits[0], 32, "prefix length");
+        if (bits.size() > 1)
+            v6_bits = parse_number(bits[1], 128, "prefix length");
+    }
+}
+
+void FairQueue::parse_weights(const std::string &list)
+{
+    for (const std::string &item : split(list, ','))
+    {
+        size_t eq = item.rfind('=');
+        if (eq == std::string::npos)
+            throw FairQueueError("Expected <class>=<weight>, got '" + item + "'");
+
+        Weight w;
+        std::memset(&w, 0, sizeof(w));
+        w.weight = parse_number(item.substr(eq + 1), 1000000, "weight");
+        if (!w.weight)
+            throw FairQueueError("Weights start at 1, got '" + item + "'");
+
+        if (mode == port)
+        {
+            w.family = AF_UNSPEC;
+            w.port = static_cast<uint16_t>(parse_number(item.substr(0, eq), 65535, "port"));
+            weights.push_back(w);
+            continue;
+        }
+
+        size_t slash = item.rfind('/', eq);
+        if (slash == std::string::npos)
+            throw FairQueueError("Expected <prefix>/<bits>=<weight>, got '" + item + "'");
+
+        std::string addr = item.substr(0, slash);
+        if (inet_pton(AF_INET, addr.c_str(), w.prefix) == 1)
+            w.family = AF_INET;
+        else if (inet_pton(AF_INET6, addr.c_str(), w.prefix) == 1)
+            w.family = AF_INET6;
+        else
+            throw FairQueueError("Invalid address '" + addr + "'");
+        w.bits = parse_number(item.substr(slash + 1, eq - slash - 1), w.family == AF_INET ? 32 : 128, "prefix length");
+
+        weights.push_back(w);
+    }
+}
+
+void FairQueue::classify(Client &client, std::string &key, unsigned &weight) const
+{
+    weight = 1;
+    key.clear();
+
+    if (mode == single)
+        return;
+
+    if (mode == port)
+    {
+        sockaddr_inet local;
+        socklen_t size = sizeof(local);
+        std::memset(&local, 0, sizeof(local));
+        getsockname(client.fd, reinterpret_cast<sockaddr*>(&local), &size);
+
+        uint16_t p = 0;
+        if (local.family == AF_INET)
+            p = ntohs(local.in.sin_port);
+        else if (local.family == AF_INET6)
+            p = ntohs(local.in6.sin6_port);
+
+        key.assign(reinterpret_cast<const char*>(&p), sizeof(p));
+        for (const Weight &w : weights)
+            if (w.port == p)
+            {
+                weight = w.weight;
+                break;
+            }
+        return;
+    }
+
+    // Local peers are told apart by user
+    ucred cred;
+    if (client.peer.family == AF_UNIX)
+    {
+        uid_t uid = client.credentials(cred) ? cred.uid : static_cast<uid_t>(-1);
+        key = "u";
+        key.append(reinterpret_cast<const char*>(&uid), sizeof(uid));
+        return;
+    }
+
+    const uint8_t *addr;
+    unsigned bits, bytes;
+    if (client.peer.family == AF_INET6)
+    {
+        addr = reinterpret_cast<const uint8_t*>(&client.peer.in6.sin6_addr);
+        bits = v6_bits;
+        bytes = 16;
+        key = "6";
+    }
+    else
+    {
+        addr = reinterpret_cast<const uint8_t*>(&client.peer.in.sin_addr);
+        bits = v4_bits;
+        bytes = 4;
+        key = "4";
+    }
+
+    uint8_t masked[16] = {};
+    std::memcpy(masked, addr, bits / 8);
+    if (bits % 8)
+        masked[bits / 8] = addr[bits / 8] & static_cast<uint8_t>(0xff << (8 - bits % 8));
+    key.append(reinterpret_cast<const char*>(masked), bytes);
+
+    for (const Weight &w : weights)
+        if (w.family == client.peer.family && prefix_match(addr, w.prefix, w.bits))
+        {
+            weight = w.weight;
+            break;
+        }
+}
+
+std::unique_ptr<Client> FairQueue::push(std::unique_ptr<Client> client, uint64_t now_ms)
+{
+    std::string key;
+    unsigned weight;
+    classify(*client, key, weight);
+
+    auto it = by_key.find(key);
+    size_t own = it == by_key.end() ? 0 : it->second.entries.size();
+
+    // Make room at the expense of whoever has the most queued; if that's
+    // the newcomer's own flow, it has had its share already
+    std::unique_ptr<Client> evicted;
+    if (capacity && count >= capacity)
+    {
+        Flow *longest = nullptr;
+        for (Flow *f : active)
+            if (!longest || f->entries.size() > longest->entries.size())
+                longest = f;
+
+        ++dropped;
+        if (!longest || own >= longest->entries.size())
+            return client;
+
+        evicted = std::move(longest->entries.back().client);
+        longest->entries.pop_back();
+        --count;
+    }
+
+    if (it == by_key.end())
+    {
+        it = by_key.emplace(key, Flow()).first;
+        it->second.key = key;
+        it->second.weight = weight;
+        it->second.deficit = 0;
+        active.push_back(&it->second);
+    }
+
+    Entry e;
+    e.client = std::move(client);
+    e.queued_ms = now_ms;
+    it->second.entries.push_back(std::move(e));
+    ++count;
+
+    return evicted;
+}
+
+std::unique_ptr<Client> FairQueue::pop(uint64_t now_ms)
+{
+    while (!active.empty())
+    {
+        Flow *f = active.front();
+        if (f->entries.empty())
+        {
+            active.pop_front();
+            by_key.erase(by_key.find(f->key));
+            continue;
+        }
+
+        // A new turn: the flow may start up to its weight
+        if (!f->deficit)
+            f->deficit = f->weight;
+
+        Entry e(std::move(f->entries.front()));
+        f->entries.pop_front();
+        --f->deficit;
+        --count;
+
+        // Flows that run dry leave the round and start afresh next time
+        if (f->entries.empty())
+        {
+            active.pop_front();
+            by_key.erase(by_key.find(f->key));
+        }
+        else if (!f->deficit)
+        {
+            active.pop_front();
+            active.push_back(f);
+        }
+
+        record_wait(now_ms - e.queued_ms);
+        return std::move(e.client);
+    }
+
+    return nullptr;
+}
+
+void FairQueue::expire(uint64_t now_ms, std::vector<std::unique_ptr<Client>> &expired)
+{
+    if (!timeout_ms)
+        return;
+
+    // Every flow is in arrival order, so the ones due are at the front
+    std::deque<Flow*> remaining;
+    for (Flow *f : active)
+    {
+        while (!f->entries.empty() && now_ms - f->entries.front().queued_ms >= timeout_ms)
+        {
+            expired.push_back(std::move(f->entries.front().client));
+            f->entries.pop_front();
+            --count;
+            ++timed_out;
+        }
+
+        if (f->entries.empty())
+            by_key.erase(by_key.find(f->key));
+        else
+            remaining.push_back(f);
+    }
+    active.swap(remaining);
+}
+
+void FairQueue::record_wait(uint64_t wait_ms)
+{
+    waits.record(wait_ms);
+}
+
+void FairQueue::collect(std::ostream &os) const
+{
+    Metrics::sample(os, "ncs_fair_queue_length", "gauge", "Connections waiting for a handler slot", count);
+    Metrics::sample(os, "ncs_fair_queue_flows", "gauge", "Flows with connections waiting", active.size());
+    Metrics::sample(os, "ncs_fair_queue_dropped_total", "counter", "Connections turned away because the queue was full", dropped);
+    Metrics::sample(os, "ncs_fair_queue_timeouts_total", "counter", "Connections turned away after waiting too long", timed_out);
+
+    waits.collect(os, "ncs_fair_queue_wait_seconds", "Time connections waited for a handler slot");
+}
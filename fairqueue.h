@@ -0,0 +1,157 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "metrics.h"
+
+/**
+ * @file fairqueue.h
+ * @brief fair queuing of connections waiting for a handler slot
+ *
+ * Once all handler slots are taken, connections left in the listen queue
+ * go to whoever reconnects fastest. Instead they can be accepted into a
+ * bounded queue of flows, one per source prefix, local port or local user,
+ * that are served by deficit round robin: each turn a flow may start as
+ * many handlers as its weight. When the queue is full the newest
+ * connection of the longest flow makes room, and connections that waited
+ * past their deadline are turned away, so the wait stays bounded.
+ */
+
+struct Client;
+
+/**
+ * @brief The FairQueueError class
+ */
+class FairQueueError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+class FairQueue
+{
+public:
+    enum Mode { single, source, port };
+
+    /**
+     * @param capacity connections queued at most, 0 for no limit
+     * @param timeout_ms how long a connection may wait, 0 for no limit
+     */
+    FairQueue(size_t capacity, uint64_t timeout_ms);
+    ~FairQueue();
+
+    /**
+     * @brief tell flows apart by source or port instead of queuing in order
+     * @param spec source[/<v4 bits>[:<v6 bits>]] or port
+     * @throws FairQueueError
+     */
+    void parse_mode(const std::string &spec);
+
+    /**
+     * @brief parse a comma separated list of <prefix>/<bits>=<weight>,
+     *        or <port>=<weight> when queuing by port
+     * @throws FairQueueError
+     */
+    void parse_weights(const std::string &list);
+
+    /**
+     * @brief queue a connection
+     * @return the connection turned away to make room, if the queue was
+     *  full. That may be the new one itself.
+     */
+    std::unique_ptr<Client> push(std::unique_ptr<Client> client, uint64_t now_ms);
+
+    /**
+     * @brief the connection to start next
+     * @return nullptr if nothing is queued
+     */
+    std::unique_ptr<Client> pop(uint64_t now_ms);
+
+    /**
+     * @brief take out the connections that waited past their deadline
+     */
+    void expire(uint64_t now_ms, std::vector<std::unique_ptr<Client>> &expired);
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    size_t flows() const { return active.size(); }
+
+    // Emit the queue's metrics in the Prometheus text format
+    void collect(std::ostream &os) const;
+
+    uint64_t dropped;       // turned away because the queue was full
+    uint64_t timed_out;     // turned away after waiting too long
+
+private:
+    struct Entry
+    {
+        std::unique_ptr<Client> client;
+        uint64_t queued_ms;
+    };
+
+    struct Flow
+    {
+        std::string key;
+        std::deque<Entry> entries;
+        unsigned weight;
+        unsigned deficit;   // connections it may still start this turn
+    };
+
+    struct Weight
+    {
+        short family;       // AF_UNSPEC for ports
+        uint8_t prefix[16];
+        unsigned bits;
+        uint16_t port;
+        unsigned weight;
+    };
+
+    static const uint64_t bounds_ms[Histogram::nbuckets];
+
+    Mode mode;
+    unsigned v4_bits;
+    unsigned v6_bits;
+    std::vector<Weight> weights;
+
+    size_t capacity;
+    uint64_t timeout_ms;
+    size_t count;
+
+    // A flow is in the map as long as it's in the round; the map owns it
+    std::unordered_map<std::string, Flow> by_key;
+    std::deque<Flow*> active;
+
+    Histogram waits;                    // in ms
+
+    void classify(Client &client, std::string &key, unsigned &weight) const;
+    void record_wait(uint64_t wait_ms);
+};
@@ -0,0 +1,219 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "logcapture.h"
+#include "reactor.h"
+
+// Flush the batch early beyond this
+static const size_t batch_limit = 65536;
+
+// Lines longer than this are cut. If the sink allows it, the rest of what
+// is available is spliced over without being copied or tagged.
+static const size_t line_limit = 4096;
+static const size_t bulk_limit = 65536;
+
+// ------------------ LogSink ------------------
+LogSink::LogSink(Reactor &sink_reactor, int fd) :
+    reactor(sink_reactor), sink_fd(fd), splice_ok(!isatty(fd)), scheduled(false)
+{
+    batch.reserve(batch_limit);
+}
+
+LogSink::~LogSink()
+{
+    flush();
+}
+
+void LogSink::write(const char *data, size_t len)
+{
+    batch.append(data, len);
+
+    if (batch.size() >= batch_limit)
+        flush();
+    else if (!scheduled)
+    {
+        scheduled = true;
+        reactor.post([this]() {
+            this->scheduled = false;
+            this->flush();
+        });
+    }
+}
+
+void LogSink::flush()
+{
+    const char *data = batch.data();
+    size_t size = batch.size();
+
+    while (size > 0)
+    {
+        ssize_t n = ::write(sink_fd, data, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // Nowhere to complain to
+            break;
+        }
+        data += n;
+        size -= n;
+    }
+    batch.clear();
+}
+
+// ------------------ LogCapture ------------------
+LogCapture::LogCapture(Reactor &capture_reactor, LogSink &capture_sink) :
+    reactor(capture_reactor), sink(capture_sink)
+{
+    fds[0] = fds[1] = -1;
+}
+
+LogCapture::~LogCapture()
+{
+    if (fds[0] >= 0)
+    {
+        reactor.remove(fds[0]);
+        close(fds[0]);
+    }
+    if (fds[1] >= 0)
+        close(fds[1]);
+}
+
+bool LogCapture::open()
+{
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return false;
+    // Only our end; the handler's stderr stays blocking
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+void LogCapture::start(const std::string &capture_tag)
+{
+    tag = capture_tag;
+
+    close(fds[1]);
+    fds[1] = -1;
+
+    reactor.add(fds[0], EPOLLIN, [this](uint32_t) {
+        this->readable();
+    });
+}
+
+void LogCapture::readable()
+{
+    char buf[16384];
+
+    // One read per wakeup keeps a chatty handler from hogging the loop
+    ssize_t n = read(fds[0], buf, sizeof(buf));
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0)
+        return finish();
+
+    emit(buf, n);
+
+    if (partial.size() >= line_limit)
+    {
+        if (sink.can_splice())
+            bulk();
+        else
+        {
+            partial += '\n';
+            sink.write(tag);
+            sink.write(partial);
+            partial.clear();
+        }
+    }
+}
+
+void LogCapture::emit(const char *data, size_t len)
+{
+    const char *end = data + len;
+
+    while (data < end)
+    {
+        const char *nl = static_cast<const char*>(std::memchr(data, '\n', end - data));
+        if (nl == NULL)
+        {
+            partial.append(data, end);
+            return;
+        }
+
+        sink.write(tag);
+        if (!partial.empty())
+        {
+            sink.write(partial);
+            partial.clear();
+        }
+        sink.write(data, nl + 1 - data);
+        data = nl + 1;
+    }
+}
+
+void LogCapture::bulk()
+{
+    sink.write(tag);
+    sink.write(partial);
+    partial.clear();
+
+    // Everything written so far has to go out first
+    sink.flush();
+
+    size_t moved = 0;
+    while (moved < bulk_limit)
+    {
+        ssize_t n = splice(fds[0], NULL, sink.fd(), NULL, bulk_limit - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0)
+            break;
+        moved += n;
+    }
+
+    sink.write("\n", 1);
+}
+
+void LogCapture::finish()
+{
+    if (!partial.empty())
+    {
+        partial += '\n';
+        sink.write(tag);
+        sink.write(partial);
+        partial.clear();
+    }
+
+    reactor.remove(fds[0]);
+    close(fds[0]);
+    fds[0] = -1;
+
+    if (on_done)
+        on_done();
+}
@@ -0,0 +1,113 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+/**
+ * @file logcapture.h
+ * @brief capture of handler stderr into the server log
+ *
+ * Each handler's stderr is a pipe read by the event loop. Output is
+ * reassembled into lines, tagged with the handler's pid and peer and
+ * written to the log in batches, once per loop iteration, so lines from
+ * different handlers never interleave.
+ */
+
+class Reactor;
+
+/**
+ * @brief batching writer for the server log
+ */
+class LogSink
+{
+public:
+    LogSink(Reactor &reactor, int fd);
+    ~LogSink();
+
+    void write(const char *data, size_t len);
+    void write(const std::string &str) { write(str.data(), str.size()); }
+    void flush();
+
+    int fd() const { return sink_fd; }
+
+    /**
+     * @brief whether splice() into the sink works
+     * False for terminals.
+     */
+    bool can_splice() const { return splice_ok; }
+
+private:
+    Reactor &reactor;
+    int sink_fd;
+    bool splice_ok;
+    bool scheduled;
+    std::string batch;
+};
+
+/**
+ * @brief the stderr pipe of a single handler
+ */
+class LogCapture
+{
+public:
+    LogCapture(Reactor &reactor, LogSink &sink);
+    ~LogCapture();
+
+    /**
+     * @brief create the pipe
+     * @return false on failure, with errno set
+     */
+    bool open();
+
+    int child_stderr() const { return fds[1]; }
+
+    /**
+     * @brief start reading
+     * Call in the parent after fork(); closes the handler's end.
+     * @param tag prefix for every line
+     */
+    void start(const std::string &tag);
+
+    bool done() const { return fds[0] < 0; }
+
+    /**
+     * @brief called when all writers have closed the pipe
+     * The LogCapture may be destroyed from within the callback.
+     */
+    std::function<void()> on_done;
+
+private:
+    Reactor &reactor;
+    LogSink &sink;
+    int fds[2];
+    std::string tag;
+    std::string partial;
+
+    void readable();
+    void emit(const char *data, size_t len);
+    void bulk();
+    void finish();
+};
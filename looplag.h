@@ -0,0 +1,69 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+#include "metrics.h"
+
+/**
+ * @file looplag.h
+ * @brief event loop lag histogram
+ *
+ * The lag of an iteration is the time from epoll_wait() returning until
+ * the loop is ready to wait again: anything that became ready meanwhile,
+ * a new connection included, had to wait at least that long. The reactor
+ * feeds every iteration in; the watchdog looks at the worst one since it
+ * last checked.
+ */
+
+class LoopLag
+{
+public:
+    LoopLag();
+
+    void record(uint64_t lag_us);
+
+    /**
+     * @brief the worst lag since the last call, in µs
+     */
+    uint64_t take_worst();
+
+    /**
+     * @brief the lag below which a fraction q of the iterations fall
+     * An upper bound from the histogram buckets, capped at the largest.
+     */
+    uint64_t quantile_us(double q) const;
+
+    uint64_t iterations() const { return lags.count(); }
+
+    // Emit the histogram in the Prometheus text format
+    void collect(std::ostream &os) const;
+
+private:
+    static const uint64_t bounds_us[Histogram::nbuckets];
+
+    Histogram lags;                     // in µs
+    uint64_t worst_us;
+};
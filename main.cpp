@@ -23,34 +23,61 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <poll.h>
 
 #include <iostream>
 #include <cstring>
 #include <string>
 #include <algorithm>
 #include <cstdio>
-#include <regex>
-#include <array>
 #include <memory>
-#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <cerrno>
+#include <cstdint>
 #include <ctime>
+#include <sstream>
 
 #include "cmdparser.h"
 #include "sd-daemon.h"
+#include "affinity.h"
+#include "breaker.h"
+#include "cache.h"
+#include "cgroup.h"
+#include "client.h"
+#include "dgram.h"
+#include "env.h"
+#include "fairqueue.h"
+#include "logcapture.h"
+#include "looplag.h"
+#include "metrics.h"
+#include "probes.h"
+#include "reactor.h"
+#include "resolver.h"
+#include "relay.h"
+#include "scheduling.h"
+#include "spantrace.h"
+#include "status.h"
+#include "system.h"
+#include "tcpinfo.h"
+#include "tls.h"
+#include "trace.h"
+#include "zygote.h"
 
 using namespace std;
 
 
-#define PASS_IN 1
-#define PASS_OUT 2
-#define PASS_ERR 4
-
 // Parse Commandline Options
 static CmdParser::ArgumentMap parse_argv(int argc, char **argv)
 {
@@ -66,21 +93,37 @@ static CmdParser::ArgumentMap parse_argv(int argc, char **argv)
     // Systemd
     parser.newSwitch("systemd");
     parser.addDocumentation("systemd", "Use systemd socket activation");
+    parser.newOption("watchdog-lag", 1000l);
+    parser.addDocumentation("watchdog-lag", "Withhold systemd watchdog pings while the event loop lags by <ms> or more, 0 to always ping", "<ms>");
+    parser.newOption("idle-exit");
+    parser.addDocumentation("idle-exit", "Exit after <sec> seconds without handlers or connections, leaving the socket to systemd", "<sec>");
 
     // Port
     parser.newOption("port", 7994l);
     parser.addFlag("port", 'p');
-    parser.addDocumentation("port", "The port to listen on");
+    parser.addDocumentation("port", "The ports to listen on, e.g. 80,443,8000-8099", "<ports>");
 
     // Address
     parser.newOption("bind");
     parser.addFlag("bind", 'b');
-    parser.addDocumentation("bind", "Bind to address", "<addr>");
+    parser.setRepeatable("bind");
+    parser.addDocumentation("bind", "Bind to address, with optional :<ports>, or to a UNIX socket with unix:/path or unix:@abstract. Repeatable", "<addr>");
 
     // Ip version
     parser.newSwitch("ipv6");
     parser.addFlag("ipv6", '6');
     parser.addDocumentation("ipv6", "Use IPv6");
+    parser.newSwitch("dual-stack");
+    parser.addDocumentation("dual-stack", "Accept IPv4 on IPv6 sockets too (IPV6_V6ONLY=0); listens on [::] by default");
+
+    // Datagrams
+    parser.newSwitch("udp");
+    parser.addFlag("udp", 'u');
+    parser.addDocumentation("udp", "Serve UDP: one handler per datagram, its stdout is the reply");
+    parser.newSwitch("udp-wait");
+    parser.addDocumentation("udp-wait", "Hand the UDP socket itself to one handler at a time, like inetd's wait");
+    parser.newSwitch("udp-gro");
+    parser.addDocumentation("udp-gro", "Let the kernel coalesce datagram bursts (UDP_GRO)");
 
     // Fd passing
     parser.newSwitch("stdin");
@@ -92,9 +135,144 @@ static CmdParser::ArgumentMap parse_argv(int argc, char **argv)
     parser.newSwitch("stderr");
     parser.addFlag("stderr", 'e');
     parser.addDocumentation("stderr", "Pass the standard error stream");
+    parser.newSwitch("relay");
+    parser.addFlag("relay", 'r');
+    parser.addDocumentation("relay", "Give the program pipes instead of the socket and relay with splice()");
+    parser.newSwitch("capture-stderr");
+    parser.addDocumentation("capture-stderr", "Collect the program's stderr into the log, tagged by connection");
+
+    // Response cache
+    parser.newOption("cache");
+    parser.addDocumentation("cache", "Answer repeated request lines from memory for <sec> seconds. Needs -i and -o; implies --relay", "<sec>");
+    parser.newOption("cache-size");
+    parser.addDocumentation("cache-size", "Memory for cached requests and responses, 64M by default (k/M/G suffixes)", "<bytes>");
+    parser.newOption("cache-request", 1024l);
+    parser.addDocumentation("cache-request", "Longest request line that is looked up", "<bytes>");
+
+    // TLS
+    parser.newOption("tls-cert");
+    parser.addDocumentation("tls-cert", "Terminate TLS with the PEM certificate chain in <file>; handlers see plaintext", "<file>");
+    parser.newOption("tls-key");
+    parser.addDocumentation("tls-key", "PEM private key, from --tls-cert by default", "<file>");
+    parser.newOption("tls-tickets", 2l);
+    parser.addDocumentation("tls-tickets", "Session tickets sent per TLS 1.3 handshake, 0 disables tickets", "<n>");
+    parser.newOption("tls-timeout", 10000l);
+    parser.addDocumentation("tls-timeout", "Drop connections that haven't finished the handshake after <ms>", "<ms>");
+    parser.newSwitch("no-ktls");
+    parser.addDocumentation("no-ktls", "Always relay TLS in userspace instead of handing the socket to kernel TLS");
+
+    // Reverse DNS
+    parser.newSwitch("resolve");
+    parser.addDocumentation("resolve", "Look up peer names for %H and $PROTOREMOTEHOST; on by default when the command line uses %H");
+    parser.newOption("resolve-deadline", 100l);
+    parser.addDocumentation("resolve-deadline", "Start the handler with the bare address after waiting <ms> for a name", "<ms>");
+    parser.newOption("resolve-ttl", 300l);
+    parser.addDocumentation("resolve-ttl", "Remember names for <sec> seconds", "<sec>");
+    parser.newOption("resolve-negative-ttl", 60l);
+    parser.addDocumentation("resolve-negative-ttl", "Remember addresses without a name for <sec> seconds", "<sec>");
+    parser.newOption("resolve-workers", 4l);
+    parser.addDocumentation("resolve-workers", "Number of lookups in flight at once", "<n>");
+    parser.newOption("resolve-cache", 4096l);
+    parser.addDocumentation("resolve-cache", "Number of names remembered", "<n>");
+
+    // Traffic shaping
+    parser.newOption("pacing-rate");
+    parser.addDocumentation("pacing-rate", "Cap every connection at <rate> bytes/s (k/M/G suffixes)", "<rate>");
+    parser.newOption("source-rate");
+    parser.addDocumentation("source-rate", "Per-source caps, e.g. 10.0.0.0/8=1M,::1/128=100M", "<list>");
+    parser.newOption("tcp-profile");
+    parser.addDocumentation("tcp-profile", "Any of nodelay, cork, keepalive[=idle:intvl:cnt]", "<list>");
+
+    // CPU placement
+    parser.newOption("cpu-affinity");
+    parser.addDocumentation("cpu-affinity", "Pin handlers to the CPU (cpu) or NUMA node (node) that received the connection", "<mode>");
+
+    // Scheduling
+    parser.newOption("nice");
+    parser.addDocumentation("nice", "Nice value of the acceptor, e.g. --nice=-5", "<n>");
+    parser.newOption("fifo");
+    parser.addDocumentation("fifo", "Run the acceptor with SCHED_FIFO at priority <prio>", "<prio>");
+    parser.newOption("fifo-cap", 200l);
+    parser.addDocumentation("fifo-cap", "Drop SCHED_FIFO after running <ms> without blocking", "<ms>");
+    parser.newOption("child-nice");
+    parser.addDocumentation("child-nice", "Nice value of the handlers", "<n>");
+    parser.newOption("child-sched");
+    parser.addDocumentation("child-sched", "Scheduling policy of the handlers: other, batch or idle", "<policy>");
+    parser.newOption("child-ioprio");
+    parser.addDocumentation("child-ioprio", "IO priority of the handlers: rt, be or idle, with an optional :<level>", "<class>");
+    parser.newOption("child-timerslack");
+    parser.addDocumentation("child-timerslack", "Timer slack of the handlers", "<ns>");
+
+    // Circuit breaker
+    parser.newOption("circuit-failures", 0l);
+    parser.addDocumentation("circuit-failures", "Stop spawning handlers after <n> quick failures", "<n>");
+    parser.newOption("circuit-window", 10000l);
+    parser.addDocumentation("circuit-window", "The window the failures have to happen in", "<ms>");
+    parser.newOption("circuit-quick", 1000l);
+    parser.addDocumentation("circuit-quick", "Failures of handlers that ran shorter than this count", "<ms>");
+    parser.newOption("circuit-open", 5000l);
+    parser.addDocumentation("circuit-open", "Time until the first probe once the circuit opened", "<ms>");
+    parser.newSwitch("circuit-queue");
+    parser.addDocumentation("circuit-queue", "Leave connections in the listen queue while open instead of resetting them");
+
+    // Load control
+    parser.newOption("backlog", 5l);
+    parser.addDocumentation("backlog", "Length of the listen queue", "<n>");
+    parser.newOption("max-children", 0l);
+    parser.addDocumentation("max-children", "Leave connections in the listen queue while <n> handlers are running", "<n>");
+    parser.newOption("fair-queue", 0l);
+    parser.addDocumentation("fair-queue", "Keep accepting at --max-children, queuing up to <n> connections that are served fairly", "<n>");
+    parser.newOption("fair-by");
+    parser.addDocumentation("fair-by", "Flows that share the queue: source[/<v4 bits>[:<v6 bits>]], source/24:64 by default, or port", "<class>");
+    parser.newOption("fair-weights");
+    parser.addDocumentation("fair-weights", "Handlers started per turn, 1 by default, e.g. 10.0.0.0/8=4 or 443=2 with --fair-by port", "<list>");
+    parser.newOption("fair-timeout", 5000l);
+    parser.addDocumentation("fair-timeout", "Turn away connections that waited <ms> for a handler slot, 0 to wait indefinitely", "<ms>");
+    parser.newOption("shed-at", 0l);
+    parser.addDocumentation("shed-at", "Reset queued connections once the listen queue is <percent> full", "<percent>");
+
+    // Limits
+    parser.newOption("max-lifetime");
+    parser.addDocumentation("max-lifetime", "Terminate handlers running for longer than <sec> seconds", "<sec>");
+    parser.newOption("idle-timeout");
+    parser.addDocumentation("idle-timeout", "Terminate handlers whose connection was idle for <sec> seconds; UNIX sockets need --relay", "<sec>");
+    parser.newOption("kill-grace", 5l);
+    parser.addDocumentation("kill-grace", "Seconds between SIGTERM and SIGKILL when terminating a handler", "<sec>");
+    parser.newOption("zygotes", 0l);
+    parser.addDocumentation("zygotes", "Spawn handlers through <n> small processes forked at startup, so spawning doesn't slow down as the server grows", "<n>");
+
+    // Resource control
+    parser.newOption("cgroup");
+    parser.addDocumentation("cgroup", "Run handlers in this cgroup v2 subtree, created if needed", "<path>");
+    parser.newOption("memory-max");
+    parser.addDocumentation("memory-max", "memory.max of the handler cgroup", "<bytes>");
+    parser.newOption("cpu-max");
+    parser.addDocumentation("cpu-max", "cpu.max of the handler cgroup", "<quota> [<period>]");
+    parser.newOption("pids-max");
+    parser.addDocumentation("pids-max", "pids.max of the handler cgroup", "<n>");
+    parser.newOption("io-max");
+    parser.addDocumentation("io-max", "io.max of the handler cgroup", "<maj:min> <limits>");
+
+    // Metrics
+    parser.newOption("metrics");
+    parser.addDocumentation("metrics", "Write Prometheus metrics to <file> every second and on SIGUSR1", "<file>");
+
+    // Status
+    parser.newOption("status");
+    parser.addDocumentation("status", "Publish live status for ncs-top in <file>, e.g. /run/ncs/<name>.status", "<file>");
+    parser.newOption("status-slots", 4096l);
+    parser.addDocumentation("status-slots", "Number of handlers listed in the status file", "<n>");
+
+    // Tracing
+    parser.newOption("trace");
+    parser.addDocumentation("trace", "Append a binary trace of connections to <file>", "<file>");
+    parser.newOption("trace-spans");
+    parser.addDocumentation("trace-spans", "Write Chrome trace JSON of connection spans to <file> on exit and SIGUSR1", "<file>");
+    parser.newOption("trace-spans-size", 65536l);
+    parser.addDocumentation("trace-spans-size", "Number of spans kept for --trace-spans", "<n>");
 
     parser.newArgument("exec", CmdParser::Variant::required);
-    parser.addDocumentation("exec", "The program command line");
+    parser.addDocumentation("exec", "The program command line. %h, %p, %l, %P, %i and %t expand to the peer address and port, the local address and port, the handler's pid and the time; %H to the peer's name, or its address without one; %I, %U and %G to the pid, uid and gid of a UNIX socket peer. The environment has PROTO, $PROTO{REMOTE,LOCAL}{IP,PORT} and $PROTOREMOTEHOST as under tcpserver, and NCS_CPU");
 
     try {
         args = parser.parse(argc, argv);
@@ -113,220 +291,1186 @@ static CmdParser::ArgumentMap parse_argv(int argc, char **argv)
     return args;
 }
 
-// Handle sockaddr structs
-union sockaddr_inet {
-    short family;
-    sockaddr_in in;
-    sockaddr_in6 in6;
-};
+static std::unordered_map<int, std::unique_ptr<Client>> pid_map;
+static std::unordered_map<Client*, std::unique_ptr<Client>> draining;
+static std::unique_ptr<Trace::Writer> trace_writer;
+static Timer trace_timer;       // flushes the trace a second after a record
+static std::unique_ptr<SpanTracer> span_tracer;
+static uint64_t accepted, cross_cpu, closed, failed;
+static uint64_t datagrams_dropped;
+
+static std::vector<int> listeners;
+static std::vector<std::string> unix_paths;    // to remove on exit
+static bool listening = true;
+static std::unordered_set<int> handed_off;      // --udp-wait: sockets a handler owns
+static std::unique_ptr<CircuitBreaker> breaker;
+static bool breaker_queue;
+static Timer resume_timer;
+static size_t max_children;
+static bool at_capacity;
+
+// Response cache
+static std::unique_ptr<ResponseCache> cache;
+static size_t cache_request_max;
+static const uint64_t REQUEST_TIMEOUT_MS = 10000;
+static std::unordered_map<Client*, std::unique_ptr<Client>> cache_pending;   // not handed to a handler
+
+// Connections waiting for a handler slot: cache misses, and with
+// --fair-queue all that were accepted at capacity
+static std::unique_ptr<FairQueue> spawn_queue;
+static bool fair_queueing;
+
+// TLS handshakes, done before anything else
+static std::unique_ptr<TlsContext> tls_context;
+static uint64_t tls_timeout_ms;
+static std::unordered_map<Client*, std::unique_ptr<Client>> handshaking;
+
+// Reverse DNS, waited for up to a deadline before the handler starts
+static std::unique_ptr<Resolver> resolver;
+static uint64_t resolve_deadline_ms;
+static uint64_t resolve_timeouts;
+static uint64_t resolve_serial;
+static std::unordered_map<uint64_t, std::unique_ptr<Client>> resolving;   // by serial, not address, so late answers can't hit a reused Client
+
+// Handlers spawned by processes forked while the server was still small
+static std::unique_ptr<Zygote> zygote;
+
+static std::string listen_name(const sockaddr_inet &addr)
+{
+    std::ostringstream os;
+    if (addr.family == AF_UNIX)
+        os << "unix:" << peername(addr);
+    else
+        os << peername(addr) << ":" << ntohs(addr.in.sin_port);
+    return os.str();
+}
 
-static char *peername(const sockaddr_inet &peer)
+static void open_listener(const sockaddr_inet &addr, socklen_t addr_size, bool udp, int backlog, bool dual_stack)
 {
-    static char straddr[INET6_ADDRSTRLEN+3] = "[";
+    int fd = socket(addr.family, (udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
 
-    inet_ntop(peer.family, &peer.in.sin_addr, straddr+1, sizeof(straddr)-2);
+    if (fd < 0)
+    {
+        cerr << "\033[31mError: ";
+        perror("socket");
+        cerr << "\033[0m";
+        exit(1);
+    }
 
-    if (peer.family == AF_INET6)
+    int zero = 0;
+    if (dual_stack && addr.family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)) == -1)
     {
-        strncpy(straddr + strlen(straddr), "]", 2);
-        return straddr;
+        cerr << "\033[31mError: ";
+        perror("IPV6_V6ONLY");
+        cerr << "\033[0m";
+        exit(1);
     }
-    else
-        return straddr+1;
+
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), addr_size) == -1)
+    {
+        cerr << "\033[31mError: ";
+        perror(("bind " + listen_name(addr)).c_str());
+        cerr << "\033[0m";
+        exit(1);
+    }
+
+    if (!udp && System::current().listen(fd, backlog) == -1)
+    {
+        cerr << "\033[31mError: ";
+        perror("listen");
+        cerr << "\033[0m";
+        exit(1);
+    }
+
+    listeners.push_back(fd);
+}
+
+// Thousands of listeners don't fit the usual soft limit of 1024 fds
+static void reserve_fds(size_t listener_count)
+{
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return;
+
+    // Leave room for the connections, relays and captures
+    rlim_t wanted = listener_count + 1024;
+    if (wanted <= rl.rlim_cur || rl.rlim_cur == rl.rlim_max)
+        return;
+
+    rl.rlim_cur = std::min(std::max(wanted, rl.rlim_cur), rl.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &rl);
 }
 
-static std::string int2s(int i)
+// Local peers are told apart by their credentials rather than their address
+static std::string client_name(Client &c)
 {
     std::ostringstream os;
-    os << i;
+    ucred cred;
+    if (c.peer.family != AF_UNIX)
+        os << c.peername() << ":" << c.port();
+    else if (c.credentials(cred))
+        os << c.peername() << " pid " << cred.pid << " uid " << cred.uid;
+    else
+        os << c.peername();
     return os.str();
 }
 
-// Represents a Client process
-struct Client
+// Connections wait in the listen queue while the circuit breaker
+// holds them back or all handler slots are taken, unless they are
+// to be queued fairly
+static void update_accepting(Reactor &reactor)
 {
-    // Members
-    int fd;
-    sockaddr_inet peer;
-    int pass;
-    const std::vector<std::string> &exec_argv;
-    std::vector<char*> argv;
+    bool on = !resume_timer.armed() && (!at_capacity || fair_queueing);
+    if (on == listening)
+        return;
 
-    // -------------------------------------------------------------------
-    // Accept a new client
-    static std::unique_ptr<Client> accept(int fd, int pass, const std::vector<std::string> &exec_argv)
-    {
-        sockaddr_inet sa;
-        socklen_t sa_size = sizeof(sa);
-        int sock = ::accept(fd, reinterpret_cast<sockaddr*>(&sa), &sa_size);
+    listening = on;
+    for (int fd : listeners)
+        reactor.modify(fd, on && !handed_off.count(fd) ? static_cast<uint32_t>(EPOLLIN) : 0);
+}
 
+// A --udp-wait handler is done with its socket
+static void take_back_socket(Reactor &reactor, const Client &c)
+{
+    if (c.listener < 0)
+        return;
+
+    handed_off.erase(c.listener);
+    if (listening)
+        reactor.modify(c.listener, EPOLLIN);
+}
+
+static void pause_accepting(Reactor &reactor, uint64_t until_ms)
+{
+    resume_timer.callback = [&reactor]() {
+        update_accepting(reactor);
+    };
+    uint64_t now = reactor.now_ms();
+    reactor.timers().arm(resume_timer, now, until_ms > now ? until_ms - now : 0);
+    update_accepting(reactor);
+}
+
+static void resume_accepting(Reactor &reactor)
+{
+    resume_timer.cancel();
+    update_accepting(reactor);
+}
+
+// Listen queue monitoring
+static uint32_t queue_depth, queue_limit, queue_peak;
+static bool queue_warned;
+static unsigned shed_percent;
+static uint64_t shed;
+static Timer queue_timer;
+static bool queue_idle;
+static std::vector<TcpStats> queue_stats;   // last sample of each listener
+static size_t queue_cursor;
+static const size_t QUEUE_SAMPLES = 64;     // listeners looked at per tick
+
+// Reset connections from the head of a queue until it is half empty,
+// so clients fail fast instead of having their SYNs dropped
+static void shed_queue(int fd, const TcpStats &st)
+{
+    // With --shed-at below 50 the queue can be over the mark and still
+    // no more than half full
+    if (st.unacked <= st.sacked / 2)
+        return;
+
+    for (uint32_t n = st.unacked - st.sacked / 2; n > 0; --n)
+    {
+        int sock = System::current().accept(fd, NULL, NULL, SOCK_CLOEXEC);
         if (sock < 0)
-            return nullptr;
+            break;
+
+        linger lg;
+        lg.l_onoff = 1;
+        lg.l_linger = 0;
+        setsockopt(sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        System::current().close(sock);
+        ++shed;
+    }
+}
+
+static void status_changed(Reactor &reactor);
+static void expire_queued(Reactor &reactor);
+
+static void watch_queues(Reactor &reactor)
+{
+    uint32_t depth = 0, limit = 0;
 
-        return std::unique_ptr<Client>(new Client(sock, sa, pass, exec_argv));
+    // With thousands of listeners, only look at a few each tick and
+    // keep the last figures of the rest
+    queue_stats.resize(listeners.size());
+    size_t samples = std::min(listeners.size(), QUEUE_SAMPLES);
+    for (size_t n = 0; n < samples; ++n)
+    {
+        size_t i = queue_cursor++ % listeners.size();
+        TcpStats &st = queue_stats[i];
+        if (!tcp_stats(listeners[i], st))
+            st = TcpStats();
+
+        if (shed_percent && st.sacked && st.unacked * 100 >= st.sacked * shed_percent)
+            shed_queue(listeners[i], st);
     }
 
-    Client(int client_fd, const sockaddr_inet &client_peer, int client_pass_stdstreams, const std::vector<std::string> &client_exec_argv) :
-        fd(client_fd), peer(client_peer),  pass(client_pass_stdstreams), exec_argv(client_exec_argv)
+    for (const TcpStats &st : queue_stats)
     {
+        depth += st.unacked;
+        limit += st.sacked;
     }
 
-    // -------------------------------------------------------------------
-    // Get the client's name (IP address) and port
-    char *peername()
+    queue_depth = depth;
+    queue_limit = limit;
+    queue_peak = std::max(queue_peak, depth);
+
+    // Warn at three quarters, and again once it went below half
+    if (!queue_warned && limit && depth * 4 >= limit * 3)
     {
-        return ::peername(peer);
+        cerr << "\033[33mWarning: Listen queue at \033[35m" << depth << "/" << limit << "\033[0m" << endl;
+        queue_warned = true;
     }
+    else if (queue_warned && depth * 2 < limit)
+    {
+        cerr << "\033[36mListen queue back at \033[35m" << depth << "/" << limit << "\033[0m" << endl;
+        queue_warned = false;
+    }
+
+    if (!spawn_queue->empty())
+        expire_queued(reactor);
+
+    status_changed(reactor);
+
+    // Sample less often while there's nothing going on
+    queue_idle = depth == 0 && pid_map.empty();
+    reactor.timers().arm(queue_timer, reactor.now_ms(), queue_idle ? 1000 : 100);
+}
+
+// Turn a connection away with a RST, without spawning anything
+static void reject(Client &c)
+{
+    linger lg;
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    setsockopt(c.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+}
+
+// Reset a connection that was accepted but won't get a handler
+static void turn_away(Reactor &reactor, std::unique_ptr<Client> c)
+{
+    reject(*c);
+
+    // Connections waiting for its response try on their own
+    if (cache && !c->cache_key.empty())
+        cache->fill(c->cache_key, nullptr, reactor.now_ms());
+}
+
+static void expire_queued(Reactor &reactor)
+{
+    std::vector<std::unique_ptr<Client>> expired;
+    spawn_queue->expire(reactor.now_ms(), expired);
+    for (std::unique_ptr<Client> &c : expired)
+        turn_away(reactor, std::move(c));
+}
+
+static uint64_t mono_ns(const timespec &ts)
+{
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_spans(Client &c, int pid, int status)
+{
+    timespec now;
+    System::current().clock_gettime(CLOCK_MONOTONIC, &now);
+
+    std::ostringstream args;
+    args << "\"peer\":\"" << c.peername() << "\",\"port\":" << c.port() << ",\"status\":" << status;
+
+    span_tracer->span("connection", pid, mono_ns(c.accepted_mono), mono_ns(now), args.str());
+    span_tracer->span("spawn", pid, mono_ns(c.accepted_mono), mono_ns(c.spawned_mono));
+    span_tracer->span("handler", pid, mono_ns(c.spawned_mono), mono_ns(c.reaped_mono));
+    if (c.relay || c.capture)
+        span_tracer->span("drain", pid, mono_ns(c.reaped_mono), mono_ns(now));
+}
+
+// Live status
+static std::unique_ptr<Status::Writer> status_writer;
+static uint32_t unlisted;
+static bool status_posted;
+static Timer status_timer;
+
+static void publish_status()
+{
+    Status::Counters c;
+    std::memset(&c, 0, sizeof(c));
+    c.accepted = accepted;
+    c.closed = closed;
+    c.failed = failed;
+    c.rejected = breaker ? breaker->rejected : 0;
+    c.shed = shed;
+    c.running = static_cast<uint32_t>(pid_map.size());
+    c.draining = static_cast<uint32_t>(draining.size());
+    c.queue_depth = queue_depth;
+    c.queue_limit = queue_limit;
+    c.unlisted = unlisted;
+    c.circuit = breaker ? breaker->state() : 0;
+    status_writer->update(c);
+}
+
+// Once per loop iteration, however much happened in it
+static void status_changed(Reactor &reactor)
+{
+    if (!status_writer || status_posted)
+        return;
+
+    status_posted = true;
+    reactor.post([]() {
+        status_posted = false;
+        publish_status();
+    });
+}
+
+static void list_client(Client &c)
+{
+    Status::Slot slot;
+    std::memset(&slot, 0, sizeof(slot));
+    slot.state = Status::running;
+    slot.family = static_cast<uint16_t>(c.peer.family);
+    slot.pid = c.pid;
+    slot.cpu = c.cpu;
+    slot.port = c.port();
+    if (c.peer.family == AF_INET6)
+        std::memcpy(slot.addr, &c.peer.in6.sin6_addr, 16);
+    else if (c.peer.family == AF_INET)
+        std::memcpy(slot.addr, &c.peer.in.sin_addr, 4);
+    slot.started_ns = static_cast<uint64_t>(c.accepted_real.tv_sec) * 1000000000 + c.accepted_real.tv_nsec;
+
+    c.status_slot = status_writer->add(slot);
+    if (c.status_slot < 0)
+        ++unlisted;
+}
+
+// Relays count bytes all the time; the status file gets them every second
+static void publish_bytes(Reactor &reactor)
+{
+    for (auto &entry : pid_map)
+        if (entry.second->relay && entry.second->status_slot >= 0)
+            status_writer->set_bytes(entry.second->status_slot, entry.second->relay->bytes_in, entry.second->relay->bytes_out);
+    for (auto &entry : draining)
+        if (entry.second->relay && entry.second->status_slot >= 0)
+            status_writer->set_bytes(entry.second->status_slot, entry.second->relay->bytes_in, entry.second->relay->bytes_out);
+
+    reactor.timers().arm(status_timer, reactor.now_ms(), 1000);
+}
+
+// Service manager notifications
+static LoopLag loop_lag;
+static uint64_t watchdog_lag_ms;
+static Timer notify_timer;
+static Timer watchdog_timer;
+
+static void notify_status(Reactor &reactor)
+{
+    std::ostringstream os;
+    os << "STATUS=" << (listening ? "Accepting" : "Paused")
+       << ", " << accepted << " accepted, " << pid_map.size() << " running, "
+       << draining.size() << " draining, queue " << queue_depth << "/" << queue_limit
+       << ", loop lag p99 " << loop_lag.quantile_us(0.99) / 1000.0 << "ms";
+    sd_notify(0, os.str().c_str());
+
+    reactor.timers().arm(notify_timer, reactor.now_ms(), 1000);
+}
+
+// Only vouch for the loop if it has been keeping up; the service manager
+// restarts us after a watchdog period without pings
+static void feed_watchdog(Reactor &reactor, uint64_t interval_ms)
+{
+    uint64_t worst_us = loop_lag.take_worst();
+    if (!watchdog_lag_ms || worst_us < watchdog_lag_ms * 1000)
+        sd_notify(0, "WATCHDOG=1");
+    else
+        cerr << "\033[33mWarning: Event loop lagged \033[35m" << worst_us / 1000
+             << "ms\033[33m, withholding watchdog ping\033[0m" << endl;
 
-    uint16_t port()
+    reactor.timers().arm(watchdog_timer, reactor.now_ms(), interval_ms);
+}
+
+// Socket activated services give the socket back to systemd when idle;
+// connections arriving meanwhile wait in its listen queue and start us again
+static uint64_t idle_exit_ms, last_active_ms;
+static Timer idle_exit_timer;
+static bool idled_out;
+
+static bool connections_pending()
+{
+    std::vector<pollfd> fds;
+    for (int fd : listeners)
+        fds.push_back(pollfd{fd, POLLIN, 0});
+    return poll(fds.data(), fds.size(), 0) > 0;
+}
+
+static void check_idle_exit(Reactor &reactor)
+{
+    uint64_t idle = reactor.now_ms() - last_active_ms;
+    if (!pid_map.empty() || !draining.empty() || !cache_pending.empty() || !handshaking.empty() || !resolving.empty() ||
+        !spawn_queue->empty() || connections_pending())
+        idle = 0;
+
+    if (idle < idle_exit_ms)
     {
-        return ntohs(peer.in.sin_port);
+        reactor.timers().arm(idle_exit_timer, reactor.now_ms(), idle_exit_ms - idle);
+        return;
     }
 
-    // -------------------------------------------------------------------
-    // Start/Fork the client process
-    int start()
+    cerr << "\033[36mIdle for \033[35m" << idle / 1000 << "s\033[36m, exiting. The socket stays with systemd.\033[0m" << endl;
+    sd_notify(0, "STOPPING=1");
+    idled_out = true;
+    reactor.stop();
+}
+
+static void write_spans()
+{
+    if (!span_tracer->write())
     {
-        int pid;
+        cerr << "\033[31mError: ";
+        perror(span_tracer->path().c_str());
+        cerr << "\033[0m";
+    }
+}
+
+// The writer only flushes by itself when more records follow
+static void record_trace(Reactor &reactor, const Trace::Record &record)
+{
+    trace_writer->append(record);
+    if (!trace_timer.armed())
+        reactor.timers().arm(trace_timer, reactor.now_ms(), 1000);
+}
+
+static void connection_closed(Reactor &reactor, Client &c, int pid, int status)
+{
+    cerr << "\033[36mConnection lost: \033[35m" << c.peername() << "\033[36m [\033[35m"
+            << pid << "\033[36m]";
+    if (c.relay)
+        cerr << " \033[35m" << c.relay->bytes_in << "\033[36m in, \033[35m"
+             << c.relay->bytes_out << "\033[36m out";
+    cerr << "\033[0m" << endl;
+
+    ++closed;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ++failed;
+
+    if (c.relay)
+        NCS_PROBE3(close, pid, c.relay->bytes_in, c.relay->bytes_out);
+    else
+        NCS_PROBE3(close, pid, 0, 0);
 
-        if ((pid = fork()) != 0)
-            return pid;
+    if (trace_writer)
+        record_trace(reactor, c.trace_record(status));
 
-        run();
+    if (span_tracer)
+        trace_spans(c, pid, status);
+
+    if (status_writer && c.status_slot >= 0)
+    {
+        status_writer->remove(c.status_slot);
+        c.status_slot = -1;
     }
 
-    // -------------------------------------------------------------------
-    // Handle the Client process argv
-    // NOTE: Memory leaks aren't a problem because we'll be exec()ing soon anyway
-    template <typename T>
-    std::string ref_var(const T &var)
+    // Only a complete output of a successful handler is worth keeping
+    if (cache && !c.cache_key.empty())
     {
-        // This is where the variables are defined.
-        if (var[1] == "h") // Peer hostname
-            return peername();
-        if (var[1] == "p") // Peer port
-            return int2s(port());
-        if (var[1] == "i") // PID
-            return int2s(getpid());
-        if (var[1] == "t") // Connection time
-        {
-            // We pretend now == connection time^^
-            std::time_t t(std::time(NULL));
-            return std::ctime(&t);
-        }
-        return var.str();
+        std::string output;
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && c.relay && c.relay->recorded(output);
+        cache->fill(c.cache_key, ok ? std::make_shared<const std::string>(std::move(output)) : nullptr, reactor.now_ms());
     }
+}
+
+static bool spawn_client(Reactor &reactor, std::unique_ptr<Client> client);
 
-    char *regex_replace_var(const std::string &str)
+static void reap_children(Reactor &reactor)
+{
+    int pid, status;
+
+    while ((pid = System::current().waitpid(-1, &status, WNOHANG)) > 0)
     {
-        static std::regex re("\\%([^\\%])");
+        auto it = pid_map.find(pid);
+        if (it == pid_map.end())
+        {
+            if (zygote && zygote->reaped(pid))
+                continue;
+            cerr<< "\033[31m Unknown Connection lost: [\033[35m" << pid << "\033[31m]\033[0m" << endl;
+            continue;
+        }
+
+        // HACK to move item from stl container
+        std::unique_ptr<Client> c (std::move(it->second));
+        pid_map.erase(it);
+        take_back_socket(reactor, *c);
+
+        if (at_capacity && pid_map.size() < max_children)
+        {
+            at_capacity = false;
+
+            // Connections held back at capacity come first
+            expire_queued(reactor);
+            while (!at_capacity)
+            {
+                std::unique_ptr<Client> next = spawn_queue->pop(reactor.now_ms());
+                if (!next)
+                    break;
+                spawn_client(reactor, std::move(next));
+            }
+            if (!at_capacity)
+                update_accepting(reactor);
+        }
 
-        auto i = std::sregex_iterator(str.begin(), str.end(), re);
-        auto i_end = decltype(i)();
-        auto last_i = i;
+        c->exited();
+        last_active_ms = reactor.now_ms();
+        NCS_PROBE3(reap, pid, status, (mono_ns(c->reaped_mono) - mono_ns(c->accepted_mono)) / 1000);
 
-        if (i == i_end)
-            return const_cast<char*>(str.c_str());
+        if (breaker)
+        {
+            bool failure = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+            breaker->record(reactor.now_ms(), c->lifetime_ms(), failure);
+            if (!breaker->blocked(reactor.now_ms()))
+                resume_accepting(reactor);
+        }
 
-        std::string res;
-        for (; i != i_end; ++i)
+        status_changed(reactor);
+
+        // Keep relaying whatever output is still in the pipes
+        if (c->busy())
         {
-            res.reserve(res.size() + i->prefix().length());
-            std::copy(i->prefix().first, i->prefix().second, std::back_inserter(res));
-            res += ref_var(*i);
-            last_i = i;
+            if (status_writer && c->status_slot >= 0)
+                status_writer->set_state(c->status_slot, Status::draining);
+
+            Client *cp = c.get();
+            cp->on_idle = [&reactor, cp, pid, status]() {
+                connection_closed(reactor, *cp, pid, status);
+                last_active_ms = reactor.now_ms();
+                reactor.post([cp]() {
+                    draining.erase(cp);
+                });
+            };
+            draining.emplace(cp, std::move(c));
+            continue;
         }
-        res.reserve(res.size() + last_i->suffix().length());
-        std::copy(last_i->suffix().first, last_i->suffix().second, std::back_inserter(res));
 
-        char *ret = new char[res.size() + 1];
-        std::strncpy(ret, res.c_str(), res.size() + 1);
-        return ret;
+        connection_closed(reactor, *c, pid, status);
+    }
+}
+
+// Start the handler; false once all handler slots are taken
+static bool spawn_client(Reactor &reactor, std::unique_ptr<Client> client)
+{
+    cerr << "\033[36mConnected: \033[35m" << client_name(*client) << "\033[0m";
+
+    ++accepted;
+    last_active_ms = reactor.now_ms();
+    if (client->cpu >= 0 && client->cpu != sched_getcpu())
+        ++cross_cpu;
+
+    int pid = client->start(reactor);
+
+    cerr << " \033[36m[\033[35m" << pid << "\033[36m]\033[0m" << endl;
+
+    if (pid < 0)
+    {
+        // Pipes, socket pairs and captures fail here as well as fork()
+        cerr << "\033[31mError: ";
+        perror("spawn");
+        cerr << "\033[0m";
+
+        take_back_socket(reactor, *client);
+
+        // Connections waiting for its response try on their own
+        if (cache && !client->cache_key.empty())
+            cache->fill(client->cache_key, nullptr, reactor.now_ms());
+        return true;
     }
 
-    void prepare_argv()
+    // Keep the socket around for TCP_INFO when tracing or watching for idleness
+    if (client->fd >= 0 && !trace_writer && !client->relay && !client->tls && !client->service.idle_timeout_ms)
     {
-        argv.reserve(exec_argv.size() + 1);
-        std::transform(exec_argv.begin(), exec_argv.end(), std::back_inserter(argv),
-                       [this](const std::string &str){return this->regex_replace_var(str);}
-                       );
-        argv.push_back(NULL);
+        System::current().close(client->fd);
+        client->fd = -1;
     }
+    if (status_writer)
+        list_client(*client);
+    status_changed(reactor);
 
-    // -------------------------------------------------------------------
-    // Execute the client process
-    void __attribute__((noreturn)) run()
+    pid_map.emplace(pid, std::move(client));
+
+    if (max_children && pid_map.size() >= max_children)
     {
-        prepare_argv();
+        at_capacity = true;
+        update_accepting(reactor);
+        return false;
+    }
+    return true;
+}
 
-        cerr << "\033[36m[\033[35m" << getpid() << "\033[36m] Calling: \033[35m";
-        cerr << argv[0];
-        for (size_t i=1; i<argv.size()-1; ++i)
-            cerr << " " << argv[i];
-        cerr << "\033[0m" << endl;
+// Connections that come in while all handler slots are taken wait
+// for one instead of going over the limit
+static void start_client(Reactor &reactor, std::unique_ptr<Client> client)
+{
+    if (!at_capacity)
+    {
+        spawn_client(reactor, std::move(client));
+        return;
+    }
 
-        dup2(2, 200);
-        fcntl(200, F_SETFD, FD_CLOEXEC);
+    std::unique_ptr<Client> dropped = spawn_queue->push(std::move(client), reactor.now_ms());
+    if (dropped)
+        turn_away(reactor, std::move(dropped));
+}
 
-        if (pass & PASS_IN)
-            dup2(fd, 0);
-        if (pass & PASS_OUT)
-            dup2(fd, 1);
-        if (pass & PASS_ERR)
-            dup2(fd, 2);
+static std::unique_ptr<Client> take_pending(Client *cp)
+{
+    auto it = cache_pending.find(cp);
+    std::unique_ptr<Client> c(std::move(it->second));
+    cache_pending.erase(it);
+    return c;
+}
 
-        execvp(argv[0], argv.data());
+static void answer_cached(Reactor &reactor, Client *cp, size_t request_size, ResponseCache::Response response)
+{
+    cerr << "\033[36mCached: \033[35m" << client_name(*cp) << "\033[36m, \033[35m"
+         << response->size() << "\033[36m bytes\033[0m" << endl;
+
+    ++accepted;
+    cp->cached.reset(new CachedReply(reactor, cp->fd, response));
+    cp->cached->on_done = [&reactor, cp]() {
+        ++closed;
+        last_active_ms = reactor.now_ms();
+        if (trace_writer)
+            record_trace(reactor, cp->trace_record(0));
+        reactor.post([cp]() {
+            cache_pending.erase(cp);
+        });
+    };
+    cp->cached->start(request_size);
+}
+
+static void lookup_request(Reactor &reactor, Client *cp, int state, const std::string &key)
+{
+    reactor.remove(cp->fd);
+    cp->request_timer.cancel();
 
-        // restore stderr
-        dup2(200, 2);
+    // Too long, or too slow in coming
+    if (state < 0)
+    {
+        start_client(reactor, take_pending(cp));
+        return;
+    }
+
+    ResponseCache::Response response = cache->find(key, reactor.now_ms());
+    if (response)
+    {
+        answer_cached(reactor, cp, key.size(), response);
+        return;
+    }
+
+    size_t request_size = key.size();
+    bool waiting = cache->join(key, [&reactor, cp, request_size](ResponseCache::Response response) {
+        if (response)
+            answer_cached(reactor, cp, request_size, response);
+        else
+            start_client(reactor, take_pending(cp));
+    });
+
+    if (!waiting)
+    {
+        cp->cache_key = key;
+        start_client(reactor, take_pending(cp));
+    }
+}
+
+// Peek at the request line before deciding whether to spawn a handler
+static void read_request(Reactor &reactor, std::unique_ptr<Client> client)
+{
+    Client *cp = client.get();
+    cache_pending.emplace(cp, std::move(client));
+    last_active_ms = reactor.now_ms();
+
+    // Edge triggered, the peeked data stays readable
+    reactor.add(cp->fd, EPOLLIN | EPOLLRDHUP | EPOLLET, [&reactor, cp](uint32_t events) {
+        std::string key;
+        int state = peek_request(cp->fd, '\n', cache_request_max, events & (EPOLLRDHUP | EPOLLHUP), key);
+        if (state != 0)
+            lookup_request(reactor, cp, state, key);
+    });
+
+    cp->request_timer.callback = [&reactor, cp]() {
+        lookup_request(reactor, cp, -1, std::string());
+    };
+    reactor.timers().arm(cp->request_timer, reactor.now_ms(), REQUEST_TIMEOUT_MS);
+}
+
+// A connection past the breaker and the name lookup; false once all
+// handler slots are taken
+static bool admit_client(Reactor &reactor, std::unique_ptr<Client> client)
+{
+    if (cache)
+        read_request(reactor, std::move(client));
+    else if (fair_queueing || at_capacity)
+        start_client(reactor, std::move(client));
+    else
+        return spawn_client(reactor, std::move(client));
+    return true;
+}
+
+static void resolved(Reactor &reactor, uint64_t id, const std::string &name)
+{
+    // Already started without it
+    auto it = resolving.find(id);
+    if (it == resolving.end())
+        return;
+
+    std::unique_ptr<Client> client(std::move(it->second));
+    resolving.erase(it);
+    client->resolve_timer.cancel();
+    client->hostname = name;
+    admit_client(reactor, std::move(client));
+}
+
+// Park the connection until its peer's name is known, or the deadline;
+// false if it's known already
+static bool resolve_client(Reactor &reactor, std::unique_ptr<Client> &client)
+{
+    uint64_t id = ++resolve_serial;
+    if (resolver->lookup(client->peer, client->hostname, [&reactor, id](const std::string &name) {
+            resolved(reactor, id, name);
+        }))
+        return false;
+
+    Client *cp = client.get();
+    cp->resolve_timer.callback = [&reactor, id]() {
+        ++resolve_timeouts;
+        resolved(reactor, id, std::string());
+    };
+    reactor.timers().arm(cp->resolve_timer, reactor.now_ms(), resolve_deadline_ms);
+    resolving.emplace(id, std::move(client));
+    last_active_ms = reactor.now_ms();
+    return true;
+}
+
+// Called from the session, which can't be destroyed right away
+static void handshake_done(Reactor &reactor, Client *cp, bool ok)
+{
+    cp->handshake_timer.cancel();
+
+    if (!ok)
+    {
+        cerr << "\033[33mTLS failed: \033[35m" << client_name(*cp) << "\033[33m, " << cp->tls->error() << "\033[0m" << endl;
+        reactor.post([cp]() {
+            handshaking.erase(cp);
+        });
+        return;
+    }
+
+    auto it = handshaking.find(cp);
+    std::unique_ptr<Client> client(std::move(it->second));
+    handshaking.erase(it);
+
+    cerr << "\033[36mTLS: \033[35m" << client_name(*cp) << "\033[36m, " << cp->tls->describe()
+         << (cp->tls->offloaded() ? ", kernel TLS" : ", userspace") << "\033[0m" << endl;
+
+    // The handler gets the socket itself once the kernel does the crypto
+    if (cp->tls->offloaded())
+    {
+        TlsSession *session = cp->tls.release();
+        reactor.post([session]() {
+            delete session;
+        });
+    }
+
+    if (!resolver || !resolve_client(reactor, client))
+        admit_client(reactor, std::move(client));
+}
 
+// Handshake before the connection goes any further
+static void start_handshake(Reactor &reactor, std::unique_ptr<Client> client)
+{
+    Client *cp = client.get();
+    cp->tls.reset(new TlsSession(reactor, cp->fd, *tls_context));
+    if (!cp->tls->handshake())
+    {
         cerr << "\033[31mError: ";
-        perror("exec");
+        perror("TLS");
         cerr << "\033[0m";
+        return;
+    }
 
-        exit(1);
+    handshaking.emplace(cp, std::move(client));
+    last_active_ms = reactor.now_ms();
+
+    cp->tls->on_handshake = [&reactor, cp](bool ok) {
+        handshake_done(reactor, cp, ok);
+    };
+    cp->handshake_timer.callback = [&reactor, cp]() {
+        ++tls_context->failures;
+        cerr << "\033[33mTLS timed out: \033[35m" << client_name(*cp) << "\033[0m" << endl;
+        cp->tls.reset();
+        reactor.post([cp]() {
+            handshaking.erase(cp);
+        });
+    };
+    reactor.timers().arm(cp->handshake_timer, reactor.now_ms(), tls_timeout_ms);
+}
+
+static void accept_clients(Reactor &reactor, int fd, const Service &service)
+{
+    // Bound the batch so reaping and relaying don't starve,
+    // unless the queue is backing up
+    size_t batch_size = 64;
+    TcpStats st;
+    if (tcp_stats(fd, st))
+    {
+        batch_size = std::max<size_t>(batch_size, st.unacked);
+        queue_peak = std::max(queue_peak, st.unacked);
     }
-};
 
-static int sock_fd = -1;
-static std::unordered_map<int, std::unique_ptr<Client>> pid_map;
+    if (queue_idle)
+    {
+        queue_idle = false;
+        reactor.timers().arm(queue_timer, reactor.now_ms(), 100);
+    }
+
+    for (size_t batch = 0; batch < batch_size; ++batch)
+    {
+        if (breaker && breaker_queue && breaker->blocked(reactor.now_ms()))
+        {
+            pause_accepting(reactor, breaker->retry_at());
+            return;
+        }
+
+        std::unique_ptr<Client> client = Client::accept(fd, service);
+
+        if (client == nullptr)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+            cerr << "\033[31mError: ";
+            perror("accept");
+            cerr << "\033[0m";
+            return;
+        }
+
+        if (breaker && !breaker->allow(reactor.now_ms()))
+        {
+            reject(*client);
+            continue;
+        }
+
+        if (tls_context)
+        {
+            start_handshake(reactor, std::move(client));
+            continue;
+        }
+
+        if (resolver && resolve_client(reactor, client))
+            continue;
 
-static void __attribute__((noreturn)) sigint_handler(int)
+        if (!admit_client(reactor, std::move(client)))
+            return;
+    }
+}
+
+// inetd "wait" mode: the handler gets the socket itself and the server
+// leaves it alone until the handler exits
+static void hand_off_socket(Reactor &reactor, int fd, const Service &service)
 {
-    cerr << "\033[31mCaught SIGINT. Shutting down.\033[0m" << endl;
-    if (sock_fd >= 0)
+    if (breaker && breaker_queue && breaker->blocked(reactor.now_ms()))
+    {
+        pause_accepting(reactor, breaker->retry_at());
+        return;
+    }
+
+    // Name the client by whoever sent the first datagram
+    sockaddr_inet peer;
+    socklen_t peer_size = sizeof(peer);
+    std::memset(&peer, 0, sizeof(peer));
+    char c;
+    if (recvfrom(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT, reinterpret_cast<sockaddr*>(&peer), &peer_size) < 0)
+        return;
+    unmap_v4(peer);
+
+    if (breaker && !breaker->allow(reactor.now_ms()))
     {
-        close(sock_fd);
-        sock_fd = -1;
+        // Consume it, or it would be back right away
+        recv(fd, &c, 1, MSG_DONTWAIT);
+        return;
     }
-    exit(2);
+
+    int sock = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        cerr << "\033[31mError: ";
+        perror("dup");
+        cerr << "\033[0m";
+        return;
+    }
+
+    // Other sockets keep being served meanwhile
+    std::unique_ptr<Client> client(new Client(sock, peer, service));
+    client->listener = fd;
+    handed_off.insert(fd);
+    reactor.modify(fd, 0);
+
+    spawn_client(reactor, std::move(client));
 }
 
-static void sigchld_handler(int, siginfo_t *si, void *)
+// Per-datagram mode: one handler per request
+static void receive_datagrams(Reactor &reactor, DatagramSocket &sock, const Service &service)
 {
-    auto it = pid_map.find(si->si_pid);
-    if (it == pid_map.end())
-        cerr<< "\033[31m Unknown Connection lost: [\033[35m" << si->si_pid << "\033[31m]\033[0m" << endl;
-    else
+    if (breaker && breaker_queue && breaker->blocked(reactor.now_ms()))
     {
-        // HACK to move item from stl container
-        std::unique_ptr<Client> c (std::move(it->second));
-        pid_map.erase(it);
+        pause_accepting(reactor, breaker->retry_at());
+        return;
+    }
+
+    // Only take what there are handler slots for; the rest waits in the socket
+    size_t room = max_children ? max_children - pid_map.size() : SIZE_MAX;
 
-        cerr << "\033[36mConnection lost: \033[35m" << c->peername() << "\033[36m [\033[35m"
-                << si->si_pid << "\033[36m]\033[0m" << endl;
+    for (const DatagramSocket::Datagram &dg : sock.receive(room))
+    {
+        if (breaker && !breaker->allow(reactor.now_ms()))
+            continue;
+
+        // GRO can hand out more datagrams than were asked for
+        if (at_capacity)
+        {
+            ++datagrams_dropped;
+            continue;
+        }
+
+        std::unique_ptr<Client> client = Client::datagram(reactor, sock, dg, service);
+        if (client == nullptr)
+        {
+            cerr << "\033[31mError: ";
+            perror("request");
+            cerr << "\033[0m";
+            continue;
+        }
+
+        // Datagrams aren't held back; the name is there if it's cached
+        if (resolver)
+            resolver->lookup(client->peer, client->hostname, [](const std::string &) {});
+
+        spawn_client(reactor, std::move(client));
     }
 }
 
+// ncs-sim brings its own main() and runs this against a simulated kernel
+int serve(int argc, char **argv);
+
+#ifndef NCS_SIM
 int main(int argc, char **argv)
+{
+    return serve(argc, argv);
+}
+#endif
+
+int serve(int argc, char **argv)
 {
     cerr << "\033[32mThis is \033[33mNetCatServer 1.0 \033[34m(c) 2014 Taeyeon Mori" << endl;
     cerr << "\033[32mThis program comes with \033[31mABSOLUTELY NO WARRANTY\033[32m.\033[0m" << endl;
     CmdParser::ArgumentMap args = parse_argv(argc, argv);
 
     // Parse exec line
-    std::vector<std::string> exec_argv = CmdParser::splitArgs(args["exec"].toString());
-    int pass = (args["stdin"].toBool() ? PASS_IN : 0) | (args["stdout"].toBool() ? PASS_OUT : 0) | (args["stderr"].toBool() ? PASS_ERR : 0);
+    Service service;
+    std::vector<std::string> &exec_argv = service.exec_argv;
+    exec_argv = CmdParser::splitArgs(args["exec"].toString());
+    service.pass = (args["stdin"].toBool() ? PASS_IN : 0) | (args["stdout"].toBool() ? PASS_OUT : 0) | (args["stderr"].toBool() ? PASS_ERR : 0);
+    service.relay = args["relay"].toBool();
+    service.log_sink = nullptr;
+    service.cgroup = nullptr;
+    service.zygote = nullptr;
+    service.cache = nullptr;
+    service.env = nullptr;
+    service.max_lifetime_ms = args["max-lifetime"].isVoid() ? 0 : args["max-lifetime"].toNumber() * 1000;
+    service.idle_timeout_ms = args["idle-timeout"].isVoid() ? 0 : args["idle-timeout"].toNumber() * 1000;
+    service.kill_grace_ms = args["kill-grace"].toNumber() * 1000;
+
+    // Before anything big is allocated; the zygotes stay the size the server is now
+    if (args["zygotes"].toNumber() > 0)
+    {
+        if (!args["cgroup"].isVoid())
+        {
+            cerr << "\033[31mError: --zygotes can't spawn into a --cgroup\033[0m" << endl;
+            exit(1);
+        }
+
+        try {
+            zygote.reset(new Zygote(static_cast<unsigned>(args["zygotes"].toNumber())));
+        } catch (ZygoteError &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+            exit(1);
+        }
+        service.zygote = zygote.get();
+        cerr << "\033[36mSpawning handlers through \033[35m" << zygote->size() << "\033[36m zygotes\033[0m" << endl;
+    }
+
+    try {
+        if (!args["pacing-rate"].isVoid())
+            service.socket_profile.pacing_rate = SocketProfile::parse_rate(args["pacing-rate"].toString());
+        if (!args["source-rate"].isVoid())
+            service.socket_profile.parse_sources(args["source-rate"].toString());
+        if (!args["tcp-profile"].isVoid())
+            service.socket_profile.parse_tcp(args["tcp-profile"].toString());
+    } catch (ShapingError &e) {
+        cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+        exit(1);
+    }
+
+    try {
+        ChildSched &sched = service.child_sched;
+        if (!args["child-nice"].isVoid())
+        {
+            sched.set_nice = true;
+            sched.nice = static_cast<int>(args["child-nice"].toNumber());
+        }
+        if (!args["child-sched"].isVoid())
+            sched.parse_policy(args["child-sched"].toString());
+        if (!args["child-ioprio"].isVoid())
+            sched.parse_ioprio(args["child-ioprio"].toString());
+        if (!args["child-timerslack"].isVoid())
+            sched.timerslack = static_cast<unsigned long>(args["child-timerslack"].toNumber());
+    } catch (SchedError &e) {
+        cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+        exit(1);
+    }
+
+    try {
+        if (!args["cpu-affinity"].isVoid())
+            service.placement.parse(args["cpu-affinity"].toString());
+    } catch (AffinityError &e) {
+        cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+        exit(1);
+    }
+
+    if (!args["cache"].isVoid())
+    {
+        if ((service.pass & (PASS_IN | PASS_OUT)) != (PASS_IN | PASS_OUT))
+        {
+            cerr << "\033[31mError: --cache needs the handler's stdin and stdout (-i -o)\033[0m" << endl;
+            exit(1);
+        }
+
+        size_t budget = 64 << 20;
+        try {
+            if (!args["cache-size"].isVoid())
+                budget = static_cast<size_t>(SocketProfile::parse_rate(args["cache-size"].toString()));
+        } catch (ShapingError &e) {
+            cerr << "\033[31mError: Invalid cache size '" << args["cache-size"].toString() << "'\033[0m" << endl;
+            exit(1);
+        }
+
+        cache.reset(new ResponseCache(budget, static_cast<uint64_t>(std::max(1l, args["cache"].toNumber())) * 1000));
+        cache_request_max = static_cast<size_t>(std::max(1l, args["cache-request"].toNumber()));
+        service.cache = cache.get();
+
+        // The output has to pass through the server to be kept
+        service.relay = true;
+        cerr << "\033[36mCaching responses for \033[35m" << args["cache"].toNumber() << "s\033[36m in \033[35m"
+             << budget << "\033[36m bytes\033[0m" << endl;
+    }
+
+    if (args["capture-stderr"].toBool() && (service.pass & PASS_ERR))
+    {
+        cerr << "\033[31mError: --capture-stderr and --stderr are mutually exclusive\033[0m" << endl;
+        exit(1);
+    }
+
+    std::unique_ptr<Cgroup> cgroup;
+    if (!args["cgroup"].isVoid())
+    {
+        CgroupLimits limits;
+        if (!args["memory-max"].isVoid())
+            limits.memory_max = args["memory-max"].toString();
+        if (!args["cpu-max"].isVoid())
+            limits.cpu_max = args["cpu-max"].toString();
+        if (!args["pids-max"].isVoid())
+            limits.pids_max = args["pids-max"].toString();
+        if (!args["io-max"].isVoid())
+            limits.io_max = args["io-max"].toString();
+
+        try {
+            cgroup.reset(new Cgroup(args["cgroup"].toString(), limits));
+        } catch (CgroupError &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+            exit(1);
+        }
+        service.cgroup = cgroup.get();
+        cerr << "\033[36mRunning handlers in \033[35m" << cgroup->path() << "\033[0m" << endl;
+    }
+    else if (!args["memory-max"].isVoid() || !args["cpu-max"].isVoid() || !args["pids-max"].isVoid() || !args["io-max"].isVoid())
+    {
+        cerr << "\033[31mError: Resource limits require --cgroup\033[0m" << endl;
+        exit(1);
+    }
+
+    max_children = static_cast<size_t>(std::max(0l, args["max-children"].toNumber()));
+    shed_percent = static_cast<unsigned>(std::max(0l, args["shed-at"].toNumber()));
+
+    fair_queueing = args["fair-queue"].toNumber() > 0;
+    spawn_queue.reset(new FairQueue(fair_queueing ? static_cast<size_t>(args["fair-queue"].toNumber()) : 0,
+                                    fair_queueing ? static_cast<uint64_t>(std::max(0l, args["fair-timeout"].toNumber())) : 0));
+    if (fair_queueing)
+    {
+        if (!max_children)
+        {
+            cerr << "\033[31mError: --fair-queue requires --max-children\033[0m" << endl;
+            exit(1);
+        }
+
+        try {
+            spawn_queue->parse_mode(args["fair-by"].isVoid() ? "source" : args["fair-by"].toString());
+            if (!args["fair-weights"].isVoid())
+                spawn_queue->parse_weights(args["fair-weights"].toString());
+        } catch (FairQueueError &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+            exit(1);
+        }
+        cerr << "\033[36mQueuing up to \033[35m" << args["fair-queue"].toNumber() << "\033[36m connections at capacity\033[0m" << endl;
+    }
+    else if (!args["fair-by"].isVoid() || !args["fair-weights"].isVoid())
+    {
+        cerr << "\033[31mError: --fair-by and --fair-weights require --fair-queue\033[0m" << endl;
+        exit(1);
+    }
+
+    if (args["circuit-failures"].toNumber() > 0)
+    {
+        breaker.reset(new CircuitBreaker(static_cast<unsigned>(args["circuit-failures"].toNumber()),
+                                         args["circuit-window"].toNumber(),
+                                         args["circuit-quick"].toNumber(),
+                                         args["circuit-open"].toNumber()));
+        breaker_queue = args["circuit-queue"].toBool();
+    }
+
+    if (!args["trace-spans"].isVoid())
+    {
+        size_t size = static_cast<size_t>(std::max(1l, args["trace-spans-size"].toNumber()));
+        span_tracer.reset(new SpanTracer(args["trace-spans"].toString(), size));
+        cerr << "\033[36mRecording connection spans for \033[35m" << span_tracer->path() << "\033[0m" << endl;
+    }
+
+    if (!args["trace"].isVoid())
+    {
+        try {
+            trace_writer.reset(new Trace::Writer(args["trace"].toString()));
+        } catch (Trace::TraceError &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+            exit(1);
+        }
+        trace_timer.callback = []() {
+            trace_writer->flush();
+        };
+        cerr << "\033[36mTracing connections to \033[35m" << args["trace"].toString() << "\033[0m" << endl;
+    }
 
     cerr << "\033[36mArgv: \033[35m['";
     cerr << exec_argv[0];
@@ -335,122 +1479,480 @@ int main(int argc, char **argv)
     cerr << "']\033[0m" << endl;
 
     // Socket
-    int fd;
+    bool udp = args["udp"].toBool() || args["udp-wait"].toBool();
     if (args["systemd"].toBool())
     {
-        cerr << "\033[36mGetting socket from systemd...\033[0m" << endl;
+        cerr << "\033[36mGetting sockets from systemd...\033[0m" << endl;
         int n = sd_listen_fds(1);
-        if (n > 1)
+        if (n < 1)
         {
-            cerr << "\033[31mToo many fds received!\033[0m" << endl;
+            cerr << "\033[31mNo fds received. Check your systemd unit!\033[0m" << endl;
             exit(1);
         }
-        else if (n < 1)
+
+        int datagram_fds = 0;
+        for (int fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n; ++fd)
         {
-            cerr << "\033[31mNo fds received. Check your systemd unit!\033[0m" << endl;
-            exit(1);
+            listeners.push_back(fd);
+
+            int type;
+            socklen_t type_size = sizeof(type);
+            if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_size) == 0 && type == SOCK_DGRAM)
+                ++datagram_fds;
+
+            sockaddr_inet sa;
+            socklen_t sa_size = sizeof(sa);
+            std::memset(&sa, 0, sizeof(sa));
+            getsockname(fd, reinterpret_cast<sockaddr*>(&sa), &sa_size);
+            if (n <= 8)
+                cerr << "\033[36mBound to \033[35m" << listen_name(sa) << "\033[0m" << endl;
         }
-        fd = SD_LISTEN_FDS_START + 0;
+        if (n > 8)
+            cerr << "\033[36mBound to \033[35m" << n << "\033[36m sockets\033[0m" << endl;
 
-        sockaddr_inet sa;
-        socklen_t sa_size = sizeof(sa);
-        getsockname(fd, reinterpret_cast<sockaddr*>(&sa), &sa_size);
-        cerr << "\033[36mBound to \033[35m" << peername(sa) << ":" << ntohs(sa.in.sin_port) << "\033[0m" << endl;
+        if (datagram_fds && datagram_fds != n)
+        {
+            cerr << "\033[31mError: Can't serve stream and datagram sockets at once\033[0m" << endl;
+            exit(1);
+        }
+        udp = udp || datagram_fds;
     }
     else
     {
-        cerr << "\033[36mOpening Listening Socket...\033[0m" << endl;
+        cerr << "\033[36mOpening Listening Sockets...\033[0m" << endl;
+
+        std::vector<std::string> binds = args["bind"].toList();
+        if (binds.empty())
+            binds.push_back(std::string());
+
+        bool dual_stack = args["dual-stack"].toBool();
+        int backlog = static_cast<int>(args["backlog"].toNumber());
 
-        std::string addrs = args["bind"].toString();
-        if (!addrs.compare(0, 1, "[") && !addrs.compare(addrs.size()-1, 1, "]"))
+        for (const std::string &bind : binds)
         {
-            args["ipv6"] = true;
-            addrs = addrs.substr(1, addrs.size()-2);
+            sockaddr_inet addr;
+            socklen_t addr_size = sizeof(addr);
+            std::memset(&addr, 0, sizeof(addr));
+
+            if (!bind.compare(0, 5, "unix:"))
+            {
+                if (!parse_unix(bind, addr, addr_size))
+                {
+                    cerr << "\033[31mError: Invalid UNIX socket address '" << bind << "'\033[0m" << endl;
+                    exit(1);
+                }
+                if (udp)
+                {
+                    cerr << "\033[31mError: UNIX sockets can't be used with --udp\033[0m" << endl;
+                    exit(1);
+                }
+
+                // A socket left behind by an earlier instance would make bind() fail
+                struct stat st;
+                if (addr.un.sun_path[0] && stat(addr.un.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+                    unlink(addr.un.sun_path);
+                if (addr.un.sun_path[0])
+                    unix_paths.push_back(addr.un.sun_path);
+
+                open_listener(addr, addr_size, udp, backlog, false);
+                cerr << "\033[36mBound to \033[35m" << listen_name(addr) << "\033[0m" << endl;
+                continue;
+            }
+
+            std::string port_spec;
+            if (!parse_inet(bind, args["ipv6"].toBool() || dual_stack, addr, port_spec))
+            {
+                cerr << "\033[31mError: Invalid address '" << bind << "'\033[0m" << endl;
+                exit(1);
+            }
+
+            std::vector<uint16_t> ports;
+            if (port_spec.empty())
+                port_spec = args["port"].toString();
+            if (!parse_ports(port_spec, ports))
+            {
+                cerr << "\033[31mError: Invalid port list '" << port_spec << "'\033[0m" << endl;
+                exit(1);
+            }
+
+            reserve_fds(listeners.size() + ports.size());
+
+            for (uint16_t port : ports)
+            {
+                if (addr.family == AF_INET6)
+                    addr.in6.sin6_port = htons(port);
+                else
+                    addr.in.sin_port = htons(port);
+                open_listener(addr, addr_size, udp, backlog, dual_stack);
+            }
+
+            if (addr.family == AF_INET6)
+                addr.in6.sin6_port = htons(ports.front());
+            else
+                addr.in.sin_port = htons(ports.front());
+            cerr << "\033[36mBound to \033[35m" << listen_name(addr);
+            if (ports.size() > 1)
+                cerr << "\033[36m and \033[35m" << ports.size() - 1 << "\033[36m more ports";
+            if (dual_stack && addr.family == AF_INET6)
+                cerr << "\033[36m, dual-stack";
+            cerr << "\033[0m" << endl;
         }
+    }
+
+    // Datagram sockets stay blocking for handlers that get them in wait
+    // mode; the server itself only uses them with MSG_DONTWAIT
+    if (!udp)
+        for (int fd : listeners)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-        sockaddr_inet addr;
-        if (args["ipv6"].toBool())
+    bool udp_wait = args["udp-wait"].toBool();
+    if (udp)
+    {
+        if (service.relay || !service.socket_profile.empty())
         {
-            addr.family = AF_INET6;
-            addr.in6.sin6_addr = {{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}};
-            addr.in6.sin6_port = {htons(static_cast<uint16_t>(args["port"].toNumber()))};
-            if (!addrs.empty())
-                inet_pton(AF_INET6, addrs.c_str(), &addr.in6.sin6_addr);
+            cerr << "\033[31mError: --relay, --cache, --pacing-rate, --source-rate and --tcp-profile don't apply to UDP\033[0m" << endl;
+            exit(1);
         }
-        else
+        if (fair_queueing)
         {
-            addr.in.sin_family = AF_INET;
-            addr.in.sin_addr.s_addr = htonl(INADDR_ANY);
-            addr.in.sin_port = htons(static_cast<uint16_t>(args["port"].toNumber()));
-            if (!addrs.empty())
-                inet_pton(AF_INET, addrs.c_str(), &addr.in.sin_addr);
+            cerr << "\033[31mError: --fair-queue doesn't apply to UDP\033[0m" << endl;
+            exit(1);
         }
 
-        fd = socket(addr.family, SOCK_STREAM, 0);
-        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        cerr << "\033[36mServing datagrams \033[35m" << (udp_wait ? "through one handler per socket at a time" : "with a handler each") << "\033[0m" << endl;
+    }
 
-        if (fd < 0)
+    // Idleness is read from TCP_INFO, or from the relay's traffic
+    if (service.idle_timeout_ms && !service.relay)
+    {
+        if (udp)
         {
-            cerr << "\033[31mError: ";
-            perror("socket");
-            cerr << "\033[0m";
+            cerr << "\033[31mError: --idle-timeout doesn't apply to UDP\033[0m" << endl;
             exit(1);
         }
+        for (int fd : listeners)
+        {
+            int domain;
+            socklen_t size = sizeof(domain);
+            if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &size) == 0 && domain == AF_UNIX)
+            {
+                cerr << "\033[31mError: --idle-timeout needs --relay on UNIX sockets\033[0m" << endl;
+                exit(1);
+            }
+        }
+    }
 
-
-        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)
+    if (!args["tls-cert"].isVoid())
+    {
+        if (udp)
         {
-            cerr << "\033[31mError: ";
-            perror("bind");
-            cerr << "\033[0m";
+            cerr << "\033[31mError: --tls-cert doesn't apply to UDP\033[0m" << endl;
             exit(1);
         }
-
-        if (listen(fd, 5) == -1)
+        if (cache)
         {
-            cerr << "\033[31mError: ";
-            perror("listen");
-            cerr << "\033[0m";
+            cerr << "\033[31mError: --cache can't look into TLS connections\033[0m" << endl;
             exit(1);
         }
 
-        cerr << "\033[36mBound to \033[35m" << peername(addr) << ":" << ntohs(addr.in.sin_port) << "\033[0m" << endl;
+        std::string cert = args["tls-cert"].toString();
+        std::string key = args["tls-key"].isVoid() ? cert : args["tls-key"].toString();
+        bool ktls = !args["no-ktls"].toBool();
+        try {
+            tls_context.reset(new TlsContext(cert, key, static_cast<unsigned>(std::max(0l, args["tls-tickets"].toNumber())), ktls));
+        } catch (TlsError &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+            exit(1);
+        }
+        tls_timeout_ms = static_cast<uint64_t>(std::max(1l, args["tls-timeout"].toNumber()));
+        cerr << "\033[36mTerminating TLS with \033[35m" << cert << "\033[36m"
+             << (ktls ? ", offloading to kernel TLS where possible" : " in userspace") << "\033[0m" << endl;
+    }
+
+    // Handlers get our environment plus their connection's UCSPI variables
+    Environment environment(environ, udp);
+    service.env = &environment;
+
+    if (!args["nice"].isVoid() || !args["fifo"].isVoid())
+    {
+        int nice = args["nice"].isVoid() ? 0 : static_cast<int>(args["nice"].toNumber());
+        int fifo = args["fifo"].isVoid() ? 0 : static_cast<int>(args["fifo"].toNumber());
+        try {
+            sched_acceptor(nice, fifo, static_cast<unsigned>(args["fifo-cap"].toNumber()));
+        } catch (SchedError &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+            exit(1);
+        }
+        if (fifo)
+            cerr << "\033[36mAccepting with SCHED_FIFO priority \033[35m" << fifo << "\033[0m" << endl;
+        else
+            cerr << "\033[36mAccepting at nice \033[35m" << nice << "\033[0m" << endl;
     }
 
     // Signals
-    struct sigaction sa;
-    sock_fd = fd;
+    // Handled synchronously by the reactor; children get the original mask back.
+    sigprocmask(SIG_SETMASK, NULL, &child_sigmask);
+    signal(SIGPIPE, SIG_IGN);
 
-    sa.sa_handler = &sigint_handler;
-    sigaction(SIGINT, &sa, 0);
+    Reactor reactor;
 
-    sa.sa_handler = NULL;
-    sa.sa_sigaction = &sigchld_handler;
-    sa.sa_flags = SA_NOCLDSTOP | SA_SIGINFO;
-    sigaction(SIGCHLD, &sa, 0);
+    std::unique_ptr<LogSink> log_sink;
+    if (args["capture-stderr"].toBool())
+    {
+        log_sink.reset(new LogSink(reactor, 2));
+        service.log_sink = log_sink.get();
+    }
 
-    cerr << "\033[36mNow accepting connections.\033[0m" << endl;
-    while (true)
+    reactor.signal(SIGCHLD, [&reactor]() {
+        reap_children(reactor);
+    });
+    // systemd stops services with SIGTERM
+    for (int sig : {SIGINT, SIGTERM})
+        reactor.signal(sig, [&reactor, sig]() {
+            cerr << "\033[31mCaught " << (sig == SIGINT ? "SIGINT" : "SIGTERM") << ". Shutting down.\033[0m" << endl;
+            sd_notify(0, "STOPPING=1");
+            reactor.stop();
+        });
+
+    reactor.set_lag_monitor(&loop_lag);
+
+    bool resolve = args["resolve"].toBool();
+    for (const std::string &arg : exec_argv)
+        if (arg.find("%H") != std::string::npos)
+            resolve = true;
+    if (resolve)
     {
-        std::unique_ptr<Client> client = Client::accept(fd, pass, exec_argv);
+        resolve_deadline_ms = static_cast<uint64_t>(std::max(0l, args["resolve-deadline"].toNumber()));
+        resolver.reset(new Resolver(reactor, static_cast<unsigned>(std::max(1l, args["resolve-workers"].toNumber())),
+                                    static_cast<size_t>(std::max(0l, args["resolve-cache"].toNumber())),
+                                    static_cast<uint64_t>(std::max(0l, args["resolve-ttl"].toNumber())) * 1000,
+                                    static_cast<uint64_t>(std::max(0l, args["resolve-negative-ttl"].toNumber())) * 1000));
+        cerr << "\033[36mLooking up peer names, waiting up to \033[35m" << resolve_deadline_ms << "ms\033[0m" << endl;
+    }
 
-        if (client == nullptr)
+    // Metrics
+    Metrics metrics;
+    metrics.add([](std::ostream &os) {
+        Metrics::sample(os, "ncs_connections_accepted_total", "counter", "Accepted connections", accepted);
+        Metrics::sample(os, "ncs_connections_cross_cpu_total", "counter", "Connections accepted on another CPU than their packets", cross_cpu);
+        Metrics::sample(os, "ncs_connections_closed_total", "counter", "Finished connections", closed);
+        Metrics::sample(os, "ncs_handlers_failed_total", "counter", "Handlers that exited unsuccessfully", failed);
+        Metrics::sample(os, "ncs_handlers_running", "gauge", "Running handler processes", pid_map.size());
+        Metrics::sample(os, "ncs_connections_draining", "gauge", "Connections still relaying after their handler exited", draining.size());
+        loop_lag.collect(os);
+    });
+    metrics.add([](std::ostream &os) {
+        Metrics::sample(os, "ncs_listen_queue_depth", "gauge", "Connections waiting in the listen queue", queue_depth);
+        Metrics::sample(os, "ncs_listen_queue_limit", "gauge", "Size of the listen queue", queue_limit);
+        Metrics::sample(os, "ncs_listen_queue_peak", "gauge", "Highest listen queue depth seen", queue_peak);
+        Metrics::sample(os, "ncs_connections_shed_total", "counter", "Connections reset because the listen queue was filling up", shed);
+
+        uint64_t overflows = 0, drops = 0;
+        if (listen_drops(overflows, drops))
+        {
+            Metrics::sample(os, "ncs_listen_overflows_total", "counter", "System wide ListenOverflows", overflows);
+            Metrics::sample(os, "ncs_listen_drops_total", "counter", "System wide ListenDrops", drops);
+        }
+    });
+    if (breaker)
+        metrics.add([](std::ostream &os) {
+            Metrics::sample(os, "ncs_circuit_state", "gauge", "Circuit breaker state: 0 closed, 1 open, 2 half-open", breaker->state());
+            Metrics::sample(os, "ncs_circuit_opened_total", "counter", "Times the circuit breaker opened", breaker->opened);
+            Metrics::sample(os, "ncs_connections_rejected_total", "counter", "Connections reset while the circuit was open", breaker->rejected);
+        });
+    if (cache)
+        metrics.add([](std::ostream &os) {
+            Metrics::sample(os, "ncs_cache_hits_total", "counter", "Requests answered from the cache", cache->hits);
+            Metrics::sample(os, "ncs_cache_misses_total", "counter", "Requests not found in the cache", cache->misses);
+            Metrics::sample(os, "ncs_cache_coalesced_total", "counter", "Misses that waited for another handler's response", cache->coalesced);
+            Metrics::sample(os, "ncs_cache_evictions_total", "counter", "Responses dropped for room before they expired", cache->evicted);
+            Metrics::sample(os, "ncs_cache_entries", "gauge", "Cached responses", cache->size());
+            Metrics::sample(os, "ncs_cache_bytes", "gauge", "Memory taken by cached requests and responses", cache->bytes());
+            Metrics::sample(os, "ncs_spawn_queue_length", "gauge", "Misses waiting for a handler slot", spawn_queue->size());
+        });
+    if (tls_context)
+        metrics.add([](std::ostream &os) {
+            tls_context->collect(os);
+        });
+    if (resolver)
+        metrics.add([](std::ostream &os) {
+            Metrics::sample(os, "ncs_resolve_lookups_total", "counter", "Peer name lookups", resolver->hits + resolver->misses);
+            Metrics::sample(os, "ncs_resolve_cache_hits_total", "counter", "Peer names found in the cache", resolver->hits);
+            Metrics::sample(os, "ncs_resolve_failures_total", "counter", "Peers without a usable name", resolver->failures);
+            Metrics::sample(os, "ncs_resolve_overflows_total", "counter", "Lookups refused with all workers busy", resolver->overflows);
+            Metrics::sample(os, "ncs_resolve_timeouts_total", "counter", "Handlers started before their peer's name was known", resolve_timeouts);
+            Metrics::sample(os, "ncs_resolve_cache_entries", "gauge", "Peer names cached", resolver->size());
+            Metrics::sample(os, "ncs_resolve_waiting", "gauge", "Connections waiting for their peer's name", resolving.size());
+        });
+    if (zygote)
+        metrics.add([](std::ostream &os) {
+            Metrics::sample(os, "ncs_zygote_spawns_total", "counter", "Handlers started by a zygote", zygote->spawned);
+            Metrics::sample(os, "ncs_zygote_misses_total", "counter", "Spawns without a spare ready, forked by the server instead", zygote->misses);
+            Metrics::sample(os, "ncs_zygote_failures_total", "counter", "Requests a zygote couldn't be sent, forked by the server instead", zygote->failures);
+            Metrics::sample(os, "ncs_zygotes", "gauge", "Zygotes still running", zygote->size());
+        });
+    if (fair_queueing)
+        metrics.add([](std::ostream &os) {
+            spawn_queue->collect(os);
+        });
+    if (cgroup)
+        metrics.add([&cgroup](std::ostream &os) {
+            cgroup->collect(os);
+        });
+
+    std::string metrics_path = args["metrics"].isVoid() ? std::string() : args["metrics"].toString();
+    Timer metrics_timer([&]() {
+        if (!metrics.write(metrics_path))
         {
-            if (errno == EINTR)
-                continue;
             cerr << "\033[31mError: ";
-            perror("accept");
+            perror(metrics_path.c_str());
             cerr << "\033[0m";
-            continue;
         }
+        reactor.timers().arm(metrics_timer, reactor.now_ms(), 1000);
+    });
+    if (!metrics_path.empty())
+        reactor.timers().arm(metrics_timer, reactor.now_ms(), 0);
+
+    reactor.signal(SIGUSR1, [&]() {
+        cerr << "\033[36mMetrics:\033[0m" << endl << metrics.render();
+        if (!metrics_path.empty())
+            metrics.write(metrics_path);
+        if (span_tracer)
+            write_spans();
+    });
+
+    if (!args["status"].isVoid())
+    {
+        std::string service_line = exec_argv[0];
+        for (size_t i = 1; i < exec_argv.size(); ++i)
+            service_line += " " + exec_argv[i];
+
+        try {
+            status_writer.reset(new Status::Writer(args["status"].toString(),
+                                                   static_cast<uint32_t>(std::max(1l, args["status-slots"].toNumber())),
+                                                   service_line));
+        } catch (Status::StatusError &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+            exit(1);
+        }
+        cerr << "\033[36mPublishing status in \033[35m" << args["status"].toString() << "\033[0m" << endl;
+
+        status_timer.callback = [&reactor]() {
+            publish_bytes(reactor);
+        };
+        reactor.timers().arm(status_timer, reactor.now_ms(), 1000);
+        publish_status();
+    }
+
+    queue_timer.callback = [&reactor]() {
+        watch_queues(reactor);
+    };
+    reactor.timers().arm(queue_timer, reactor.now_ms(), 100);
+
+    std::vector<std::unique_ptr<DatagramSocket>> datagram_sockets;
+    for (int fd : listeners)
+    {
+        if (udp && udp_wait)
+            reactor.add(fd, EPOLLIN, [&reactor, fd, &service](uint32_t) {
+                hand_off_socket(reactor, fd, service);
+            });
+        else if (udp)
+        {
+            DatagramSocket *sock = new DatagramSocket(reactor, fd);
+            datagram_sockets.emplace_back(sock);
+            if (args["udp-gro"].toBool() && !sock->enable_gro())
+            {
+                cerr << "\033[33mWarning: ";
+                perror("UDP_GRO");
+                cerr << "\033[0m";
+            }
+            reactor.add(fd, EPOLLIN, [&reactor, sock, &service](uint32_t) {
+                receive_datagrams(reactor, *sock, service);
+            });
+        }
+        else
+            reactor.add(fd, EPOLLIN, [&reactor, fd, &service](uint32_t) {
+                accept_clients(reactor, fd, service);
+            });
+    }
 
-        cerr << "\033[36mConnected: \033[35m" << client->peername() << ":" << client->port() << "\033[0m";
+    if (!datagram_sockets.empty())
+        metrics.add([&datagram_sockets](std::ostream &os) {
+            uint64_t received = 0, sent = 0, dropped = 0;
+            for (const std::unique_ptr<DatagramSocket> &sock : datagram_sockets)
+            {
+                received += sock->received;
+                sent += sock->sent;
+                dropped += sock->dropped;
+            }
+            Metrics::sample(os, "ncs_datagrams_received_total", "counter", "Datagrams received", received);
+            Metrics::sample(os, "ncs_datagrams_dropped_total", "counter", "Datagrams dropped because all handler slots were taken", datagrams_dropped);
+            Metrics::sample(os, "ncs_datagram_replies_sent_total", "counter", "Replies sent", sent);
+            Metrics::sample(os, "ncs_datagram_replies_dropped_total", "counter", "Replies that could not be sent", dropped);
+        });
+
+    // systemd
+    watchdog_lag_ms = static_cast<uint64_t>(std::max(0l, args["watchdog-lag"].toNumber()));
+    uint64_t watchdog_usec = 0;
+    if (sd_watchdog_enabled(1, &watchdog_usec) > 0)
+    {
+        uint64_t interval_ms = std::max<uint64_t>(watchdog_usec / 2000, 1);
+        watchdog_timer.callback = [&reactor, interval_ms]() {
+            feed_watchdog(reactor, interval_ms);
+        };
+        reactor.timers().arm(watchdog_timer, reactor.now_ms(), interval_ms);
+        cerr << "\033[36mPinging the watchdog every \033[35m" << interval_ms << "ms\033[0m" << endl;
+    }
 
-        int pid = client->start();
+    if (!args["idle-exit"].isVoid())
+    {
+        if (!args["systemd"].toBool())
+        {
+            cerr << "\033[31mError: --idle-exit requires --systemd, the socket would be gone\033[0m" << endl;
+            exit(1);
+        }
 
-        cerr << " \033[36m[\033[35m" << pid << "\033[36m]\033[0m" << endl;
+        idle_exit_ms = static_cast<uint64_t>(std::max(1l, args["idle-exit"].toNumber())) * 1000;
+        last_active_ms = reactor.now_ms();
+        idle_exit_timer.callback = [&reactor]() {
+            check_idle_exit(reactor);
+        };
+        reactor.timers().arm(idle_exit_timer, reactor.now_ms(), idle_exit_ms);
+    }
 
-        close(client->fd);
-        pid_map.emplace(pid, std::move(client));
+    if (getenv("NOTIFY_SOCKET"))
+    {
+        notify_timer.callback = [&reactor]() {
+            notify_status(reactor);
+        };
+        reactor.timers().arm(notify_timer, reactor.now_ms(), 1000);
+        sd_notify(0, "READY=1");
     }
+
+    cerr << "\033[36mNow accepting connections.\033[0m" << endl;
+    reactor.run();
+
+    for (int fd : listeners)
+        close(fd);
+    for (const std::string &path : unix_paths)
+        unlink(path.c_str());
+    if (accepted)
+        cerr << "\033[36mAccepted \033[35m" << accepted << "\033[36m connections, \033[35m"
+             << cross_cpu << "\033[36m on another CPU than their packets\033[0m" << endl;
+
+    draining.clear();
+    pid_map.clear();
+    cache_pending.clear();
+    handshaking.clear();
+    resolving.clear();
+    spawn_queue.reset();
+    resolver.reset();
+    tls_context.reset();
+    if (span_tracer)
+        write_spans();
+    status_writer.reset();
+    log_sink.reset();
+    trace_writer.reset();
+    cgroup.reset();
+    exit(idled_out ? 0 : 2);
 }
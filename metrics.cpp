@@ -0,0 +1,122 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "metrics.h"
+
+void Metrics::add(Collector collector)
+{
+    collectors.push_back(std::move(collector));
+}
+
+std::string Metrics::render() const
+{
+    std::ostringstream os;
+    for (const Collector &c : collectors)
+        c(os);
+    return os.str();
+}
+
+bool Metrics::write(const std::string &path) const
+{
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::trunc);
+        f << render();
+        f.close();
+        if (!f)
+            return false;
+    }
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+void Metrics::family(std::ostream &os, const char *name, const char *type, const char *help)
+{
+    os << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " " << type << "\n";
+}
+
+void Metrics::sample(std::ostream &os, const char *name, const char *type, const char *help, uint64_t value)
+{
+    family(os, name, type, help);
+    os << name << " " << value << "\n";
+}
+
+Histogram::Histogram(const uint64_t (&bucket_bounds)[nbuckets], uint64_t values_per_unit) :
+    bounds(bucket_bounds), per_unit(values_per_unit), buckets(), total(0), sum(0)
+{
+}
+
+void Histogram::record(uint64_t value)
+{
+    int i = 0;
+    while (i < nbuckets && value > bounds[i])
+        ++i;
+    ++buckets[i];
+
+    ++total;
+    sum += value;
+}
+
+uint64_t Histogram::quantile(double q) const
+{
+    if (!total)
+        return 0;
+
+    uint64_t want = static_cast<uint64_t>(q * total), seen = 0;
+    for (int i = 0; i < nbuckets; ++i)
+    {
+        seen += buckets[i];
+        if (seen > want)
+            return bounds[i];
+    }
+    return bounds[nbuckets - 1];
+}
+
+void Histogram::collect(std::ostream &os, const char *name, const char *help) const
+{
+    Metrics::family(os, name, "histogram", help);
+
+    // Enough decimals for the sum to be exact
+    int digits = 0;
+    for (uint64_t n = per_unit; n >= 10; n /= 10)
+        ++digits;
+
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+    uint64_t cumulative = 0;
+    for (int i = 0; i < nbuckets; ++i)
+    {
+        cumulative += buckets[i];
+        os << name << "_bucket{le=\"" << static_cast<double>(bounds[i]) / per_unit << "\"} " << cumulative << "\n";
+    }
+    os << name << "_bucket{le=\"+Inf\"} " << total << "\n"
+       << name << "_sum " << std::fixed << std::setprecision(digits) << static_cast<double>(sum) / per_unit << "\n"
+       << name << "_count " << total << "\n";
+    os.flags(flags);
+    os.precision(precision);
+}
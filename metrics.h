@@ -0,0 +1,101 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * @file metrics.h
+ * @brief server metrics in the Prometheus text format
+ *
+ * Modules register collectors that write their samples on demand; nothing
+ * is kept in between. The result goes to a file that is replaced
+ * atomically, for the node exporter's textfile collector or plain cat.
+ */
+
+class Metrics
+{
+public:
+    typedef std::function<void(std::ostream &os)> Collector;
+
+    void add(Collector collector);
+
+    std::string render() const;
+
+    /**
+     * @brief write to path.tmp and rename it over path
+     * @return false on failure, with errno set
+     */
+    bool write(const std::string &path) const;
+
+    // Emit the HELP and TYPE lines of a metric family
+    static void family(std::ostream &os, const char *name, const char *type, const char *help);
+
+    // Emit a family with a single unlabeled sample
+    static void sample(std::ostream &os, const char *name, const char *type, const char *help, uint64_t value);
+
+private:
+    std::vector<Collector> collectors;
+};
+
+/**
+ * @brief a histogram with fixed buckets
+ * Values are counted in an integer unit, e.g. µs, and written out in the
+ * base unit Prometheus expects, e.g. seconds.
+ */
+class Histogram
+{
+public:
+    static const int nbuckets = 12;
+
+    /**
+     * @param bounds the upper bounds of the buckets, ascending. Not copied.
+     * @param per_unit values per base unit, e.g. 1000000 for µs as seconds
+     */
+    Histogram(const uint64_t (&bounds)[nbuckets], uint64_t per_unit);
+
+    void record(uint64_t value);
+
+    uint64_t count() const { return total; }
+
+    /**
+     * @brief the value below which a fraction q of the recorded ones fall
+     * An upper bound from the buckets, capped at the largest.
+     */
+    uint64_t quantile(double q) const;
+
+    // Emit the family with its _bucket, _sum and _count samples
+    void collect(std::ostream &os, const char *name, const char *help) const;
+
+private:
+    const uint64_t *bounds;
+    uint64_t per_unit;
+    uint64_t buckets[nbuckets + 1];     // the last one is +Inf
+    uint64_t total;
+    uint64_t sum;
+};
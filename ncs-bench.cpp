@@ -0,0 +1,816 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ncs-bench: spawn-throughput benchmark and load generator for NetCatServer.
+//
+// Starts a NetCatServer instance against a local handler, drives it over
+// loopback with a configurable concurrency and connection rate and prints a
+// single JSON object describing the run on stdout. A short human readable
+// summary goes to stderr.
+//
+// Run once as is and once with --unix to compare loopback TCP with UNIX
+// socket connection rates.
+//
+// With --flood, it instead fills the listen queue of a server that is kept
+// at capacity and checks the queue figures the server reports against what
+// the clients saw, e.g. with --server-args "--backlog 8 --shed-at 25".
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include "cmdparser.h"
+
+using namespace std;
+
+
+// Parse Commandline Options
+static CmdParser::ArgumentMap parse_argv(int argc, char **argv)
+{
+    CmdParser::Parser parser;
+    CmdParser::ArgumentMap args;
+
+    // Help
+    parser.newSwitch("help");
+    parser.addFlag("help", 'h');
+    parser.addDocumentation("help", "Show this help and exit");
+    parser.setTerminal("help");
+
+    // Server
+    parser.newOption("server", std::string("bin/Release/NetCatServer"));
+    parser.addFlag("server", 's');
+    parser.addDocumentation("server", "The NetCatServer binary to start", "<path>");
+
+    parser.newOption("server-args", std::string());
+    parser.addFlag("server-args", 'a');
+    parser.addDocumentation("server-args", "Extra arguments for the server, e.g. \"--relay\"", "<args>");
+
+    parser.newOption("pid", 0l);
+    parser.addDocumentation("pid", "Attach to an already running server instead of starting one", "<pid>");
+
+    parser.newOption("port", 17994l);
+    parser.addFlag("port", 'p');
+    parser.addDocumentation("port", "The loopback port to use");
+
+    parser.newOption("unix");
+    parser.addDocumentation("unix", "Connect through a UNIX socket at <path> instead of loopback TCP", "<path>");
+
+    parser.newOption("handler", std::string("true"));
+    parser.addFlag("handler", 'x');
+    parser.addDocumentation("handler", "Handler: true, cat, echo or a full command line", "<cmd>");
+
+    // Load
+    parser.newOption("concurrency", 16l);
+    parser.addFlag("concurrency", 'c');
+    parser.addDocumentation("concurrency", "Maximum number of connections in flight", "<n>");
+
+    parser.newOption("rate", 0l);
+    parser.addFlag("rate", 'r');
+    parser.addDocumentation("rate", "Connection attempts per second (0: closed loop)", "<n>");
+
+    parser.newOption("duration", 5l);
+    parser.addFlag("duration", 'd');
+    parser.addDocumentation("duration", "Length of the measurement in seconds", "<s>");
+
+    parser.newOption("connections", 0l);
+    parser.addFlag("connections", 'n');
+    parser.addDocumentation("connections", "Stop after this many connections (0: no limit)", "<n>");
+
+    parser.newOption("payload", -1l);
+    parser.addDocumentation("payload", "Bytes sent on every connection (default: 64 for cat, else 0)", "<bytes>");
+
+    parser.newOption("expect-rate", 0l);
+    parser.addDocumentation("expect-rate", "Fail unless the median per-connection rate is within 20% of <rate> bytes/s", "<rate>");
+
+    parser.newOption("burn", 0l);
+    parser.addDocumentation("burn", "Saturate the CPUs with <n> busy processes during the run", "<n>");
+
+    parser.newOption("timeout", 10l);
+    parser.addDocumentation("timeout", "Per-connection timeout in seconds", "<s>");
+
+    parser.newOption("flood", 0l);
+    parser.addDocumentation("flood", "Hold <n> connections to a server kept at one busy handler for --duration and check its listen queue metrics", "<n>");
+
+    try {
+        args = parser.parse(argc, argv);
+    } catch (CmdParser::ParsingError &e) {
+        cerr << "Error: " << e.what() << endl;
+        cerr << parser.compileUsage(argv[0]) << endl;
+        exit(1);
+    }
+
+    if (args["help"].toBool())
+    {
+        cout << parser.compileHelp(argv[0]) << endl;
+        exit(0);
+    }
+
+    return args;
+}
+
+// -------------------------------------------------------------------
+// Time
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// -------------------------------------------------------------------
+// Server process statistics from /proc
+struct ProcStat
+{
+    double utime, stime;
+    double cutime, cstime;
+    long rss_kb, hwm_kb;
+};
+
+static bool read_procstat(int pid, ProcStat &ps)
+{
+    std::ostringstream path;
+    path << "/proc/" << pid << "/stat";
+
+    std::ifstream stat(path.str());
+    std::string line;
+    if (!std::getline(stat, line))
+        return false;
+
+    // Skip over the comm field; it may contain spaces
+    std::istringstream is(line.substr(line.rfind(')') + 2));
+    std::string field;
+    unsigned long long ticks[4];
+    for (int i = 3; i < 14; ++i)
+        is >> field;
+    is >> ticks[0] >> ticks[1] >> ticks[2] >> ticks[3];
+
+    double hz = sysconf(_SC_CLK_TCK);
+    ps.utime = ticks[0] / hz;
+    ps.stime = ticks[1] / hz;
+    ps.cutime = ticks[2] / hz;
+    ps.cstime = ticks[3] / hz;
+
+    path.str("");
+    path << "/proc/" << pid << "/status";
+
+    std::ifstream status(path.str());
+    ps.rss_kb = ps.hwm_kb = 0;
+    while (std::getline(status, line))
+    {
+        if (!line.compare(0, 6, "VmRSS:"))
+            ps.rss_kb = std::atol(line.c_str() + 6);
+        else if (!line.compare(0, 6, "VmHWM:"))
+            ps.hwm_kb = std::atol(line.c_str() + 6);
+    }
+
+    return true;
+}
+
+// -------------------------------------------------------------------
+// Start the server under test
+static std::string handler_cmdline(const std::string &handler)
+{
+    if (handler == "true")
+        return "/bin/true";
+    if (handler == "cat")
+        return "cat";
+    if (handler == "echo")
+        return "/bin/echo x";
+    return handler;
+}
+
+static int start_server(const std::string &server, const std::string &extra, int port, const std::string &unix_path, const std::string &handler)
+{
+    std::vector<std::string> args = {server, "-b", "127.0.0.1", "-p", std::to_string(port), "-i", "-o"};
+    if (!unix_path.empty())
+        args = {server, "-b", "unix:" + unix_path, "-i", "-o"};
+    for (const std::string &arg : CmdParser::splitArgs(extra))
+        args.push_back(arg);
+    args.push_back(handler);
+
+    std::vector<char*> argv;
+    for (std::string &arg : args)
+        argv.push_back(&arg[0]);
+    argv.push_back(NULL);
+
+    int pid = fork();
+    if (pid != 0)
+        return pid;
+
+    // The per-connection log would dominate the measurement
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 2);
+
+    execv(server.c_str(), argv.data());
+    perror("exec");
+    _exit(127);
+}
+
+// Busy loops competing with the server and its handlers for CPU
+static std::vector<int> start_burners(long n)
+{
+    std::vector<int> pids;
+    for (long i = 0; i < n; ++i)
+    {
+        int pid = fork();
+        if (pid == 0)
+        {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            for (volatile unsigned long spin = 0;; ++spin);
+        }
+        if (pid > 0)
+            pids.push_back(pid);
+    }
+    return pids;
+}
+
+static void stop_burners(const std::vector<int> &pids)
+{
+    for (int pid : pids)
+        kill(pid, SIGKILL);
+    for (int pid : pids)
+        waitpid(pid, NULL, 0);
+}
+
+// Where the server listens: a loopback port or a UNIX socket
+struct Endpoint
+{
+    union
+    {
+        sockaddr_in in;
+        sockaddr_un un;
+    } addr;
+    socklen_t size;
+    int family;
+
+    Endpoint(int port, const std::string &unix_path)
+    {
+        std::memset(&addr, 0, sizeof(addr));
+        if (unix_path.empty())
+        {
+            family = addr.in.sin_family = AF_INET;
+            addr.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.in.sin_port = htons(static_cast<uint16_t>(port));
+            size = sizeof(addr.in);
+        }
+        else
+        {
+            family = addr.un.sun_family = AF_UNIX;
+            std::strncpy(addr.un.sun_path, unix_path.c_str(), sizeof(addr.un.sun_path) - 1);
+            size = sizeof(addr.un);
+        }
+    }
+
+    const sockaddr *sa() const
+    {
+        return reinterpret_cast<const sockaddr*>(&addr);
+    }
+};
+
+static bool wait_listening(const Endpoint &ep, double timeout)
+{
+    double deadline = now() + timeout;
+
+    while (now() < deadline)
+    {
+        int fd = socket(ep.family, SOCK_STREAM, 0);
+        if (connect(fd, ep.sa(), ep.size) == 0)
+        {
+            close(fd);
+            return true;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return false;
+}
+
+// -------------------------------------------------------------------
+// Load generator
+struct Connection
+{
+    int fd;
+    double started;
+    double first;
+    size_t sent;
+    size_t received;
+
+    Connection() :
+        fd(-1), started(0), first(0), sent(0), received(0)
+    {
+    }
+};
+
+struct Results
+{
+    std::vector<double> response;   // connect() -> first byte or EOF
+    std::vector<double> session;    // connect() -> EOF
+    std::vector<double> rate;       // bytes/s received, first byte -> EOF
+    size_t errors;
+    size_t timeouts;
+    size_t bytes;
+};
+
+class LoadGenerator
+{
+    int epfd;
+    Endpoint ep;
+    std::vector<Connection> conns;  // indexed by fd
+    std::string payload;
+    size_t active;
+    double timeout;
+
+public:
+    Results results;
+
+    LoadGenerator(const Endpoint &endpoint, size_t payload_size, double conn_timeout) :
+        ep(endpoint), payload(payload_size, 'x'), active(0), timeout(conn_timeout)
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        results.errors = results.timeouts = results.bytes = 0;
+    }
+
+    ~LoadGenerator()
+    {
+        close(epfd);
+    }
+
+    size_t inflight() const
+    {
+        return active;
+    }
+
+    void open()
+    {
+        int fd = socket(ep.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            ++results.errors;
+            return;
+        }
+
+        int one = 1;
+        if (ep.family == AF_INET)
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        double t = now();
+        // A full UNIX listen queue fails with EAGAIN instead of leaving the SYN pending
+        if (connect(fd, ep.sa(), ep.size) < 0 && errno != EINPROGRESS)
+        {
+            close(fd);
+            ++results.errors;
+            return;
+        }
+
+        if (conns.size() <= static_cast<size_t>(fd))
+            conns.resize(fd + 1);
+        Connection &c = conns[fd];
+        c.fd = fd;
+        c.started = t;
+        c.first = 0;
+        c.sent = 0;
+        c.received = 0;
+
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        ++active;
+    }
+
+    void finish(Connection &c, size_t *failed = nullptr)
+    {
+        if (failed == nullptr)
+        {
+            double t = now();
+            results.response.push_back(c.first - c.started);
+            results.session.push_back(t - c.started);
+            if (c.received > 0 && t > c.first)
+                results.rate.push_back(c.received / (t - c.first));
+        }
+        else
+            ++*failed;
+
+        close(c.fd);
+        c.fd = -1;
+        --active;
+    }
+
+    void writable(Connection &c)
+    {
+        while (c.sent < payload.size())
+        {
+            ssize_t n = send(c.fd, payload.data() + c.sent, payload.size() - c.sent, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EAGAIN)
+                    return;
+                // The handler may well exit without reading its input
+                break;
+            }
+            c.sent += n;
+        }
+
+        c.sent = payload.size();
+        shutdown(c.fd, SHUT_WR);
+
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = c.fd;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    void readable(Connection &c)
+    {
+        char buf[16384];
+        while (true)
+        {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n >= 0)
+            {
+                if (c.first == 0)
+                    c.first = now();
+                if (n == 0)
+                    return finish(c);
+                results.bytes += n;
+                c.received += n;
+            }
+            else if (errno == EAGAIN)
+                return;
+            else
+                return finish(c, &results.errors);
+        }
+    }
+
+    void poll(double wait)
+    {
+        epoll_event events[256];
+        int n = epoll_wait(epfd, events, 256, static_cast<int>(wait * 1000));
+
+        for (int i = 0; i < n; ++i)
+        {
+            Connection &c = conns[events[i].data.fd];
+            if (c.fd < 0)
+                continue;
+            if (events[i].events & EPOLLERR && c.first == 0)
+                finish(c, &results.errors);
+            else if (events[i].events & (EPOLLIN | EPOLLHUP))
+                readable(c);
+            else if (events[i].events & EPOLLOUT)
+                writable(c);
+        }
+    }
+
+    void expire()
+    {
+        double t = now();
+        for (Connection &c : conns)
+            if (c.fd >= 0 && t - c.started > timeout)
+                finish(c, &results.timeouts);
+    }
+};
+
+// -------------------------------------------------------------------
+// Reporting
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static void json_latency(std::ostream &os, const char *name, std::vector<double> &v)
+{
+    std::sort(v.begin(), v.end());
+    os << "\"" << name << "\":{"
+       << "\"p50\":" << percentile(v, 0.5) * 1e6 << ","
+       << "\"p90\":" << percentile(v, 0.9) * 1e6 << ","
+       << "\"p99\":" << percentile(v, 0.99) * 1e6 << ","
+       << "\"p999\":" << percentile(v, 0.999) * 1e6 << ","
+       << "\"max\":" << (v.empty() ? 0 : v.back() * 1e6) << "}";
+}
+
+static std::string json_string(const std::string &s)
+{
+    std::string res = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            res += '\\';
+        res += c;
+    }
+    return res + "\"";
+}
+
+// -------------------------------------------------------------------
+// Listen queue flood
+static std::map<std::string, double> read_metrics(const std::string &path)
+{
+    std::map<std::string, double> values;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        size_t space = line.rfind(' ');
+        if (space != std::string::npos)
+            values[line.substr(0, space)] = std::atof(line.c_str() + space + 1);
+    }
+    return values;
+}
+
+static int flood(const Endpoint &ep, int server, size_t n, double duration, const std::string &metrics_path)
+{
+    // The probe in wait_listening() left the one allowed handler running,
+    // so everything from here on stays in the listen queue
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<int> fds;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int fd = socket(ep.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || (connect(fd, ep.sa(), ep.size) < 0 && errno != EINPROGRESS))
+        {
+            perror("connect");
+            return 1;
+        }
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        fds.push_back(fd);
+    }
+
+    // Anything readable is a reset from the server shedding its queue
+    size_t resets = 0;
+    double end = now() + duration;
+    for (double t = now(); t < end; t = now())
+    {
+        epoll_event events[256];
+        int ready = epoll_wait(epfd, events, 256, static_cast<int>((end - t) * 1000) + 1);
+        for (int i = 0; i < ready; ++i)
+        {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+            ++resets;
+        }
+    }
+
+    // Have the server write its figures now rather than up to a second ago
+    kill(server, SIGUSR1);
+    usleep(200000);
+    std::map<std::string, double> m = read_metrics(metrics_path);
+    unlink(metrics_path.c_str());
+
+    for (int fd : fds)
+        close(fd);
+    close(epfd);
+
+    double depth = m["ncs_listen_queue_depth"];
+    double limit = m["ncs_listen_queue_limit"];
+    double peak = m["ncs_listen_queue_peak"];
+    double shed = m["ncs_connections_shed_total"];
+
+    cout << "{\"flood\":" << n
+         << ",\"resets\":" << resets
+         << ",\"queue_depth\":" << depth
+         << ",\"queue_limit\":" << limit
+         << ",\"queue_peak\":" << peak
+         << ",\"shed\":" << shed
+         << "}" << endl;
+
+    cerr << "\033[36mFlooded with " << n << " connections: queue \033[35m" << depth << "/" << limit
+         << "\033[36m, peak \033[35m" << peak << "\033[36m, \033[35m" << shed << "\033[36m shed, \033[35m"
+         << resets << "\033[36m resets seen\033[0m" << endl;
+
+    // The kernel admits one connection more than the backlog
+    std::string failure;
+    if (limit == 0)
+        failure = "Server reported no listen queue";
+    else if (depth > limit + 1 || peak > limit + 1)
+        failure = "Queue figures exceed the limit";
+    else if (peak < std::min<double>(n, limit))
+        failure = "Queue never filled up";
+    else if (shed != resets)
+        failure = "Shed count doesn't match the resets seen";
+    else if (shed > 0 && depth < static_cast<uint32_t>(limit) / 2)
+        failure = "Shedding went below half the queue";
+
+    if (!failure.empty())
+    {
+        cerr << "\033[31m" << failure << "\033[0m" << endl;
+        return 2;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    CmdParser::ArgumentMap args = parse_argv(argc, argv);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int port = static_cast<int>(args["port"].toNumber());
+    size_t concurrency = std::max(1l, args["concurrency"].toNumber());
+    double rate = args["rate"].toNumber();
+    double duration = args["duration"].toNumber();
+    size_t limit = args["connections"].toNumber();
+    std::string handler = handler_cmdline(args["handler"].toString());
+    long payload = args["payload"].toNumber();
+    if (payload < 0)
+        payload = args["handler"].toString() == "cat" ? 64 : 0;
+
+    std::string unix_path = args["unix"].isVoid() ? std::string() : args["unix"].toString();
+    Endpoint endpoint(port, unix_path);
+
+    size_t flood_size = std::max(0l, args["flood"].toNumber());
+    std::string server_args = args["server-args"].toString();
+    std::string metrics_path;
+    if (flood_size)
+    {
+        if (args["pid"].toNumber() || !unix_path.empty())
+        {
+            cerr << "\033[31mError: --flood starts its own TCP server\033[0m" << endl;
+            return 1;
+        }
+        metrics_path = "/tmp/ncs-bench-" + std::to_string(getpid()) + ".prom";
+        server_args += " --max-children 1 --metrics " + metrics_path;
+        handler = "sleep " + std::to_string(static_cast<long>(duration) + 5);
+    }
+
+    // Server
+    int server = static_cast<int>(args["pid"].toNumber());
+    bool spawned = server == 0;
+    if (spawned)
+        server = start_server(args["server"].toString(), server_args, port, unix_path, handler);
+
+    if (!wait_listening(endpoint, 5))
+    {
+        cerr << "\033[31mError: Server did not start listening on "
+             << (unix_path.empty() ? "port " + std::to_string(port) : unix_path) << "\033[0m" << endl;
+        if (spawned)
+            kill(server, SIGTERM);
+        return 1;
+    }
+
+    // Let the readiness probe settle
+    usleep(100000);
+
+    if (flood_size)
+    {
+        int res = flood(endpoint, server, flood_size, duration, metrics_path);
+        kill(server, SIGINT);
+        waitpid(server, NULL, 0);
+        return res;
+    }
+
+    std::vector<int> burners = start_burners(args["burn"].toNumber());
+
+    ProcStat before, after;
+    read_procstat(server, before);
+
+    // Load
+    LoadGenerator gen(endpoint, payload, args["timeout"].toNumber());
+    size_t opened = 0;
+    double start = now();
+    double end = start + duration;
+    double last_expire = start;
+
+    while (true)
+    {
+        double t = now();
+        bool more = t < end && (limit == 0 || opened < limit);
+
+        if (!more && gen.inflight() == 0)
+            break;
+
+        double wait = 0.01;
+        while (more && gen.inflight() < concurrency)
+        {
+            if (rate > 0)
+            {
+                double next = start + opened / rate;
+                if (next > t)
+                {
+                    wait = std::min(wait, next - t);
+                    break;
+                }
+            }
+            gen.open();
+            ++opened;
+            more = limit == 0 || opened < limit;
+        }
+
+        gen.poll(wait);
+
+        if (t - last_expire > 0.1)
+        {
+            gen.expire();
+            last_expire = t;
+        }
+    }
+
+    double elapsed = now() - start;
+    read_procstat(server, after);
+    stop_burners(burners);
+
+    if (spawned)
+    {
+        kill(server, SIGINT);
+        waitpid(server, NULL, 0);
+    }
+
+    // Report
+    Results &r = gen.results;
+    size_t completed = r.session.size();
+
+    std::ostringstream json;
+    json << "{\"handler\":" << json_string(handler)
+         << ",\"transport\":" << (unix_path.empty() ? "\"tcp\"" : "\"unix\"")
+         << ",\"concurrency\":" << concurrency
+         << ",\"rate\":" << rate
+         << ",\"burn\":" << burners.size()
+         << ",\"elapsed_s\":" << elapsed
+         << ",\"attempted\":" << opened
+         << ",\"completed\":" << completed
+         << ",\"errors\":" << r.errors
+         << ",\"timeouts\":" << r.timeouts
+         << ",\"bytes\":" << r.bytes
+         << ",\"conn_per_sec\":" << completed / elapsed
+         << ",";
+    json_latency(json, "response_us", r.response);
+    json << ",";
+    json_latency(json, "session_us", r.session);
+    std::sort(r.rate.begin(), r.rate.end());
+    json << ",\"goodput_Bps\":" << r.bytes / elapsed
+         << ",\"conn_rate_Bps\":{\"p50\":" << percentile(r.rate, 0.5)
+         << ",\"p99\":" << percentile(r.rate, 0.99) << "}";
+    json << ",\"server\":{"
+         << "\"cpu_user_s\":" << after.utime - before.utime
+         << ",\"cpu_sys_s\":" << after.stime - before.stime
+         << ",\"children_cpu_s\":" << (after.cutime + after.cstime) - (before.cutime + before.cstime)
+         << ",\"rss_kb\":" << after.rss_kb
+         << ",\"hwm_kb\":" << after.hwm_kb
+         << "}}";
+
+    cout << json.str() << endl;
+
+    cerr << "\033[36m" << completed << " connections in " << elapsed << "s: \033[35m"
+         << completed / elapsed << " conn/s\033[36m, p99 response \033[35m"
+         << percentile(r.response, 0.99) * 1e6 << "us\033[36m, "
+         << r.errors << " errors, " << r.timeouts << " timeouts\033[0m" << endl;
+
+    double expect = args["expect-rate"].toNumber();
+    if (expect > 0)
+    {
+        double median = percentile(r.rate, 0.5);
+        if (median < expect * 0.8 || median > expect * 1.2)
+        {
+            cerr << "\033[31mMedian per-connection rate " << median << " B/s is not within 20% of "
+                 << expect << " B/s\033[0m" << endl;
+            return 2;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,328 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ncs-replay: replay a connection trace recorded with --trace.
+//
+// Connections are opened against a (test) server over loopback with the
+// recorded inter-arrival times. Each one sends the number of bytes the
+// original peer sent and is held open for the recorded session length
+// before being half-closed. A JSON summary is printed on stdout.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+
+#include "cmdparser.h"
+#include "trace.h"
+
+using namespace std;
+
+
+// Parse Commandline Options
+static CmdParser::ArgumentMap parse_argv(int argc, char **argv)
+{
+    CmdParser::Parser parser;
+    CmdParser::ArgumentMap args;
+
+    // Help
+    parser.newSwitch("help");
+    parser.addFlag("help", 'h');
+    parser.addDocumentation("help", "Show this help and exit");
+    parser.setTerminal("help");
+
+    parser.newOption("port", 7994l);
+    parser.addFlag("port", 'p');
+    parser.addDocumentation("port", "The loopback port of the server under test");
+
+    parser.newOption("speed", std::string("1"));
+    parser.addFlag("speed", 's');
+    parser.addDocumentation("speed", "Time compression factor (2 replays twice as fast)", "<x>");
+
+    parser.newOption("limit", 0l);
+    parser.addFlag("limit", 'n');
+    parser.addDocumentation("limit", "Only replay the first <n> connections", "<n>");
+
+    parser.newOption("max-payload", 1048576l);
+    parser.addDocumentation("max-payload", "Cap on the bytes sent per connection", "<bytes>");
+
+    parser.newSwitch("no-hold");
+    parser.addDocumentation("no-hold", "Don't reproduce session lengths, half-close right away");
+
+    parser.newArgument("trace", CmdParser::Variant::required);
+    parser.addDocumentation("trace", "The trace file to replay");
+
+    try {
+        args = parser.parse(argc, argv);
+    } catch (CmdParser::ParsingError &e) {
+        cerr << "Error: " << e.what() << endl;
+        cerr << parser.compileUsage(argv[0]) << endl;
+        exit(1);
+    }
+
+    if (args["help"].toBool())
+    {
+        cout << parser.compileHelp(argv[0]) << endl;
+        exit(0);
+    }
+
+    return args;
+}
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// -------------------------------------------------------------------
+// A scheduled connection
+struct Arrival
+{
+    double at;          // seconds after replay start
+    double hold;        // seconds to keep the connection open
+    size_t payload;
+};
+
+struct Session
+{
+    int fd;
+    double opened;
+    double release;     // when to half-close
+    size_t remaining;   // payload left to send
+    bool closing;
+
+    Session() :
+        fd(-1), opened(0), release(0), remaining(0), closing(false)
+    {
+    }
+};
+
+static const char filler[16384] = {};
+
+static double percentile(std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    size_t i = static_cast<size_t>(p * (v.size() - 1) + 0.5);
+    return v[std::min(i, v.size() - 1)];
+}
+
+int main(int argc, char **argv)
+{
+    CmdParser::ArgumentMap args = parse_argv(argc, argv);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    double speed = std::atof(args["speed"].toString().c_str());
+    if (speed <= 0)
+        speed = 1;
+    size_t limit = args["limit"].toNumber();
+    size_t max_payload = args["max-payload"].toNumber();
+    bool hold = !args["no-hold"].toBool();
+
+    // Load the schedule
+    std::vector<Arrival> schedule;
+    try {
+        Trace::Reader reader(args["trace"].toString());
+        Trace::Record r;
+        while (reader.next(r))
+        {
+            Arrival a;
+            a.at = r.accepted_ns * 1e-9;
+            a.hold = hold ? r.duration_ns * 1e-9 / speed : 0;
+            a.payload = std::min<size_t>(r.bytes_in, max_payload);
+            schedule.push_back(a);
+        }
+    } catch (Trace::TraceError &e) {
+        cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+        return 1;
+    }
+
+    // Records are written at reap time, arrivals need sorting
+    std::sort(schedule.begin(), schedule.end(),
+              [](const Arrival &a, const Arrival &b){return a.at < b.at;});
+    if (limit && schedule.size() > limit)
+        schedule.resize(limit);
+    if (schedule.empty())
+    {
+        cerr << "\033[31mError: Empty trace\033[0m" << endl;
+        return 1;
+    }
+
+    double first = schedule.front().at;
+    for (Arrival &a : schedule)
+        a.at = (a.at - first) / speed;
+
+    cerr << "\033[36mReplaying \033[35m" << schedule.size() << "\033[36m connections over \033[35m"
+         << schedule.back().at << "s\033[0m" << endl;
+
+    // Replay
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(args["port"].toNumber()));
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<Session> sessions;
+    std::vector<double> lag, length;
+    size_t next = 0, active = 0, errors = 0;
+    double start = now();
+
+    auto finish = [&](Session &s, bool ok) {
+        if (ok)
+            length.push_back(now() - s.opened);
+        else
+            ++errors;
+        close(s.fd);
+        s.fd = -1;
+        --active;
+    };
+
+    while (next < schedule.size() || active > 0)
+    {
+        double t = now() - start;
+
+        // Open everything that is due
+        while (next < schedule.size() && schedule[next].at <= t)
+        {
+            const Arrival &a = schedule[next++];
+            lag.push_back(t - a.at);
+
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0 || (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS))
+            {
+                if (fd >= 0)
+                    close(fd);
+                ++errors;
+                continue;
+            }
+
+            if (sessions.size() <= static_cast<size_t>(fd))
+                sessions.resize(fd + 1);
+            Session &s = sessions[fd];
+            s.fd = fd;
+            s.opened = t + start;
+            s.release = s.opened + a.hold;
+            s.remaining = a.payload;
+            s.closing = false;
+
+            epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT;
+            ev.data.fd = fd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            ++active;
+        }
+
+        // Half-close sessions whose time is up
+        double abs = now();
+        double wake = next < schedule.size() ? start + schedule[next].at : abs + 0.1;
+        for (Session &s : sessions)
+        {
+            if (s.fd < 0 || s.closing || s.remaining > 0)
+                continue;
+            if (s.release <= abs)
+            {
+                shutdown(s.fd, SHUT_WR);
+                s.closing = true;
+            }
+            else
+                wake = std::min(wake, s.release);
+        }
+
+        epoll_event events[256];
+        int timeout = std::max(0, static_cast<int>((wake - now()) * 1000));
+        int n = epoll_wait(epfd, events, 256, std::min(timeout, 100));
+
+        for (int i = 0; i < n; ++i)
+        {
+            Session &s = sessions[events[i].data.fd];
+            if (s.fd < 0)
+                continue;
+
+            if (events[i].events & EPOLLOUT && s.remaining > 0)
+            {
+                ssize_t w = send(s.fd, filler, std::min(s.remaining, sizeof(filler)), MSG_NOSIGNAL);
+                if (w > 0)
+                    s.remaining -= w;
+                else if (errno != EAGAIN)
+                    s.remaining = 0;
+            }
+            if (s.remaining == 0)
+            {
+                epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.fd = s.fd;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, s.fd, &ev);
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                char buf[16384];
+                ssize_t r;
+                while ((r = recv(s.fd, buf, sizeof(buf), 0)) > 0);
+                if (r == 0)
+                    finish(s, true);
+                else if (errno != EAGAIN)
+                    finish(s, false);
+            }
+        }
+    }
+
+    double elapsed = now() - start;
+
+    std::ostringstream json;
+    json << "{\"replayed\":" << schedule.size()
+         << ",\"errors\":" << errors
+         << ",\"speed\":" << speed
+         << ",\"elapsed_s\":" << elapsed
+         << ",\"trace_span_s\":" << schedule.back().at
+         << ",\"schedule_lag_us\":{\"p50\":" << percentile(lag, 0.5) * 1e6
+         << ",\"p99\":" << percentile(lag, 0.99) * 1e6
+         << ",\"max\":" << percentile(lag, 1) * 1e6
+         << "},\"session_s\":{\"p50\":" << percentile(length, 0.5)
+         << ",\"p99\":" << percentile(length, 0.99)
+         << ",\"max\":" << percentile(length, 1)
+         << "}}";
+    cout << json.str() << endl;
+
+    close(epfd);
+    return errors ? 1 : 0;
+}
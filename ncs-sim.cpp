@@ -0,0 +1,694 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ncs-sim: run the server's accept/spawn/reap loop against a simulated
+// kernel.
+//
+// Connections arrive from a trace recorded with --trace, on a virtual
+// clock that jumps ahead whenever the server has nothing to do, so hours
+// of traffic take seconds. Handlers are pretend processes that exit after
+// their recorded duration with their recorded status. Nothing is exec'd;
+// the server's own limits, queues and breakers decide who gets a handler
+// when. A JSON summary is printed on stdout, and the exit status is 1 if
+// an invariant broke: a connection's socket leaked, a handler was never
+// reaped or --max-children was exceeded.
+//
+// Only stream connections are simulated. Features that need the
+// handler's data (--relay, --cache, --tls-cert, --capture-stderr), a
+// real child (--cgroup, --zygotes) or datagrams (--udp, --udp-wait) have
+// no simulated counterpart and are refused.
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cmdparser.h"
+#include "sockaddr.h"
+#include "system.h"
+#include "trace.h"
+
+using namespace std;
+
+int serve(int argc, char **argv);
+
+// Options without a simulated counterpart. The zygotes and the cgroup
+// spawn real handlers behind System's back, the relay and stderr capture
+// wait for output nobody writes, and neither TLS, the cache nor UDP have
+// simulated sockets.
+static const char *const unsimulated_options[] = {
+    "zygotes", "cgroup", "relay", "capture-stderr", "tls-cert", "cache", "udp", "udp-wait",
+};
+static const char unsimulated_flags[] = "ru";   // --relay, --udp
+
+// The refused option in a command line argument, empty if it's fine
+static std::string unsimulated(const std::string &arg)
+{
+    if (!arg.compare(0, 2, "--"))
+    {
+        std::string name = arg.substr(2, arg.find('=') - 2);
+        for (const char *option : unsimulated_options)
+            if (name == option)
+                return "--" + name;
+        return std::string();
+    }
+
+    // A group of flags like -ior, possibly with =value
+    if (arg.size() > 1 && arg[0] == '-')
+        for (size_t i = 1; i < arg.size() && arg[i] != '='; ++i)
+            if (std::strchr(unsimulated_flags, arg[i]))
+                return std::string("-") + arg[i];
+    return std::string();
+}
+
+
+// Parse Commandline Options
+static CmdParser::ArgumentMap parse_argv(int argc, char **argv)
+{
+    CmdParser::Parser parser;
+    CmdParser::ArgumentMap args;
+
+    // Help
+    parser.newSwitch("help");
+    parser.addFlag("help", 'h');
+    parser.addDocumentation("help", "Show this help and exit");
+    parser.setTerminal("help");
+
+    parser.newOption("speed", std::string("1"));
+    parser.addFlag("speed", 's');
+    parser.addDocumentation("speed", "Time compression factor of the arrivals (2 is twice the load)", "<x>");
+
+    parser.newOption("scale", std::string("1"));
+    parser.addDocumentation("scale", "Factor on the recorded handler durations (0.5 models a backend twice as fast)", "<x>");
+
+    parser.newOption("spawn-cost", 0l);
+    parser.addDocumentation("spawn-cost", "Virtual time every handler spawn takes", "<us>");
+
+    parser.newOption("limit", 0l);
+    parser.addFlag("limit", 'n');
+    parser.addDocumentation("limit", "Only simulate the first <n> connections", "<n>");
+
+    parser.newOption("server", std::string());
+    parser.addFlag("server", 'S');
+    parser.addDocumentation("server", "The server's options, e.g. \"--max-children 64 --fair-queue 256\"", "<options>");
+
+    parser.newSwitch("verbose");
+    parser.addFlag("verbose", 'v');
+    parser.addDocumentation("verbose", "Keep the server's log");
+
+    parser.newArgument("trace", CmdParser::Variant::required);
+    parser.addDocumentation("trace", "The trace file to replay");
+
+    parser.newArgument("exec", CmdParser::Variant::required);
+    parser.addDocumentation("exec", "The handler, as given to the server; it never actually runs");
+
+    try {
+        args = parser.parse(argc, argv);
+    } catch (CmdParser::ParsingError &e) {
+        cerr << "Error: " << e.what() << endl;
+        cerr << parser.compileUsage(argv[0]) << endl;
+        exit(1);
+    }
+
+    if (args["help"].toBool())
+    {
+        cout << parser.compileHelp(argv[0]) << endl;
+        exit(0);
+    }
+
+    return args;
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    size_t i = static_cast<size_t>(p * (v.size() - 1) + 0.5);
+    return v[std::min(i, v.size() - 1)];
+}
+
+// -------------------------------------------------------------------
+// A connection from the trace
+struct Arrival
+{
+    uint64_t at_ns;         // virtual time
+    uint64_t service_ns;    // how long its handler runs
+    int status;             // the handler's wait() status
+    sockaddr_inet peer;
+};
+
+// The kernel the server runs against. Everything it doesn't simulate is
+// passed through, so the server can still bind its sockets and set up
+// its signalfd; only nobody ever connects to them for real.
+class SimKernel : public System
+{
+public:
+    SimKernel(std::vector<Arrival> &&arrivals, uint64_t realtime_base_ns, uint64_t spawn_cost_ns);
+
+    int listen(int fd, int backlog) override;
+    int accept(int fd, sockaddr *addr, socklen_t *size, int flags) override;
+    int close(int fd) override;
+    pid_t spawn(int fd) override;
+    pid_t waitpid(pid_t pid, int *status, int options) override;
+    int kill(pid_t pid, int signo) override;
+    int clock_gettime(clockid_t clock, timespec *ts) override;
+    int signalfd(int fd, const sigset_t *mask, int flags) override;
+    int epoll_ctl(int epfd, int op, int fd, epoll_event *event) override;
+    int epoll_wait(int epfd, epoll_event *events, int max_events, int timeout_ms) override;
+    ssize_t read(int fd, void *buf, size_t size) override;
+
+    void report(size_t max_children, double wall_s);
+
+private:
+    struct Connection
+    {
+        size_t arrival;
+        bool spawned;
+    };
+
+    struct Child
+    {
+        uint64_t exit_ns;
+        int status;
+        bool exited;
+    };
+
+    typedef std::pair<uint64_t, pid_t> Exit;
+
+    std::vector<Arrival> arrivals;
+    size_t next_arrival;
+    std::deque<size_t> backlog;
+    size_t backlog_max;
+    std::unordered_map<int, epoll_event> listeners;     // fd -> interest
+    int devnull;
+
+    uint64_t now_ns;
+    uint64_t realtime_base_ns;
+    uint64_t spawn_cost_ns;
+
+    std::unordered_map<int, Connection> connections;    // by fd
+    std::unordered_map<pid_t, Child> children;          // until reaped
+    std::priority_queue<Exit, std::vector<Exit>, std::greater<Exit>> exits;
+    std::deque<pid_t> zombies;
+    pid_t next_pid;
+
+    int sigfd;
+    epoll_event sigfd_interest;
+    bool sigchld_pending;
+    bool sigint_pending;
+    bool stopping;
+    bool stalled;           // stopped with connections left in the backlog
+
+    // Statistics
+    uint64_t refused, accepted, spawned, turned_away, abandoned;
+    size_t peak_children, peak_backlog;
+    std::vector<double> accept_wait_ms, spawn_wait_ms, reap_delay_ms;
+
+    void advance(uint64_t to_ns);
+    bool finished() const;
+};
+
+// Pids above the kernel's pid_max can't belong to anything real
+static const pid_t first_pid = 1 << 22;
+
+SimKernel::SimKernel(std::vector<Arrival> &&trace, uint64_t realtime_base, uint64_t spawn_cost) :
+    arrivals(std::move(trace)), next_arrival(0), backlog_max(SOMAXCONN), devnull(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+    now_ns(1000000000), realtime_base_ns(realtime_base), spawn_cost_ns(spawn_cost), next_pid(first_pid),
+    sigfd(-1), sigfd_interest(), sigchld_pending(false), sigint_pending(false), stopping(false), stalled(false),
+    refused(0), accepted(0), spawned(0), turned_away(0), abandoned(0), peak_children(0), peak_backlog(0)
+{
+    for (Arrival &a : arrivals)
+        a.at_ns += now_ns;
+}
+
+int SimKernel::listen(int fd, int backlog)
+{
+    if (System::listen(fd, backlog) < 0)
+        return -1;
+
+    // Linux caps the accept queue at somaxconn
+    backlog_max = std::min(backlog_max, static_cast<size_t>(std::max(1, std::min(backlog, SOMAXCONN))));
+    listeners[fd] = epoll_event();
+    return 0;
+}
+
+int SimKernel::accept(int fd, sockaddr *addr, socklen_t *size, int flags)
+{
+    if (!listeners.count(fd))
+        return System::accept(fd, addr, size, flags);
+
+    if (backlog.empty())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Real descriptors, so nothing the server does with them touches
+    // anything else
+    int sock = fcntl(devnull, F_DUPFD_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    size_t i = backlog.front();
+    backlog.pop_front();
+    const Arrival &a = arrivals[i];
+
+    if (addr && size)
+    {
+        socklen_t n = a.peer.family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+        std::memcpy(addr, &a.peer, std::min(n, *size));
+        *size = n;
+    }
+
+    Connection c;
+    c.arrival = i;
+    c.spawned = false;
+    connections[sock] = c;
+
+    ++accepted;
+    accept_wait_ms.push_back((now_ns - a.at_ns) / 1e6);
+    return sock;
+}
+
+int SimKernel::close(int fd)
+{
+    auto it = connections.find(fd);
+    if (it != connections.end())
+    {
+        if (!it->second.spawned)
+            ++(stopping ? abandoned : turned_away);
+        connections.erase(it);
+    }
+    return System::close(fd);
+}
+
+pid_t SimKernel::spawn(int fd)
+{
+    now_ns += spawn_cost_ns;
+
+    pid_t pid = next_pid++;
+    Child &child = children[pid];
+    child.exit_ns = now_ns;
+    child.status = 0;
+    child.exited = false;
+
+    auto it = connections.find(fd);
+    if (it != connections.end())
+    {
+        const Arrival &a = arrivals[it->second.arrival];
+        it->second.spawned = true;
+        child.exit_ns += a.service_ns;
+        child.status = a.status;
+        spawn_wait_ms.push_back((now_ns - a.at_ns) / 1e6);
+    }
+
+    exits.push(Exit(child.exit_ns, pid));
+    ++spawned;
+    peak_children = std::max(peak_children, children.size());
+    return pid;
+}
+
+pid_t SimKernel::waitpid(pid_t pid, int *status, int options)
+{
+    if (pid != -1 || !(options & WNOHANG))
+        return System::waitpid(pid, status, options);
+
+    if (zombies.empty())
+    {
+        if (children.empty())
+        {
+            errno = ECHILD;
+            return -1;
+        }
+        return 0;
+    }
+
+    pid_t reaped = zombies.front();
+    zombies.pop_front();
+
+    auto it = children.find(reaped);
+    if (status)
+        *status = it->second.status;
+    reap_delay_ms.push_back((now_ns - it->second.exit_ns) / 1e6);
+    children.erase(it);
+    return reaped;
+}
+
+int SimKernel::kill(pid_t pid, int signo)
+{
+    if (pid < first_pid)
+        return System::kill(pid, signo);
+
+    auto it = children.find(pid);
+    if (it == children.end())
+    {
+        errno = ESRCH;
+        return -1;
+    }
+    if (signo == 0 || it->second.exited)
+        return 0;
+
+    // Handlers don't catch anything
+    it->second.exit_ns = now_ns;
+    it->second.status = signo;
+    exits.push(Exit(now_ns, pid));
+    advance(now_ns);
+    return 0;
+}
+
+int SimKernel::clock_gettime(clockid_t clock, timespec *ts)
+{
+    uint64_t ns;
+    if (clock == CLOCK_MONOTONIC || clock == CLOCK_MONOTONIC_COARSE || clock == CLOCK_BOOTTIME)
+        ns = now_ns;
+    else if (clock == CLOCK_REALTIME || clock == CLOCK_REALTIME_COARSE)
+        ns = realtime_base_ns + now_ns;
+    else
+        return System::clock_gettime(clock, ts);
+
+    ts->tv_sec = static_cast<time_t>(ns / 1000000000);
+    ts->tv_nsec = static_cast<long>(ns % 1000000000);
+    return 0;
+}
+
+int SimKernel::signalfd(int fd, const sigset_t *mask, int flags)
+{
+    int ret = System::signalfd(fd, mask, flags);
+    if (fd < 0 && ret >= 0)
+        sigfd = ret;
+    return ret;
+}
+
+int SimKernel::epoll_ctl(int epfd, int op, int fd, epoll_event *event)
+{
+    if (System::epoll_ctl(epfd, op, fd, event) < 0)
+        return -1;
+
+    epoll_event interest = op == EPOLL_CTL_DEL ? epoll_event() : *event;
+    if (listeners.count(fd))
+        listeners[fd] = interest;
+    else if (fd == sigfd)
+        sigfd_interest = interest;
+    return 0;
+}
+
+int SimKernel::epoll_wait(int epfd, epoll_event *events, int max_events, int timeout_ms)
+{
+    uint64_t deadline = timeout_ms < 0 ? UINT64_MAX : now_ns + static_cast<uint64_t>(timeout_ms) * 1000000;
+
+    for (;;)
+    {
+        // Whatever is really there first, e.g. a real SIGINT
+        int n = System::epoll_wait(epfd, events, max_events, 0);
+        if (n < 0)
+            return n;
+
+        if (!backlog.empty())
+            for (const auto &l : listeners)
+                if ((l.second.events & EPOLLIN) && n < max_events)
+                {
+                    events[n] = l.second;
+                    events[n++].events = EPOLLIN;
+                }
+        if ((sigchld_pending || sigint_pending) && (sigfd_interest.events & EPOLLIN) && n < max_events)
+        {
+            events[n] = sigfd_interest;
+            events[n++].events = EPOLLIN;
+        }
+        if (n > 0 || now_ns >= deadline)
+            return n;
+
+        // Nothing to do until the next arrival, exit or timer
+        uint64_t next = deadline;
+        if (next_arrival < arrivals.size())
+            next = std::min(next, arrivals[next_arrival].at_ns);
+        if (!exits.empty())
+            next = std::min(next, exits.top().first);
+
+        // Everything played out, or nothing ever will again: stop the
+        // server the usual way
+        if (!stopping && (finished() || next == UINT64_MAX))
+        {
+            stalled = !finished();
+            stopping = true;
+            sigint_pending = true;
+            continue;
+        }
+        if (next == UINT64_MAX)
+            return 0;
+
+        advance(std::max(next, now_ns));
+    }
+}
+
+ssize_t SimKernel::read(int fd, void *buf, size_t size)
+{
+    if (fd != sigfd || size < sizeof(signalfd_siginfo) || !(sigchld_pending || sigint_pending))
+        return System::read(fd, buf, size);
+
+    signalfd_siginfo *si = static_cast<signalfd_siginfo*>(buf);
+    std::memset(si, 0, sizeof(*si));
+    if (sigchld_pending)
+    {
+        si->ssi_signo = SIGCHLD;
+        sigchld_pending = false;
+    }
+    else
+    {
+        si->ssi_signo = SIGINT;
+        sigint_pending = false;
+    }
+    return sizeof(*si);
+}
+
+void SimKernel::advance(uint64_t to_ns)
+{
+    now_ns = to_ns;
+
+    while (next_arrival < arrivals.size() && arrivals[next_arrival].at_ns <= now_ns)
+    {
+        // A full accept queue drops the SYN; the client gives up
+        if (backlog.size() >= backlog_max)
+            ++refused;
+        else
+            backlog.push_back(next_arrival);
+        ++next_arrival;
+    }
+    peak_backlog = std::max(peak_backlog, backlog.size());
+
+    while (!exits.empty() && exits.top().first <= now_ns)
+    {
+        Exit e = exits.top();
+        exits.pop();
+
+        // Killed before its time, or already handled
+        auto it = children.find(e.second);
+        if (it == children.end() || it->second.exited || it->second.exit_ns != e.first)
+            continue;
+
+        it->second.exited = true;
+        zombies.push_back(e.second);
+        sigchld_pending = true;
+    }
+}
+
+bool SimKernel::finished() const
+{
+    return next_arrival == arrivals.size() && backlog.empty() && children.empty();
+}
+
+void SimKernel::report(size_t max_children, double wall_s)
+{
+    size_t leaked = connections.size();
+    size_t unreaped = children.size();
+    bool within_limit = !max_children || peak_children <= max_children;
+    bool ok = !leaked && !unreaped && within_limit && !stalled && next_arrival == arrivals.size();
+    double virtual_s = (now_ns - 1000000000) / 1e9;
+
+    std::ostringstream json;
+    json << "{\"connections\":" << arrivals.size()
+         << ",\"simulated\":" << next_arrival
+         << ",\"refused\":" << refused
+         << ",\"accepted\":" << accepted
+         << ",\"spawned\":" << spawned
+         << ",\"turned_away\":" << turned_away
+         << ",\"abandoned\":" << abandoned
+         << ",\"peak_children\":" << peak_children
+         << ",\"max_children\":" << max_children
+         << ",\"peak_backlog\":" << peak_backlog
+         << ",\"backlog\":" << backlog_max
+         << ",\"accept_wait_ms\":{\"p50\":" << percentile(accept_wait_ms, 0.5)
+         << ",\"p99\":" << percentile(accept_wait_ms, 0.99)
+         << ",\"max\":" << percentile(accept_wait_ms, 1)
+         << "},\"spawn_wait_ms\":{\"p50\":" << percentile(spawn_wait_ms, 0.5)
+         << ",\"p99\":" << percentile(spawn_wait_ms, 0.99)
+         << ",\"max\":" << percentile(spawn_wait_ms, 1)
+         << "},\"reap_delay_ms\":{\"p99\":" << percentile(reap_delay_ms, 0.99)
+         << ",\"max\":" << percentile(reap_delay_ms, 1)
+         << "},\"virtual_s\":" << virtual_s
+         << ",\"wall_s\":" << wall_s
+         << ",\"leaked_fds\":" << leaked
+         << ",\"zombies\":" << unreaped
+         << ",\"stranded\":" << backlog.size()
+         << ",\"within_limit\":" << (within_limit ? "true" : "false")
+         << ",\"ok\":" << (ok ? "true" : "false")
+         << "}";
+    cout << json.str() << endl;
+
+    // The server exits on its own; this is the verdict
+    _exit(ok ? 0 : 1);
+}
+
+// -------------------------------------------------------------------
+static SimKernel *sim;
+static size_t max_children;
+static timespec wall_start;
+
+static void report()
+{
+    timespec t;
+    ::clock_gettime(CLOCK_MONOTONIC, &t);
+    double wall_s = (t.tv_sec - wall_start.tv_sec) + (t.tv_nsec - wall_start.tv_nsec) * 1e-9;
+    sim->report(max_children, wall_s);
+}
+
+int main(int argc, char **argv)
+{
+    CmdParser::ArgumentMap args = parse_argv(argc, argv);
+
+    double speed = std::atof(args["speed"].toString().c_str());
+    if (speed <= 0)
+        speed = 1;
+    double scale = std::atof(args["scale"].toString().c_str());
+    if (scale < 0)
+        scale = 1;
+    size_t limit = args["limit"].toNumber();
+    uint64_t spawn_cost_ns = static_cast<uint64_t>(std::max(0l, args["spawn-cost"].toNumber())) * 1000;
+
+    // Load the trace
+    std::vector<Trace::Record> records;
+    try {
+        Trace::Reader reader(args["trace"].toString());
+        Trace::Record r;
+        while (reader.next(r))
+            records.push_back(r);
+    } catch (Trace::TraceError &e) {
+        cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+        return 1;
+    }
+
+    // Records are written at reap time, arrivals need sorting
+    std::sort(records.begin(), records.end(),
+              [](const Trace::Record &a, const Trace::Record &b){return a.accepted_ns < b.accepted_ns;});
+    if (limit && records.size() > limit)
+        records.resize(limit);
+    if (records.empty())
+    {
+        cerr << "\033[31mError: Empty trace\033[0m" << endl;
+        return 1;
+    }
+
+    uint64_t first = records.front().accepted_ns;
+    std::vector<Arrival> arrivals;
+    arrivals.reserve(records.size());
+    for (const Trace::Record &r : records)
+    {
+        Arrival a;
+        a.at_ns = static_cast<uint64_t>((r.accepted_ns - first) / speed);
+        a.service_ns = static_cast<uint64_t>(r.duration_ns * scale);
+        a.status = r.status;
+        std::memset(&a.peer, 0, sizeof(a.peer));
+        a.peer.family = r.family == AF_INET6 ? AF_INET6 : AF_INET;
+        if (a.peer.family == AF_INET6)
+        {
+            std::memcpy(&a.peer.in6.sin6_addr, r.addr, 16);
+            a.peer.in6.sin6_port = htons(r.port);
+        }
+        else
+        {
+            std::memcpy(&a.peer.in.sin_addr, r.addr, 4);
+            a.peer.in.sin_port = htons(r.port);
+        }
+        arrivals.push_back(a);
+    }
+    uint64_t span_ns = arrivals.back().at_ns;
+    records.clear();
+    records.shrink_to_fit();
+
+    // The server's command line; unless told otherwise it listens somewhere harmless
+    std::vector<std::string> server_args = CmdParser::splitArgs(args["server"].toString());
+    bool bound = false;
+    for (size_t i = 0; i < server_args.size(); ++i)
+    {
+        const std::string &arg = server_args[i];
+        if (arg == "-p" || arg == "--port" || arg == "-b" || arg == "--bind" || arg == "--systemd")
+            bound = true;
+        if (arg == "--max-children" && i + 1 < server_args.size())
+            max_children = std::strtoul(server_args[i + 1].c_str(), NULL, 10);
+        std::string refused = unsimulated(arg);
+        if (!refused.empty())
+        {
+            cerr << "\033[31mError: " << refused << " can't be simulated\033[0m" << endl;
+            return 1;
+        }
+    }
+    if (!bound)
+        server_args.insert(server_args.begin(), {"-b", "127.0.0.1", "-p", "0"});
+    server_args.insert(server_args.begin(), argv[0]);
+    server_args.push_back(args["exec"].toString());
+
+    std::vector<char*> server_argv;
+    for (std::string &arg : server_args)
+        server_argv.push_back(&arg[0]);
+    server_argv.push_back(nullptr);
+
+    cerr << "\033[36mSimulating \033[35m" << arrivals.size() << "\033[36m connections over \033[35m"
+         << span_ns / 1e9 << "s\033[0m" << endl;
+
+    sim = new SimKernel(std::move(arrivals), first, spawn_cost_ns);
+    System::install(sim);
+    ::clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    std::atexit(report);
+
+    if (!args["verbose"].toBool())
+        cerr.rdbuf(nullptr);
+
+    return serve(static_cast<int>(server_argv.size() - 1), server_argv.data());
+}
@@ -0,0 +1,225 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ncs-top: live view of a NetCatServer's handlers.
+//
+// Reads the status file a server publishes with --status. The file is
+// mapped and read under its seqlocks, so watching never disturbs the
+// server; it doesn't even have to be the same user.
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cmdparser.h"
+#include "status.h"
+
+using namespace std;
+
+
+// Parse Commandline Options
+static CmdParser::ArgumentMap parse_argv(int argc, char **argv)
+{
+    CmdParser::Parser parser;
+    CmdParser::ArgumentMap args;
+
+    // Help
+    parser.newSwitch("help");
+    parser.addFlag("help", 'h');
+    parser.addDocumentation("help", "Show this help and exit");
+    parser.setTerminal("help");
+
+    parser.newOption("interval", 1l);
+    parser.addFlag("interval", 'd');
+    parser.addDocumentation("interval", "Seconds between updates", "<s>");
+
+    parser.newSwitch("once");
+    parser.addFlag("once", '1');
+    parser.addDocumentation("once", "Print a single snapshot and exit");
+
+    parser.newOption("lines", 40l);
+    parser.addFlag("lines", 'n');
+    parser.addDocumentation("lines", "Maximum number of handlers shown", "<n>");
+
+    parser.newArgument("status", CmdParser::Variant::required);
+    parser.addDocumentation("status", "The server's status file");
+
+    try {
+        args = parser.parse(argc, argv);
+    } catch (CmdParser::ParsingError &e) {
+        cerr << "Error: " << e.what() << endl;
+        cerr << parser.compileUsage(argv[0]) << endl;
+        exit(1);
+    }
+
+    if (args["help"].toBool())
+    {
+        cout << parser.compileHelp(argv[0]) << endl;
+        exit(0);
+    }
+
+    return args;
+}
+
+static uint64_t realtime_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static std::string peer(const Status::Slot &s)
+{
+    if (s.family == AF_UNIX)
+        return "local";
+
+    char addr[INET6_ADDRSTRLEN];
+    if (s.family == AF_INET6)
+        inet_ntop(AF_INET6, s.addr, addr, sizeof(addr));
+    else
+        inet_ntop(AF_INET, s.addr, addr, sizeof(addr));
+
+    char buf[INET6_ADDRSTRLEN + 10];
+    std::snprintf(buf, sizeof(buf), s.family == AF_INET6 ? "[%s]:%u" : "%s:%u", addr, s.port);
+    return buf;
+}
+
+static std::string duration(uint64_t ns)
+{
+    uint64_t s = ns / 1000000000;
+    char buf[32];
+    if (s < 60)
+        std::snprintf(buf, sizeof(buf), "%.1fs", ns / 1e9);
+    else if (s < 3600)
+        std::snprintf(buf, sizeof(buf), "%um%02us", static_cast<unsigned>(s / 60), static_cast<unsigned>(s % 60));
+    else
+        std::snprintf(buf, sizeof(buf), "%uh%02um", static_cast<unsigned>(s / 3600), static_cast<unsigned>(s / 60 % 60));
+    return buf;
+}
+
+static std::string bytes(uint64_t n)
+{
+    static const char units[] = "BKMGT";
+    double v = static_cast<double>(n);
+    int u = 0;
+    while (v >= 1024 && u < 4)
+    {
+        v /= 1024;
+        ++u;
+    }
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), u ? "%.1f%c" : "%.0f%c", v, units[u]);
+    return buf;
+}
+
+static const char *circuit_names[] = {"closed", "open", "half-open"};
+
+static void show(const Status::Reader &status, const Status::Counters &prev, double elapsed, size_t lines)
+{
+    Status::Header h = status.header();
+    const Status::Counters &c = h.counters;
+    uint64_t now = realtime_ns();
+
+    cout << "\033[32mNetCatServer \033[35m" << h.server_pid << "\033[36m up "
+         << duration(now - h.started_ns) << ": \033[35m" << h.service << "\033[0m\n";
+    cout << "\033[36mhandlers \033[35m" << c.running << "\033[36m running, \033[35m" << c.draining
+         << "\033[36m draining   listen queue \033[35m" << c.queue_depth << "/" << c.queue_limit
+         << "\033[36m   circuit \033[35m" << circuit_names[std::min<uint32_t>(c.circuit, 2)] << "\033[0m\n";
+
+    char rate[32];
+    std::snprintf(rate, sizeof(rate), "%.1f", elapsed > 0 ? (c.accepted - prev.accepted) / elapsed : 0.0);
+    cout << "\033[36maccepted \033[35m" << c.accepted << "\033[36m (\033[35m" << rate << "\033[36m/s)  closed \033[35m"
+         << c.closed << "\033[36m  failed \033[35m" << c.failed << "\033[36m  rejected \033[35m" << c.rejected
+         << "\033[36m  shed \033[35m" << c.shed;
+    if (c.unlisted)
+        cout << "\033[36m  unlisted \033[35m" << c.unlisted;
+    cout << "\033[0m\n\n";
+
+    std::vector<Status::Slot> slots;
+    for (uint32_t i = 0; i < status.slot_count(); ++i)
+    {
+        Status::Slot s = status.slot(i);
+        if (s.state != Status::free_slot)
+            slots.push_back(s);
+    }
+
+    // Longest running first
+    std::sort(slots.begin(), slots.end(), [](const Status::Slot &a, const Status::Slot &b) {
+        return a.started_ns < b.started_ns;
+    });
+
+    char line[160];
+    std::snprintf(line, sizeof(line), "%8s %-46s %-8s %4s %9s %9s %9s", "PID", "PEER", "STATE", "CPU", "AGE", "IN", "OUT");
+    cout << "\033[7m" << line << "\033[0m\n";
+
+    for (size_t i = 0; i < slots.size() && i < lines; ++i)
+    {
+        const Status::Slot &s = slots[i];
+        std::snprintf(line, sizeof(line), "%8d %-46s %-8s %4d %9s %9s %9s",
+                      s.pid, peer(s).c_str(), s.state == Status::draining ? "draining" : "running", s.cpu,
+                      duration(now - s.started_ns).c_str(), bytes(s.bytes_in).c_str(), bytes(s.bytes_out).c_str());
+        cout << line << "\n";
+    }
+    if (slots.size() > lines)
+        cout << "\033[36m... and \033[35m" << slots.size() - lines << "\033[36m more\033[0m\n";
+    cout.flush();
+}
+
+int main(int argc, char **argv)
+{
+    CmdParser::ArgumentMap args = parse_argv(argc, argv);
+
+    unsigned interval = static_cast<unsigned>(std::max(1l, args["interval"].toNumber()));
+    size_t lines = static_cast<size_t>(std::max(0l, args["lines"].toNumber()));
+
+    try {
+        Status::Reader status(args["status"].toString());
+
+        Status::Counters prev = status.header().counters;
+        if (args["once"].toBool())
+        {
+            show(status, prev, 0, lines);
+            return 0;
+        }
+
+        while (true)
+        {
+            cout << "\033[H\033[2J";
+            show(status, prev, interval, lines);
+            prev = status.header().counters;
+            sleep(interval);
+        }
+    } catch (Status::StatusError &e) {
+        cerr << "\033[31mError: " << e.what() << "\033[0m" << endl;
+        return 1;
+    }
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+/**
+ * @file probes.h
+ * @brief USDT probes on the connection lifecycle
+ *
+ * Static tracepoints in the "ncs" provider, for bpftrace, perf or
+ * SystemTap, e.g.
+ *   bpftrace -e 'usdt:./NetCatServer:ncs:reap { printf("%d %d\n", arg0, arg1); }'
+ *
+ * A disabled probe is a single nop. Arguments are only what is at hand
+ * anyway; the peer is passed as a struct sockaddr pointer and its port.
+ *
+ *   accept(fd, sockaddr *peer, port)
+ *   spawn__begin(fd, sockaddr *peer)
+ *   spawn__end(pid, fd)                pid < 0: fork failed
+ *   exec(pid, const char *file)        in the child, just before exec
+ *   reap(pid, status, lifetime_us)
+ *   close(pid, bytes_in, bytes_out)    after the relay finished
+ *
+ * Without <sys/sdt.h> (systemtap-sdt-dev) they compile to nothing.
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NCS_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef NCS_HAVE_PROBES
+#define NCS_PROBE2(name, a, b) DTRACE_PROBE2(ncs, name, a, b)
+#define NCS_PROBE3(name, a, b, c) DTRACE_PROBE3(ncs, name, a, b, c)
+#else
+#define NCS_PROBE2(name, a, b) do {} while (0)
+#define NCS_PROBE3(name, a, b, c) do {} while (0)
+#endif
@@ -0,0 +1,201 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <ctime>
+#include <cstring>
+#include <stdexcept>
+
+#include "looplag.h"
+#include "reactor.h"
+#include "system.h"
+
+static uint64_t monotonic_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Events carry the fd in the low and the slot generation in the high word,
+// so events for an fd that was removed (and maybe reused) in the same
+// iteration can be told apart.
+static uint64_t pack(int fd, uint32_t generation)
+{
+    return static_cast<uint64_t>(generation) << 32 | static_cast<uint32_t>(fd);
+}
+
+Reactor::Reactor() :
+    sigfd(-1), running(false), now(0), lag(nullptr)
+{
+    update_clock();
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        throw std::runtime_error(std::string("epoll_create1: ") + std::strerror(errno));
+    sigemptyset(&sigmask);
+}
+
+Reactor::~Reactor()
+{
+    if (sigfd >= 0)
+        close(sigfd);
+    close(epfd);
+}
+
+void Reactor::add(int fd, uint32_t events, Handler handler)
+{
+    if (slots.size() <= static_cast<size_t>(fd))
+        slots.resize(fd + 1);
+
+    Slot &slot = slots[fd];
+    ++slot.generation;
+    slot.handler.reset(new Handler(std::move(handler)));
+
+    epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = pack(fd, slot.generation);
+    if (System::current().epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        throw std::runtime_error(std::string("epoll_ctl: ") + std::strerror(errno));
+}
+
+void Reactor::modify(int fd, uint32_t events)
+{
+    epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = pack(fd, slots[fd].generation);
+    System::current().epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void Reactor::remove(int fd)
+{
+    if (static_cast<size_t>(fd) >= slots.size() || !slots[fd].handler)
+        return;
+
+    System::current().epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    ++slots[fd].generation;
+
+    // The handler may be the one currently running
+    retired.push_back(std::move(slots[fd].handler));
+}
+
+void Reactor::signal(int signo, SignalHandler handler)
+{
+    signal_handlers[signo] = std::move(handler);
+
+    sigaddset(&sigmask, signo);
+    sigprocmask(SIG_BLOCK, &sigmask, NULL);
+
+    if (sigfd < 0)
+    {
+        sigfd = System::current().signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+        add(sigfd, EPOLLIN, [this](uint32_t){this->dispatch_signals();});
+    }
+    else
+        System::current().signalfd(sigfd, &sigmask, 0);
+}
+
+void Reactor::dispatch_signals()
+{
+    signalfd_siginfo si;
+
+    while (System::current().read(sigfd, &si, sizeof(si)) == sizeof(si))
+    {
+        auto it = signal_handlers.find(si.ssi_signo);
+        if (it != signal_handlers.end())
+            it->second();
+    }
+}
+
+void Reactor::update_clock()
+{
+    timespec ts;
+    System::current().clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+void Reactor::run_once(int timeout_ms)
+{
+    epoll_event events[64];
+
+    if (!posted.empty())
+        timeout_ms = 0;
+    else
+    {
+        int timer_ms = wheel.next_timeout(now);
+        if (timer_ms >= 0 && (timeout_ms < 0 || timer_ms < timeout_ms))
+            timeout_ms = timer_ms;
+    }
+
+    int n = System::current().epoll_wait(epfd, events, 64, timeout_ms);
+    update_clock();
+    uint64_t woken_us = lag ? monotonic_us() : 0;
+
+    for (int i = 0; i < n; ++i)
+    {
+        int fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+        uint32_t generation = static_cast<uint32_t>(events[i].data.u64 >> 32);
+
+        const Slot &slot = slots[fd];
+        if (slot.generation != generation || !slot.handler)
+            continue;
+
+        // Handlers are heap allocated, so this stays valid even
+        // if the handler grows the slot table
+        Handler *handler = slot.handler.get();
+        (*handler)(events[i].events);
+    }
+
+    wheel.advance(now);
+
+    // Posted functions may post again; those run next time
+    running_posted.swap(posted);
+    for (std::function<void()> &fn : running_posted)
+        fn();
+    running_posted.clear();
+
+    retired.clear();
+
+    if (lag)
+        lag->record(monotonic_us() - woken_us);
+}
+
+void Reactor::post(std::function<void()> fn)
+{
+    posted.push_back(std::move(fn));
+}
+
+void Reactor::run()
+{
+    running = true;
+    while (running)
+        run_once();
+}
+
+void Reactor::stop()
+{
+    running = false;
+}
@@ -0,0 +1,133 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <signal.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "timerwheel.h"
+
+class LoopLag;
+
+/**
+ * @file reactor.h
+ * @brief epoll based event loop
+ */
+
+class Reactor
+{
+public:
+    typedef std::function<void(uint32_t events)> Handler;
+    typedef std::function<void()> SignalHandler;
+
+    Reactor();
+    ~Reactor();
+
+    /**
+     * @brief watch a file descriptor
+     * @param fd the file descriptor
+     * @param events EPOLL* event mask
+     * @param handler called with the ready events
+     * Handlers must tolerate spurious wakeups.
+     */
+    void add(int fd, uint32_t events, Handler handler);
+    void modify(int fd, uint32_t events);
+
+    /**
+     * @brief stop watching a file descriptor
+     * Must be called before the fd is closed. Events already
+     * collected for it in the current iteration are dropped.
+     */
+    void remove(int fd);
+
+    /**
+     * @brief handle a signal synchronously from the loop
+     * The signal is blocked and delivered through a signalfd.
+     */
+    void signal(int signo, SignalHandler handler);
+
+    /**
+     * @brief call a function after the current iteration's events
+     * Used to batch work that many handlers contribute to.
+     */
+    void post(std::function<void()> fn);
+
+    /**
+     * @brief the loop's timer wheel
+     * Timers are run after the iteration's events, before posted functions.
+     */
+    TimerWheel &timers() { return wheel; }
+
+    /**
+     * @brief monotonic time in milliseconds
+     * Cached once per iteration; use this as now_ms when arming timers.
+     */
+    uint64_t now_ms() const { return now; }
+
+    /**
+     * @brief record the lag of every iteration into this, if set
+     */
+    void set_lag_monitor(LoopLag *monitor) { lag = monitor; }
+
+    /**
+     * @brief run one iteration
+     * @param timeout_ms maximum time to wait, -1 for no limit
+     */
+    void run_once(int timeout_ms = -1);
+
+    /**
+     * @brief run until stop() is called
+     */
+    void run();
+    void stop();
+
+private:
+    struct Slot
+    {
+        uint32_t generation;
+        std::unique_ptr<Handler> handler;
+    };
+
+    int epfd;
+    int sigfd;
+    sigset_t sigmask;
+    bool running;
+    uint64_t now;
+    TimerWheel wheel;
+    LoopLag *lag;
+
+    std::vector<Slot> slots;
+    std::vector<std::unique_ptr<Handler>> retired;
+    std::vector<std::function<void()>> posted;
+    std::vector<std::function<void()>> running_posted;
+    std::unordered_map<int, SignalHandler> signal_handlers;
+
+    void dispatch_signals();
+    void update_clock();
+};
@@ -0,0 +1,265 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "client.h"
+#include "reactor.h"
+#include "relay.h"
+
+// One pipe buffer per call
+static const size_t splice_size = 65536;
+
+static void close_fd(int &fd)
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
+static bool make_pipe(int fds[2], int nonblock_end)
+{
+    // The handler's end must stay blocking
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return false;
+    fcntl(fds[nonblock_end], F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+Relay::Relay(Reactor &relay_reactor, int relay_sock, int relay_pass) :
+    bytes_in(0), bytes_out(0), last_active_ms(relay_reactor.now_ms()), reactor(relay_reactor), sock(relay_sock), pass(relay_pass), watching(false), notified(false),
+    record_limit(0), record_complete(false), record_dropped(false)
+{
+    in[0] = in[1] = out[0] = out[1] = -1;
+}
+
+Relay::~Relay()
+{
+    if (watching)
+        reactor.remove(sock);
+    if (in[1] >= 0)
+        reactor.remove(in[1]);
+    if (out[0] >= 0)
+        reactor.remove(out[0]);
+
+    close_fd(in[0]);
+    close_fd(in[1]);
+    close_fd(out[0]);
+    close_fd(out[1]);
+}
+
+bool Relay::open()
+{
+    if ((pass & PASS_IN) && !make_pipe(in, 1))
+        return false;
+    if ((pass & (PASS_OUT | PASS_ERR)) && !make_pipe(out, 0))
+        return false;
+    return true;
+}
+
+void Relay::start()
+{
+    close_fd(in[0]);
+    close_fd(out[1]);
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    // Edge triggered: every handler runs both directions until they block,
+    // and any change on either end of a direction retries it.
+    if (in[1] >= 0)
+        reactor.add(in[1], EPOLLOUT | EPOLLET, [this](uint32_t){
+            this->pump_in();
+            this->notify();
+        });
+    if (out[0] >= 0)
+        reactor.add(out[0], EPOLLIN | EPOLLET, [this](uint32_t){
+            this->pump_out();
+            this->notify();
+        });
+    reactor.add(sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, [this](uint32_t){
+        this->pump_in();
+        this->pump_out();
+        this->notify();
+    });
+    watching = true;
+}
+
+void Relay::child_exited()
+{
+    finish_in();
+    notify();
+}
+
+void Relay::record(size_t limit)
+{
+    record_limit = limit;
+}
+
+bool Relay::recorded(std::string &output)
+{
+    if (!record_complete)
+        return false;
+    output = std::move(record_copy);
+    record_complete = false;
+    return true;
+}
+
+void Relay::pump_in()
+{
+    while (in[1] >= 0)
+    {
+        ssize_t n = splice(sock, NULL, in[1], NULL, splice_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            bytes_in += n;
+            last_active_ms = reactor.now_ms();
+        }
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && errno == EAGAIN)
+            break;
+        else
+            // EOF from the peer or the handler closed its stdin
+            finish_in();
+    }
+}
+
+void Relay::pump_out()
+{
+    if (record_limit)
+    {
+        copy_out();
+        return;
+    }
+
+    while (out[0] >= 0)
+    {
+        ssize_t n = splice(out[0], NULL, sock, NULL, splice_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            bytes_out += n;
+            last_active_ms = reactor.now_ms();
+        }
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && errno == EAGAIN)
+            break;
+        else
+            // The handler closed its stdout or the peer went away
+            finish_out();
+    }
+}
+
+void Relay::copy_out()
+{
+    char buf[splice_size];
+
+    while (out[0] >= 0)
+    {
+        // Get rid of the last read before reading more
+        if (!unsent.empty())
+        {
+            ssize_t n = send(sock, unsent.data(), unsent.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0)
+            {
+                bytes_out += n;
+                last_active_ms = reactor.now_ms();
+                unsent.erase(0, n);
+            }
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (n < 0 && errno == EAGAIN)
+                break;
+            else
+            {
+                // The peer went away before the end
+                record_dropped = true;
+                finish_out();
+            }
+            continue;
+        }
+
+        ssize_t n = read(out[0], buf, sizeof(buf));
+        if (n > 0)
+        {
+            unsent.assign(buf, n);
+
+            // Too large to keep, but it still has to be relayed
+            if (record_copy.size() + n > record_limit)
+                record_dropped = true;
+            if (record_dropped)
+                record_copy.clear();
+            else
+                record_copy.append(buf, n);
+        }
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && errno == EAGAIN)
+            break;
+        else
+        {
+            // The handler closed its stdout
+            record_complete = n == 0 && !record_dropped;
+            finish_out();
+        }
+    }
+}
+
+void Relay::finish_in()
+{
+    if (in[1] < 0)
+        return;
+
+    reactor.remove(in[1]);
+    close_fd(in[1]);
+}
+
+void Relay::finish_out()
+{
+    if (out[0] < 0)
+        return;
+
+    reactor.remove(out[0]);
+    close_fd(out[0]);
+    shutdown(sock, SHUT_WR);
+}
+
+void Relay::notify()
+{
+    if (!done() || notified)
+        return;
+
+    reactor.remove(sock);
+    watching = false;
+    notified = true;
+
+    if (on_done)
+        on_done();
+}
@@ -0,0 +1,123 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+/**
+ * @file relay.h
+ * @brief splice() based stdio relay
+ *
+ * Instead of handing the socket itself to the handler, the handler's
+ * standard streams are connected to pipes and the server moves the data
+ * between socket and pipes with splice(), so it never passes through
+ * userspace. Half-closes are propagated in both directions.
+ */
+
+class Reactor;
+
+class Relay
+{
+public:
+    /**
+     * @param reactor the event loop to relay from
+     * @param sock the connected socket. It stays owned by the caller.
+     * @param pass the PASS_* streams to relay
+     */
+    Relay(Reactor &reactor, int sock, int pass);
+    ~Relay();
+
+    /**
+     * @brief create the pipes
+     * @return false on failure, with errno set
+     */
+    bool open();
+
+    // The handler's ends of the pipes, -1 if not relayed
+    int child_stdin() const { return in[0]; }
+    int child_stdout() const { return out[1]; }
+
+    /**
+     * @brief start relaying
+     * Call in the parent after fork(); closes the handler's ends.
+     */
+    void start();
+
+    /**
+     * @brief the handler has exited
+     * Stops reading from the socket. Output still buffered in
+     * the pipe is flushed out.
+     */
+    void child_exited();
+
+    /**
+     * @brief keep a copy of the handler's output
+     * Call before start(). The output then goes through userspace
+     * instead of being spliced.
+     * @param limit stop copying once the output grows larger
+     */
+    void record(size_t limit);
+
+    /**
+     * @brief take the recorded output
+     * @return false if it grew too large or didn't reach its end
+     */
+    bool recorded(std::string &output);
+
+    bool done() const { return in[1] < 0 && out[0] < 0; }
+
+    /**
+     * @brief called once both directions are finished
+     * The Relay may be destroyed from within the callback.
+     */
+    std::function<void()> on_done;
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t last_active_ms;    // Reactor::now_ms() of the last transfer
+
+private:
+    Reactor &reactor;
+    int sock;
+    int pass;
+    int in[2];      // socket -> handler stdin
+    int out[2];     // handler stdout -> socket
+    bool watching;  // the socket is registered with the reactor
+    bool notified;
+
+    size_t record_limit;    // 0 if not recording
+    bool record_complete;
+    bool record_dropped;    // too large, or the peer left early
+    std::string record_copy;
+    std::string unsent;     // read from the handler, not yet sent
+
+    void pump_in();
+    void pump_out();
+    void copy_out();
+    void finish_in();
+    void finish_out();
+    void notify();
+};
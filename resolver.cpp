@@ -0,0 +1,242 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <thread>
+
+#include "reactor.h"
+#include "resolver.h"
+
+// Lookups queued at most per worker before new ones are refused
+static const size_t jobs_per_worker = 64;
+
+static std::string address_key(const sockaddr_inet &addr)
+{
+    if (addr.family == AF_INET6)
+        return std::string(reinterpret_cast<const char*>(&addr.in6.sin6_addr), 16);
+    return std::string(reinterpret_cast<const char*>(&addr.in.sin_addr), 4);
+}
+
+// Names end up in command lines; anything but a plain hostname is
+// as good as no name
+static bool valid_hostname(const char *name)
+{
+    if (!*name)
+        return false;
+    for (const char *c = name; *c; ++c)
+        if (!isalnum(static_cast<unsigned char>(*c)) && *c != '.' && *c != '-' && *c != '_')
+            return false;
+    return true;
+}
+
+Resolver::Queue::Queue() :
+    wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), stopping(false)
+{
+}
+
+Resolver::Queue::~Queue()
+{
+    close(wakeup);
+}
+
+Resolver::Resolver(Reactor &resolver_reactor, unsigned threads, size_t max_entries, uint64_t ttl, uint64_t negative_ttl) :
+    hits(0), misses(0), failures(0), overflows(0),
+    reactor(resolver_reactor), queue(std::make_shared<Queue>()), workers(std::max(1u, threads)),
+    cache_size(max_entries), ttl_ms(ttl), negative_ttl_ms(negative_ttl)
+{
+    reactor.add(queue->wakeup, EPOLLIN, [this](uint32_t) {
+        this->collect();
+    });
+
+    // Signals are for the event loop, not the workers
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (size_t i = 0; i < workers; ++i)
+        std::thread(&Resolver::worker, queue).detach();
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+Resolver::~Resolver()
+{
+    reactor.remove(queue->wakeup);
+
+    // A worker stuck in getnameinfo() isn't worth waiting for; the last
+    // one out frees the queue
+    {
+        std::lock_guard<std::mutex> guard(queue->lock);
+        queue->stopping = true;
+    }
+    queue->work.notify_all();
+}
+
+bool Resolver::lookup(const sockaddr_inet &addr, std::string &name, Callback callback)
+{
+    name.clear();
+    if (addr.family != AF_INET && addr.family != AF_INET6)
+        return true;
+
+    std::string key = address_key(addr);
+
+    auto it = entries.find(key);
+    if (it != entries.end())
+    {
+        if (it->second->expires_ms > reactor.now_ms())
+        {
+            lru.splice(lru.begin(), lru, it->second);
+            name = it->second->name;
+            ++hits;
+            return true;
+        }
+        lru.erase(it->second);
+        entries.erase(it);
+    }
+    ++misses;
+
+    // Someone else is already asking
+    auto p = pending.find(key);
+    if (p != pending.end())
+    {
+        p->second.push_back(std::move(callback));
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(queue->lock);
+        if (queue->jobs.size() >= workers * jobs_per_worker)
+        {
+            ++overflows;
+            return true;
+        }
+
+        Job job;
+        job.key = key;
+        job.addr = addr;
+        queue->jobs.push_back(job);
+    }
+    queue->work.notify_one();
+
+    pending[key].push_back(std::move(callback));
+    return false;
+}
+
+void Resolver::worker(std::shared_ptr<Queue> queue)
+{
+    // Whatever policy the acceptor runs at is meant for it alone: a
+    // SCHED_FIFO worker would count against RLIMIT_RTTIME, and the
+    // SIGXCPU demotion can't reach it since it blocks all signals
+    sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+    std::unique_lock<std::mutex> guard(queue->lock);
+
+    for (;;)
+    {
+        queue->work.wait(guard, [&queue]() {
+            return queue->stopping || !queue->jobs.empty();
+        });
+        if (queue->stopping)
+            return;
+
+        Job job = queue->jobs.front();
+        queue->jobs.pop_front();
+        guard.unlock();
+
+        char host[NI_MAXHOST];
+        socklen_t size = job.addr.family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+        int err = getnameinfo(reinterpret_cast<const sockaddr*>(&job.addr), size, host, sizeof(host), NULL, 0, NI_NAMEREQD);
+
+        Result result;
+        result.key = job.key;
+        if (!err && valid_hostname(host))
+            result.name = host;
+
+        guard.lock();
+        queue->results.push_back(result);
+
+        uint64_t one = 1;
+        if (write(queue->wakeup, &one, sizeof(one)) < 0)
+        {
+            // Already signalled
+        }
+    }
+}
+
+void Resolver::collect()
+{
+    uint64_t n;
+    if (read(queue->wakeup, &n, sizeof(n)) < 0)
+        return;
+
+    std::vector<Result> done;
+    {
+        std::lock_guard<std::mutex> guard(queue->lock);
+        done.swap(queue->results);
+    }
+
+    for (const Result &result : done)
+    {
+        if (result.name.empty())
+            ++failures;
+        store(result.key, result.name);
+
+        auto it = pending.find(result.key);
+        if (it == pending.end())
+            continue;
+        std::vector<Callback> callbacks(std::move(it->second));
+        pending.erase(it);
+
+        for (Callback &callback : callbacks)
+            callback(result.name);
+    }
+}
+
+void Resolver::store(const std::string &key, const std::string &name)
+{
+    if (!cache_size)
+        return;
+
+    while (entries.size() >= cache_size)
+    {
+        entries.erase(lru.back().key);
+        lru.pop_back();
+    }
+
+    Entry e;
+    e.key = key;
+    e.name = name;
+    e.expires_ms = reactor.now_ms() + (name.empty() ? negative_ttl_ms : ttl_ms);
+    lru.push_front(e);
+    entries[key] = lru.begin();
+}
@@ -0,0 +1,139 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "sockaddr.h"
+
+/**
+ * @file resolver.h
+ * @brief asynchronous reverse DNS
+ *
+ * getnameinfo() blocks for as long as the DNS server takes, so it runs on
+ * a small pool of worker threads. Finished lookups are handed back to the
+ * event loop through an eventfd and cached, failures included, for a
+ * while. Lookups of an address that is already being resolved wait for
+ * that one. When the workers fall behind, new lookups fail right away
+ * instead of queuing without bound.
+ */
+
+class Reactor;
+
+class Resolver
+{
+public:
+    /**
+     * @brief called from the event loop with the name, empty if there is none
+     */
+    typedef std::function<void(const std::string &name)> Callback;
+
+    /**
+     * @param reactor the event loop callbacks are run from
+     * @param workers number of threads
+     * @param cache_size names kept at most
+     * @param ttl_ms how long names are kept
+     * @param negative_ttl_ms how long failures are kept
+     */
+    Resolver(Reactor &reactor, unsigned workers, size_t cache_size, uint64_t ttl_ms, uint64_t negative_ttl_ms);
+    ~Resolver();
+
+    Resolver(const Resolver &) = delete;
+    Resolver &operator=(const Resolver &) = delete;
+
+    /**
+     * @brief look up the name of an address
+     * @return true if the answer is known right away, in name. Otherwise
+     *  the callback runs once it is.
+     */
+    bool lookup(const sockaddr_inet &addr, std::string &name, Callback callback);
+
+    size_t size() const { return entries.size(); }
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t failures;      // lookups that found no usable name
+    uint64_t overflows;     // lookups refused because the workers were behind
+
+private:
+    struct Job
+    {
+        std::string key;
+        sockaddr_inet addr;
+    };
+
+    struct Result
+    {
+        std::string key;
+        std::string name;
+    };
+
+    struct Entry
+    {
+        std::string key;
+        std::string name;
+        uint64_t expires_ms;
+    };
+
+    typedef std::list<Entry> Lru;   // most recently used first
+
+    // Shared with the workers, which may outlive the resolver while
+    // stuck in getnameinfo()
+    struct Queue
+    {
+        Queue();
+        ~Queue();
+
+        int wakeup;                 // eventfd, written by the workers
+        std::mutex lock;
+        std::condition_variable work;
+        std::deque<Job> jobs;
+        std::vector<Result> results;
+        bool stopping;
+    };
+
+    Reactor &reactor;
+    std::shared_ptr<Queue> queue;
+    size_t workers;
+    size_t cache_size;
+    uint64_t ttl_ms;
+    uint64_t negative_ttl_ms;
+
+    Lru lru;
+    std::unordered_map<std::string, Lru::iterator> entries;
+    std::unordered_map<std::string, std::vector<Callback>> pending;
+
+    static void worker(std::shared_ptr<Queue> queue);
+    void collect();
+    void store(const std::string &key, const std::string &name);
+};
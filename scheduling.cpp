@@ -0,0 +1,161 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "scheduling.h"
+
+#ifndef SCHED_RESET_ON_FORK
+#define SCHED_RESET_ON_FORK 0x40000000
+#endif
+
+// linux/ioprio.h isn't always installed
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(cls, data) (((cls) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+
+static std::string strerr(const std::string &what)
+{
+    return what + ": " + std::strerror(errno);
+}
+
+// The loop spun for too long at real time priority. This can't go
+// through the reactor: if it is spinning it won't read the signalfd.
+static void rttime_exceeded(int)
+{
+    sched_param param;
+    param.sched_priority = 0;
+    sched_setscheduler(0, SCHED_OTHER | SCHED_RESET_ON_FORK, &param);
+
+    static const char msg[] = "\033[31mReal time limit exceeded, acceptor falls back to SCHED_OTHER\033[0m\n";
+    if (write(2, msg, sizeof(msg) - 1) < 0)
+        return;
+}
+
+void sched_acceptor(int nice, int fifo, unsigned cap_ms)
+{
+    sched_param param;
+    param.sched_priority = fifo;
+
+    if (fifo)
+    {
+        // The soft limit demotes the acceptor, the hard limit kills it
+        // should even that fail
+        rlimit rl;
+        rl.rlim_cur = static_cast<rlim_t>(cap_ms) * 1000;
+        rl.rlim_max = rl.rlim_cur + 1000000;
+        if (setrlimit(RLIMIT_RTTIME, &rl) < 0)
+            throw SchedError(strerr("RLIMIT_RTTIME"));
+
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = rttime_exceeded;
+        sigaction(SIGXCPU, &sa, NULL);
+
+        if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) < 0)
+            throw SchedError(strerr("SCHED_FIFO"));
+    }
+    else if (sched_setscheduler(0, SCHED_OTHER | SCHED_RESET_ON_FORK, &param) < 0)
+        throw SchedError(strerr("SCHED_RESET_ON_FORK"));
+
+    if (nice && setpriority(PRIO_PROCESS, 0, nice) < 0)
+        throw SchedError(strerr("setpriority"));
+}
+
+// ------------------ ChildSched ------------------
+ChildSched::ChildSched() :
+    set_nice(false), nice(0), policy(-1), ioprio(-1), timerslack(0)
+{
+}
+
+bool ChildSched::empty() const
+{
+    return !set_nice && policy < 0 && ioprio < 0 && !timerslack;
+}
+
+void ChildSched::parse_policy(const std::string &str)
+{
+    if (str == "other")
+        policy = SCHED_OTHER;
+    else if (str == "batch")
+        policy = SCHED_BATCH;
+    else if (str == "idle")
+        policy = SCHED_IDLE;
+    else
+        throw SchedError("Unknown scheduling policy '" + str + "'");
+}
+
+void ChildSched::parse_ioprio(const std::string &str)
+{
+    std::string cls = str.substr(0, str.find(':'));
+    int level = 4;
+
+    if (cls.size() < str.size())
+    {
+        char *end;
+        level = static_cast<int>(std::strtol(str.c_str() + cls.size() + 1, &end, 10));
+        if (*end || level < 0 || level > 7)
+            throw SchedError("Invalid IO priority level in '" + str + "'");
+    }
+
+    if (cls == "rt")
+        ioprio = IOPRIO_PRIO_VALUE(1, level);
+    else if (cls == "be")
+        ioprio = IOPRIO_PRIO_VALUE(2, level);
+    else if (cls == "idle")
+        ioprio = IOPRIO_PRIO_VALUE(3, 0);
+    else
+        throw SchedError("Unknown IO scheduling class '" + cls + "'");
+}
+
+bool ChildSched::apply() const
+{
+    bool ok = true;
+
+    if (policy >= 0)
+    {
+        sched_param param;
+        param.sched_priority = 0;
+        ok &= sched_setscheduler(0, policy, &param) == 0;
+    }
+
+    if (set_nice)
+        ok &= setpriority(PRIO_PROCESS, 0, nice) == 0;
+
+    if (ioprio >= 0)
+        ok &= syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == 0;
+
+    if (timerslack)
+        ok &= prctl(PR_SET_TIMERSLACK, timerslack, 0, 0, 0) == 0;
+
+    return ok;
+}
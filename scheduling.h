@@ -0,0 +1,87 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+/**
+ * @file scheduling.h
+ * @brief CPU and IO scheduling of the acceptor and the handlers
+ *
+ * Handlers are many and the acceptor is one, so under load it can wait
+ * behind all of them for a CPU. Raising the acceptor (nice or SCHED_FIFO)
+ * and lowering the handlers keeps accept latency flat. The acceptor always
+ * uses SCHED_RESET_ON_FORK, so handlers never inherit its priority.
+ */
+
+/**
+ * @brief The SchedError class
+ */
+class SchedError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+/**
+ * @brief raise the acceptor's priority
+ * @param nice the nice value, 0 to leave it
+ * @param fifo SCHED_FIFO priority, 0 for none
+ * @param cap_ms with SCHED_FIFO, fall back to SCHED_OTHER after running
+ *        this long without blocking (RLIMIT_RTTIME)
+ * @throws SchedError
+ */
+void sched_acceptor(int nice, int fifo, unsigned cap_ms);
+
+struct ChildSched
+{
+    bool set_nice;
+    int nice;
+    int policy;                 // SCHED_*, -1 to inherit
+    int ioprio;                 // IOPRIO_PRIO_VALUE, -1 to inherit
+    unsigned long timerslack;   // ns, 0 to inherit
+
+    ChildSched();
+
+    bool empty() const;
+
+    /**
+     * @brief parse other, batch or idle
+     * @throws SchedError
+     */
+    void parse_policy(const std::string &policy);
+
+    /**
+     * @brief parse <class>[:<level>], class being rt, be or idle
+     * @throws SchedError
+     */
+    void parse_ioprio(const std::string &ioprio);
+
+    /**
+     * @brief apply to the calling process
+     * Only makes system calls, so it's safe between fork() and exec().
+     * @return false if any setting failed, with errno set
+     */
+    bool apply() const;
+};
@@ -27,6 +27,8 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <sstream>
 
@@ -83,3 +85,96 @@ finish:
 
         return r;
 }
+
+int sd_notify(int unset_environment, const char *state) {
+        int fd = -1, r;
+        const char *e;
+        size_t len;
+        struct sockaddr_un sockaddr;
+
+        if (!state) {
+                r = -EINVAL;
+                goto finish;
+        }
+
+        e = getenv("NOTIFY_SOCKET");
+        if (!e)
+                return 0;
+
+        /* Must be an abstract socket, or an absolute path */
+        len = strlen(e);
+        if ((e[0] != '@' && e[0] != '/') || len < 2 || len > sizeof(sockaddr.sun_path)) {
+                r = -EINVAL;
+                goto finish;
+        }
+
+        fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sun_family = AF_UNIX;
+        memcpy(sockaddr.sun_path, e, len);
+
+        if (sockaddr.sun_path[0] == '@')
+                sockaddr.sun_path[0] = 0;
+
+        if (sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+                   (struct sockaddr*) &sockaddr, offsetof(struct sockaddr_un, sun_path) + len) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        r = 1;
+
+finish:
+        if (unset_environment)
+                unsetenv("NOTIFY_SOCKET");
+
+        if (fd >= 0)
+                close(fd);
+
+        return r;
+}
+
+int sd_watchdog_enabled(int unset_environment, uint64_t *usec) {
+        const char *e;
+        long long u;
+        int r;
+
+        e = getenv("WATCHDOG_USEC");
+        if (!e) {
+                r = 0;
+                goto finish;
+        }
+
+        u = atoll(e);
+        if (u <= 0) {
+                r = -EINVAL;
+                goto finish;
+        }
+
+        e = getenv("WATCHDOG_PID");
+        if (e) {
+                /* Is this for us? */
+                if (getpid() != s2int(e)) {
+                        r = 0;
+                        goto finish;
+                }
+        }
+
+        if (usec)
+                *usec = (uint64_t) u;
+
+        r = 1;
+
+finish:
+        if (unset_environment) {
+                unsetenv("WATCHDOG_USEC");
+                unsetenv("WATCHDOG_PID");
+        }
+
+        return r;
+}
@@ -61,4 +61,52 @@
 */
 int sd_listen_fds(int unset_environment);
 
+/*
+  Informs systemd about changed daemon state. This takes a number of
+  newline separated environment-style variable assignments in a
+  string. The following variables are used:
+
+    READY=1      Tells systemd that daemon startup is finished (only
+                 relevant for services of Type=notify).
+
+    STATUS=...   Passes a single-line status string back to systemd
+                 that describes the daemon state.
+
+    STOPPING=1   Tells systemd that the daemon is shutting down.
+
+    WATCHDOG=1   Tells systemd to update the watchdog timestamp.
+                 Services using this feature should do this in
+                 regular intervals. A watchdog framework can use the
+                 timestamps to detect failed services.
+
+  Returns a negative errno-style error code on failure. Returns > 0
+  if systemd could be notified, 0 if it couldn't possibly because
+  systemd is not running.
+
+  If the unset_environment parameter is non-zero sd_notify() will
+  unset the $NOTIFY_SOCKET environment variable before returning
+  (regardless whether the function call itself succeeded or
+  not). Further calls to sd_notify() will then fail, but the
+  variable is ultimately cleaned up.
+
+  See sd_notify(3) for more information.
+*/
+int sd_notify(int unset_environment, const char *state);
+
+/*
+  Returns > 0 if the service manager expects watchdog keep-alive
+  events to be sent regularly via sd_notify(0, "WATCHDOG=1"). Returns
+  0 if it does not expect this. If the usec argument is non-NULL
+  returns the watchdog timeout in µs after which the service manager
+  will act on a process that has not sent a watchdog keep alive
+  message. This function is useful to implement services that
+  recognize automatically if they are being run under supervision of
+  systemd with WatchdogSec= set. It is recommended for clients to
+  generate keep-alive pings via sd_notify(0, "WATCHDOG=1") every half
+  of the returned time.
+
+  See sd_watchdog_enabled(3) for more information.
+*/
+int sd_watchdog_enabled(int unset_environment, uint64_t *usec);
+
 #endif
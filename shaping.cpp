@@ -0,0 +1,196 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "shaping.h"
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+static std::vector<std::string> split(const std::string &str, char sep)
+{
+    std::vector<std::string> parts;
+    std::istringstream is(str);
+    std::string part;
+    while (std::getline(is, part, sep))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+SocketProfile::SocketProfile() :
+    pacing_rate(0), nodelay(false), cork(false), keepalive(false),
+    keepidle(0), keepintvl(0), keepcnt(0)
+{
+}
+
+bool SocketProfile::empty() const
+{
+    return !pacing_rate && sources.empty() && !nodelay && !cork && !keepalive;
+}
+
+uint64_t SocketProfile::parse_rate(const std::string &rate)
+{
+    char *end;
+    double value = std::strtod(rate.c_str(), &end);
+    std::string unit(end);
+
+    if (unit == "k" || unit == "K")
+        value *= 1e3;
+    else if (unit == "m" || unit == "M")
+        value *= 1e6;
+    else if (unit == "g" || unit == "G")
+        value *= 1e9;
+    else if (!unit.empty())
+        throw ShapingError("Invalid rate '" + rate + "'");
+
+    if (end == rate.c_str() || value < 1)
+        throw ShapingError("Invalid rate '" + rate + "'");
+
+    return static_cast<uint64_t>(value);
+}
+
+void SocketProfile::parse_sources(const std::string &list)
+{
+    for (const std::string &item : split(list, ','))
+    {
+        size_t eq = item.rfind('=');
+        size_t slash = item.rfind('/', eq);
+        if (eq == std::string::npos || slash == std::string::npos)
+            throw ShapingError("Expected <prefix>/<bits>=<rate>, got '" + item + "'");
+
+        SourceRate src;
+        std::memset(&src, 0, sizeof(src));
+        std::string addr = item.substr(0, slash);
+        src.bits = std::atoi(item.substr(slash + 1, eq - slash - 1).c_str());
+        src.rate = parse_rate(item.substr(eq + 1));
+
+        if (inet_pton(AF_INET, addr.c_str(), src.prefix) == 1)
+            src.family = AF_INET;
+        else if (inet_pton(AF_INET6, addr.c_str(), src.prefix) == 1)
+            src.family = AF_INET6;
+        else
+            throw ShapingError("Invalid address '" + addr + "'");
+
+        if (src.bits > (src.family == AF_INET ? 32u : 128u))
+            throw ShapingError("Invalid prefix length in '" + item + "'");
+
+        sources.push_back(src);
+    }
+}
+
+void SocketProfile::parse_tcp(const std::string &list)
+{
+    for (const std::string &item : split(list, ','))
+    {
+        if (item == "nodelay")
+            nodelay = true;
+        else if (item == "cork")
+            cork = true;
+        else if (item == "keepalive")
+            keepalive = true;
+        else if (!item.compare(0, 10, "keepalive="))
+        {
+            std::vector<std::string> parts = split(item.substr(10), ':');
+            if (parts.size() != 3)
+                throw ShapingError("Expected keepalive=<idle>:<interval>:<count>, got '" + item + "'");
+            keepalive = true;
+            keepidle = std::atoi(parts[0].c_str());
+            keepintvl = std::atoi(parts[1].c_str());
+            keepcnt = std::atoi(parts[2].c_str());
+        }
+        else
+            throw ShapingError("Unknown TCP option '" + item + "'");
+    }
+
+    if (nodelay && cork)
+        throw ShapingError("nodelay and cork are mutually exclusive");
+}
+
+uint64_t SocketProfile::rate_for(const sockaddr_inet &peer) const
+{
+    static const uint8_t v4mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+    const uint8_t *v4 = NULL, *v6 = NULL;
+    if (peer.family == AF_INET)
+        v4 = reinterpret_cast<const uint8_t*>(&peer.in.sin_addr);
+    else
+    {
+        v6 = reinterpret_cast<const uint8_t*>(&peer.in6.sin6_addr);
+        if (!std::memcmp(v6, v4mapped, sizeof(v4mapped)))
+            v4 = v6 + 12;
+    }
+
+    for (const SourceRate &src : sources)
+    {
+        if (src.family == AF_INET && v4 && prefix_match(v4, src.prefix, src.bits))
+            return src.rate;
+        if (src.family == AF_INET6 && v6 && prefix_match(v6, src.prefix, src.bits))
+            return src.rate;
+    }
+
+    return pacing_rate;
+}
+
+void SocketProfile::apply(int fd, const sockaddr_inet &peer) const
+{
+    int one = 1;
+
+    uint64_t rate = rate_for(peer);
+    if (rate)
+    {
+        // Older kernels only take 32 bits and would silently truncate
+        if (rate < 0xffffffffu)
+        {
+            uint32_t rate32 = static_cast<uint32_t>(rate);
+            setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32, sizeof(rate32));
+        }
+        else
+            setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+    }
+
+    if (nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (cork)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+
+    if (keepalive)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+        if (keepidle)
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle));
+        if (keepintvl)
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl));
+        if (keepcnt)
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt));
+    }
+}
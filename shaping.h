@@ -0,0 +1,100 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "sockaddr.h"
+
+/**
+ * @file shaping.h
+ * @brief per-connection socket options applied before the handler starts
+ *
+ * Bandwidth caps use SO_MAX_PACING_RATE, which the kernel enforces in the
+ * fq qdisc or, without it, in TCP's internal pacing. Since the socket is
+ * configured before it is handed to the handler there is no relay cost.
+ */
+
+/**
+ * @brief The ShapingError class
+ */
+class ShapingError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+struct SourceRate
+{
+    short family;
+    uint8_t prefix[16];
+    unsigned bits;
+    uint64_t rate;
+};
+
+struct SocketProfile
+{
+    uint64_t pacing_rate;               // bytes/s, 0: unlimited
+    std::vector<SourceRate> sources;    // first match overrides pacing_rate
+
+    bool nodelay;
+    bool cork;
+    bool keepalive;
+    int keepidle, keepintvl, keepcnt;   // 0: system default
+
+    SocketProfile();
+
+    bool empty() const;
+
+    /**
+     * @brief parse a rate like 1500, 64k or 10M (bytes/s)
+     * @throws ShapingError
+     */
+    static uint64_t parse_rate(const std::string &rate);
+
+    /**
+     * @brief parse a comma separated list of <prefix>/<bits>=<rate>
+     * @throws ShapingError
+     */
+    void parse_sources(const std::string &list);
+
+    /**
+     * @brief parse a comma separated list of nodelay, cork and
+     *        keepalive[=<idle>:<interval>:<count>]
+     * @throws ShapingError
+     */
+    void parse_tcp(const std::string &list);
+
+    /**
+     * @brief the pacing rate for a peer
+     */
+    uint64_t rate_for(const sockaddr_inet &peer) const;
+
+    /**
+     * @brief configure an accepted socket
+     */
+    void apply(int fd, const sockaddr_inet &peer) const;
+};
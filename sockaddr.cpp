@@ -0,0 +1,176 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <arpa/inet.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "sockaddr.h"
+
+char *peername(const sockaddr_inet &peer)
+{
+    static char straddr[sizeof(peer.un.sun_path)+3] = "[";
+
+    if (peer.family == AF_UNIX)
+    {
+        // Abstract names start with a NUL; unnamed peers have nothing at all
+        const char *path = peer.un.sun_path;
+        if (!path[0] && !path[1])
+            return strncpy(straddr+1, "local", sizeof(straddr)-1);
+        straddr[1] = path[0] ? path[0] : '@';
+        strncpy(straddr+2, path+1, sizeof(peer.un.sun_path)-1);
+        straddr[sizeof(straddr)-1] = 0;
+        return straddr+1;
+    }
+    else if (peer.family == AF_INET6)
+    {
+        inet_ntop(AF_INET6, &peer.in6.sin6_addr, straddr+1, sizeof(straddr)-2);
+        strncpy(straddr + strlen(straddr), "]", 2);
+        return straddr;
+    }
+    else
+    {
+        inet_ntop(AF_INET, &peer.in.sin_addr, straddr+1, sizeof(straddr)-2);
+        return straddr+1;
+    }
+}
+
+bool parse_unix(const std::string &spec, sockaddr_inet &addr, socklen_t &size)
+{
+    if (spec.compare(0, 5, "unix:") || spec.size() < 6)
+        return false;
+
+    std::string path = spec.substr(5);
+    if (path.size() >= sizeof(addr.un.sun_path))
+        return false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.un.sun_family = AF_UNIX;
+    memcpy(addr.un.sun_path, path.data(), path.size());
+
+    // Abstract names aren't NUL terminated; their length is all there is
+    size = offsetof(sockaddr_un, sun_path) + path.size();
+    if (path[0] == '@')
+        addr.un.sun_path[0] = 0;
+    else
+        ++size;
+    return true;
+}
+
+bool parse_inet(const std::string &spec, bool ipv6, sockaddr_inet &addr, std::string &ports)
+{
+    std::string host = spec;
+    ports.clear();
+
+    if (!host.compare(0, 1, "["))
+    {
+        size_t end = host.find(']');
+        if (end == std::string::npos || (end + 1 < host.size() && host[end + 1] != ':'))
+            return false;
+        if (end + 1 < host.size())
+            ports = host.substr(end + 2);
+        host = host.substr(1, end - 1);
+        ipv6 = true;
+    }
+    else if (host.find(':') != host.rfind(':'))
+        // Bare IPv6, no room for a port
+        ipv6 = true;
+    else if (host.find(':') != std::string::npos)
+    {
+        ports = host.substr(host.find(':') + 1);
+        host = host.substr(0, host.find(':'));
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    if (ipv6)
+    {
+        addr.in6.sin6_family = AF_INET6;
+        addr.in6.sin6_addr = in6addr_any;
+        return host.empty() || inet_pton(AF_INET6, host.c_str(), &addr.in6.sin6_addr) == 1;
+    }
+    else
+    {
+        addr.in.sin_family = AF_INET;
+        addr.in.sin_addr.s_addr = htonl(INADDR_ANY);
+        return host.empty() || inet_pton(AF_INET, host.c_str(), &addr.in.sin_addr) == 1;
+    }
+}
+
+static bool parse_port(const std::string &s, unsigned long &port)
+{
+    char *end;
+    port = strtoul(s.c_str(), &end, 10);
+    return !s.empty() && !*end && port <= 65535;
+}
+
+bool parse_ports(const std::string &spec, std::vector<uint16_t> &ports)
+{
+    std::istringstream is(spec);
+    std::string item;
+
+    while (std::getline(is, item, ','))
+    {
+        size_t dash = item.find('-');
+        unsigned long first, last;
+
+        if (dash == std::string::npos)
+        {
+            if (!parse_port(item, first))
+                return false;
+            last = first;
+        }
+        else if (!parse_port(item.substr(0, dash), first) || !parse_port(item.substr(dash + 1), last) || last < first)
+            return false;
+
+        for (unsigned long port = first; port <= last; ++port)
+            ports.push_back(static_cast<uint16_t>(port));
+    }
+    return !ports.empty();
+}
+
+bool prefix_match(const uint8_t *addr, const uint8_t *prefix, unsigned bits)
+{
+    unsigned bytes = bits / 8;
+    if (memcmp(addr, prefix, bytes))
+        return false;
+    if (bits % 8 == 0)
+        return true;
+    uint8_t mask = static_cast<uint8_t>(0xff << (8 - bits % 8));
+    return (addr[bytes] & mask) == (prefix[bytes] & mask);
+}
+
+void unmap_v4(sockaddr_inet &addr)
+{
+    if (addr.family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&addr.in6.sin6_addr))
+        return;
+
+    sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = addr.in6.sin6_port;
+    memcpy(&in.sin_addr, &addr.in6.sin6_addr.s6_addr[12], 4);
+    addr.in = in;
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @file sockaddr.h
+ * @brief socket address handling
+ */
+
+// Handle sockaddr structs
+union sockaddr_inet {
+    short family;
+    sockaddr_in in;
+    sockaddr_in6 in6;
+    sockaddr_un un;
+};
+
+// The address, "/path" or "@abstract" for UNIX sockets, "local" if unnamed
+char *peername(const sockaddr_inet &peer);
+
+/**
+ * @brief parse "unix:/path" or "unix:@abstract"
+ * @param spec the --bind argument
+ * @param addr filled in on success
+ * @param size the length to pass to bind()
+ * @return false if spec doesn't name a UNIX socket or is too long
+ */
+bool parse_unix(const std::string &spec, sockaddr_inet &addr, socklen_t &size);
+
+/**
+ * @brief parse an IP address with an optional port list
+ * "1.2.3.4", "1.2.3.4:80", "[::1]", "[::1]:8000-8099", "::1" or "" for any
+ * @param spec the --bind argument
+ * @param ipv6 whether "" means the IPv6 wildcard
+ * @param addr filled in on success, with port 0
+ * @param ports the port list, empty if spec has none
+ * @return false if the address is invalid
+ */
+bool parse_inet(const std::string &spec, bool ipv6, sockaddr_inet &addr, std::string &ports);
+
+/**
+ * @brief parse a port list like "80,443,8000-8099"
+ * @return false on syntax errors and out of range ports
+ */
+bool parse_ports(const std::string &spec, std::vector<uint16_t> &ports);
+
+// Whether the first bits of two addresses in network byte order agree
+bool prefix_match(const uint8_t *addr, const uint8_t *prefix, unsigned bits);
+
+// The v4 address of a v4-mapped IPv6 address, as seen on dual-stack sockets
+void unmap_v4(sockaddr_inet &addr);
@@ -0,0 +1,80 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+
+#include "spantrace.h"
+
+SpanTracer::SpanTracer(const std::string &path, size_t capacity) :
+    dropped(0), file(path), ring(capacity ? capacity : 1), head(0), count(0), pid(getpid())
+{
+}
+
+void SpanTracer::span(const char *name, int tid, uint64_t begin_ns, uint64_t end_ns, const std::string &args)
+{
+    Span &s = ring[head];
+    s.name = name;
+    s.tid = tid;
+    s.begin_ns = begin_ns;
+    s.end_ns = end_ns;
+    s.args = args;
+
+    head = (head + 1) % ring.size();
+    if (count < ring.size())
+        ++count;
+    else
+        ++dropped;
+}
+
+bool SpanTracer::write() const
+{
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::trunc);
+        f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+        // Oldest first
+        size_t first = (head + ring.size() - count) % ring.size();
+        for (size_t i = 0; i < count; ++i)
+        {
+            const Span &s = ring[(first + i) % ring.size()];
+            char times[64];
+            std::snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f",
+                          s.begin_ns / 1e3, (s.end_ns - s.begin_ns) / 1e3);
+
+            f << (i ? ",\n" : "")
+              << "{\"name\":\"" << s.name << "\",\"cat\":\"ncs\",\"ph\":\"X\"," << times
+              << ",\"pid\":" << pid << ",\"tid\":" << s.tid
+              << ",\"args\":{" << s.args << "}}";
+        }
+
+        f << "\n]}\n";
+        f.close();
+        if (!f)
+            return false;
+    }
+    return std::rename(tmp.c_str(), file.c_str()) == 0;
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @file spantrace.h
+ * @brief per-connection spans in the Chrome trace event format
+ *
+ * Spans are kept in a ring buffer, so a long running server holds on to
+ * the most recent ones only, and written out as JSON that chrome://tracing
+ * and ui.perfetto.dev can load. Each handler pid gets its own track.
+ */
+
+class SpanTracer
+{
+public:
+    /**
+     * @param path the file to write
+     * @param capacity the number of spans kept
+     */
+    SpanTracer(const std::string &path, size_t capacity);
+
+    /**
+     * @brief record a complete span
+     * @param name a string literal
+     * @param tid the track
+     * @param begin_ns CLOCK_MONOTONIC
+     * @param end_ns CLOCK_MONOTONIC
+     * @param args the members of a JSON object, e.g. "\"status\":0"
+     */
+    void span(const char *name, int tid, uint64_t begin_ns, uint64_t end_ns, const std::string &args = std::string());
+
+    /**
+     * @brief write the buffered spans, replacing the file atomically
+     * @return false on failure, with errno set
+     */
+    bool write() const;
+
+    const std::string &path() const { return file; }
+
+    uint64_t dropped;   // overwritten before they were written
+
+private:
+    struct Span
+    {
+        const char *name;
+        int tid;
+        uint64_t begin_ns;
+        uint64_t end_ns;
+        std::string args;
+    };
+
+    std::string file;
+    std::vector<Span> ring;
+    size_t head;
+    size_t count;
+    int pid;
+};
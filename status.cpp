@@ -0,0 +1,247 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include "status.h"
+
+namespace Status {
+
+static std::string strerr(const std::string &what)
+{
+    return what + ": " + std::strerror(errno);
+}
+
+// ------------------ seqlock ------------------
+static void write_begin(uint32_t &seq)
+{
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(uint32_t &seq)
+{
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Gives up eventually, in case the server died in the middle of a write
+template <typename T>
+static T read_consistent(const T &shared)
+{
+    T copy;
+
+    for (int tries = 0; tries < 100000; ++tries)
+    {
+        uint32_t before = __atomic_load_n(&shared.seq, __ATOMIC_ACQUIRE);
+        if (before & 1)
+            continue;
+        std::memcpy(&copy, &shared, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared.seq, __ATOMIC_RELAXED) == before)
+            return copy;
+    }
+
+    std::memcpy(&copy, &shared, sizeof(copy));
+    return copy;
+}
+
+// ------------------ Writer ------------------
+Writer::Writer(const std::string &path, uint32_t slot_count, const std::string &service) :
+    file(path), size(sizeof(Header) + slot_count * sizeof(Slot)), header(nullptr), slots(nullptr)
+{
+    // Readers may still have the old one mapped; don't truncate it under them
+    unlink(path.c_str());
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw StatusError(strerr(path));
+
+    if (ftruncate(fd, static_cast<off_t>(size)) < 0)
+    {
+        std::string err = strerr(path);
+        close(fd);
+        throw StatusError(err);
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw StatusError(strerr("mmap " + path));
+
+    header = static_cast<Header*>(map);
+    slots = reinterpret_cast<Slot*>(header + 1);
+
+    // The file starts out zeroed
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->version = version;
+    header->slot_size = sizeof(Slot);
+    header->slot_count = slot_count;
+    header->server_pid = getpid();
+    header->started_ns = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    std::strncpy(header->service, service.c_str(), sizeof(header->service) - 1);
+
+    // Readers check the magic last
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    std::memcpy(header->magic, "NCSSTAT", 8);
+
+    free_slots.reserve(slot_count);
+    for (uint32_t i = slot_count; i > 0; --i)
+        free_slots.push_back(static_cast<int>(i - 1));
+}
+
+Writer::~Writer()
+{
+    munmap(header, size);
+    unlink(file.c_str());
+}
+
+void Writer::update(const Counters &counters)
+{
+    write_begin(header->seq);
+    header->counters = counters;
+    write_end(header->seq);
+}
+
+Slot &Writer::begin(int index)
+{
+    Slot &slot = slots[index];
+    write_begin(slot.seq);
+    return slot;
+}
+
+void Writer::end(Slot &slot)
+{
+    write_end(slot.seq);
+}
+
+int Writer::add(const Slot &data)
+{
+    if (free_slots.empty())
+        return -1;
+
+    int index = free_slots.back();
+    free_slots.pop_back();
+
+    Slot &slot = begin(index);
+    uint32_t seq = slot.seq;
+    slot = data;
+    slot.seq = seq;
+    end(slot);
+    return index;
+}
+
+void Writer::set_state(int index, SlotState state)
+{
+    Slot &slot = begin(index);
+    slot.state = state;
+    end(slot);
+}
+
+void Writer::set_bytes(int index, uint64_t in, uint64_t out)
+{
+    Slot &slot = begin(index);
+    slot.bytes_in = in;
+    slot.bytes_out = out;
+    end(slot);
+}
+
+void Writer::remove(int index)
+{
+    Slot &slot = begin(index);
+    slot.state = free_slot;
+    slot.pid = 0;
+    end(slot);
+    free_slots.push_back(index);
+}
+
+// ------------------ Reader ------------------
+Reader::Reader(const std::string &path) :
+    size(0), map(nullptr), slots(nullptr), count(0)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw StatusError(strerr(path));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(Header))
+    {
+        close(fd);
+        throw StatusError(path + ": Not a status file");
+    }
+    size = static_cast<size_t>(st.st_size);
+
+    void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+        throw StatusError(strerr("mmap " + path));
+
+    const Header *h = static_cast<const Header*>(m);
+    const char *error = nullptr;
+
+    if (std::memcmp(h->magic, "NCSSTAT", 8) != 0)
+        error = ": Not a status file";
+    else
+    {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (h->version != version || h->slot_size != sizeof(Slot))
+            error = ": Unsupported status file version";
+    }
+
+    if (error)
+    {
+        munmap(m, size);
+        throw StatusError(path + error);
+    }
+
+    map = h;
+    slots = reinterpret_cast<const Slot*>(map + 1);
+
+    count = std::min<uint32_t>(map->slot_count, static_cast<uint32_t>((size - sizeof(Header)) / sizeof(Slot)));
+}
+
+Reader::~Reader()
+{
+    if (map)
+        munmap(const_cast<Header*>(map), size);
+}
+
+Header Reader::header() const
+{
+    return read_consistent(*map);
+}
+
+Slot Reader::slot(uint32_t index) const
+{
+    return read_consistent(slots[index]);
+}
+
+}
@@ -0,0 +1,180 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @file status.h
+ * @brief live server status in a shared memory file
+ *
+ * The server publishes its counters and a table of running handlers in an
+ * mmap()ed file, typically under /run. Readers map it too and never talk
+ * to the server. The header and every slot are guarded by their own
+ * seqlock: the writer makes the sequence odd, updates and makes it even
+ * again; readers copy and retry if the sequence was odd or changed. Neither
+ * side ever blocks or makes a system call.
+ */
+
+namespace Status {
+
+/**
+ * @brief The StatusError class
+ */
+class StatusError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+enum SlotState : uint8_t
+{
+    free_slot = 0,
+    running = 1,
+    draining = 2,   // handler exited, relay still flushing
+};
+
+struct Counters
+{
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t failed;
+    uint64_t rejected;
+    uint64_t shed;
+    uint32_t running;
+    uint32_t draining;
+    uint32_t queue_depth;
+    uint32_t queue_limit;
+    uint32_t unlisted;      // handlers that didn't get a slot
+    uint32_t circuit;       // CircuitBreaker::State
+};
+
+struct Header
+{
+    char magic[8];          // "NCSSTAT"
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t slot_count;
+    uint32_t seq;
+    int32_t server_pid;
+    uint32_t reserved;
+    uint64_t started_ns;    // CLOCK_REALTIME
+    Counters counters;
+    char service[128];      // the handler command line
+};
+
+struct Slot
+{
+    uint32_t seq;
+    uint8_t state;
+    uint8_t reserved;
+    uint16_t family;
+    int32_t pid;
+    int32_t cpu;            // that received the connection
+    uint16_t port;
+    uint8_t addr[16];
+    uint64_t started_ns;    // CLOCK_REALTIME
+    uint64_t bytes_in;      // only when relaying
+    uint64_t bytes_out;
+};
+
+static const uint32_t version = 1;
+
+class Writer
+{
+public:
+    /**
+     * @brief create the file, replacing an old one
+     * @throws StatusError
+     */
+    Writer(const std::string &path, uint32_t slots, const std::string &service);
+
+    /**
+     * Removes the file.
+     */
+    ~Writer();
+
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    // Publish the counters
+    void update(const Counters &counters);
+
+    /**
+     * @brief take a slot for a new handler
+     * @return the slot index or -1 if the table is full
+     */
+    int add(const Slot &slot);
+
+    void set_state(int index, SlotState state);
+    void set_bytes(int index, uint64_t in, uint64_t out);
+    void remove(int index);
+
+private:
+    std::string file;
+    size_t size;
+    Header *header;
+    Slot *slots;
+    std::vector<int> free_slots;
+
+    Slot &begin(int index);
+    void end(Slot &slot);
+};
+
+class Reader
+{
+public:
+    /**
+     * @throws StatusError
+     */
+    explicit Reader(const std::string &path);
+    ~Reader();
+
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    /**
+     * @brief a consistent copy of the header
+     */
+    Header header() const;
+
+    uint32_t slot_count() const { return count; }
+
+    /**
+     * @brief a consistent copy of a slot
+     */
+    Slot slot(uint32_t index) const;
+
+private:
+    size_t size;
+    const Header *map;
+    const Slot *slots;
+    uint32_t count;
+};
+
+}
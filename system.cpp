@@ -0,0 +1,96 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "system.h"
+
+static System kernel;
+
+System *System::installed = &kernel;
+
+System::~System()
+{
+}
+
+void System::install(System *sys)
+{
+    installed = sys ? sys : &kernel;
+}
+
+int System::listen(int fd, int backlog)
+{
+    return ::listen(fd, backlog);
+}
+
+int System::accept(int fd, sockaddr *addr, socklen_t *size, int flags)
+{
+    return ::accept4(fd, addr, size, flags);
+}
+
+int System::close(int fd)
+{
+    return ::close(fd);
+}
+
+pid_t System::spawn(int)
+{
+    return ::fork();
+}
+
+pid_t System::waitpid(pid_t pid, int *status, int options)
+{
+    return ::waitpid(pid, status, options);
+}
+
+int System::kill(pid_t pid, int signo)
+{
+    return ::kill(pid, signo);
+}
+
+int System::clock_gettime(clockid_t clock, timespec *ts)
+{
+    return ::clock_gettime(clock, ts);
+}
+
+int System::signalfd(int fd, const sigset_t *mask, int flags)
+{
+    return ::signalfd(fd, mask, flags);
+}
+
+int System::epoll_ctl(int epfd, int op, int fd, epoll_event *event)
+{
+    return ::epoll_ctl(epfd, op, fd, event);
+}
+
+int System::epoll_wait(int epfd, epoll_event *events, int max_events, int timeout_ms)
+{
+    return ::epoll_wait(epfd, events, max_events, timeout_ms);
+}
+
+ssize_t System::read(int fd, void *buf, size_t size)
+{
+    return ::read(fd, buf, size);
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <signal.h>
+
+#include <ctime>
+
+/**
+ * @file system.h
+ * @brief the kernel as seen by the accept/spawn/reap core
+ *
+ * The reactor, main() and Client make the calls that decide what happens
+ * to connections through System::current(): listening, accepting, spawning,
+ * reaping and signalling handlers, closing sockets, waiting for events and
+ * reading the clock. The base class passes them straight to the kernel.
+ * ncs-sim installs a simulated kernel with a virtual clock instead, so
+ * the same loop can be run against a recorded trace.
+ */
+
+class System
+{
+public:
+    virtual ~System();
+
+    virtual int listen(int fd, int backlog);
+    virtual int accept(int fd, sockaddr *addr, socklen_t *size, int flags);
+    virtual int close(int fd);
+
+    /**
+     * @brief fork() a handler
+     * @param fd the connection it's for, -1 if none
+     */
+    virtual pid_t spawn(int fd);
+    virtual pid_t waitpid(pid_t pid, int *status, int options);
+    virtual int kill(pid_t pid, int signo);
+
+    virtual int clock_gettime(clockid_t clock, timespec *ts);
+
+    virtual int signalfd(int fd, const sigset_t *mask, int flags);
+    virtual int epoll_ctl(int epfd, int op, int fd, epoll_event *event);
+    virtual int epoll_wait(int epfd, epoll_event *events, int max_events, int timeout_ms);
+    virtual ssize_t read(int fd, void *buf, size_t size);
+
+    static System &current() { return *installed; }
+
+    /**
+     * @brief route the core's calls elsewhere
+     * @param sys stays owned by the caller; nullptr for the kernel again
+     */
+    static void install(System *sys);
+
+private:
+    static System *installed;
+};
@@ -0,0 +1,86 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "tcpinfo.h"
+
+bool tcp_stats(int fd, TcpStats &st)
+{
+    tcp_info info;
+    socklen_t size = sizeof(info);
+
+    // Older kernels fill in less; the rest stays zero
+    std::memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) < 0)
+        return false;
+
+    st.state = info.tcpi_state;
+    st.unacked = info.tcpi_unacked;
+    st.sacked = info.tcpi_sacked;
+    st.last_data_sent_ms = info.tcpi_last_data_sent;
+    st.last_data_recv_ms = info.tcpi_last_data_recv;
+    st.bytes_acked = info.tcpi_bytes_acked;
+    st.bytes_received = info.tcpi_bytes_received;
+    return true;
+}
+
+bool listen_drops(uint64_t &overflows, uint64_t &drops)
+{
+    std::ifstream f("/proc/net/netstat");
+    std::string names, values;
+
+    // Pairs of lines: "TcpExt: <names...>" and "TcpExt: <values...>"
+    while (std::getline(f, names) && std::getline(f, values))
+    {
+        if (names.compare(0, 7, "TcpExt:") != 0)
+            continue;
+
+        std::istringstream n(names), v(values);
+        std::string name;
+        uint64_t value;
+        bool found = false;
+
+        n >> name;
+        v >> name;
+        while (n >> name && v >> value)
+        {
+            if (name == "ListenOverflows")
+            {
+                overflows = value;
+                found = true;
+            }
+            else if (name == "ListenDrops")
+                drops = value;
+        }
+        return found;
+    }
+    return false;
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @file tcpinfo.h
+ * @brief TCP_INFO access
+ * glibc's struct tcp_info lags behind the kernel's and <linux/tcp.h>
+ * cannot be included alongside <netinet/tcp.h>, so the fields we
+ * care about are copied out here.
+ */
+
+struct TcpStats
+{
+    uint8_t state;
+    uint32_t unacked;               // listening: current accept queue length
+    uint32_t sacked;                // listening: accept queue limit
+    uint32_t last_data_sent_ms;
+    uint32_t last_data_recv_ms;
+    uint64_t bytes_acked;           // 0 on kernels before 4.1
+    uint64_t bytes_received;        // 0 on kernels before 4.1
+};
+
+/**
+ * @brief query TCP_INFO on a socket
+ * @param fd the socket
+ * @param st receives the statistics
+ * @return false if fd is not a TCP socket
+ */
+bool tcp_stats(int fd, TcpStats &st);
+
+/**
+ * @brief the system wide ListenOverflows and ListenDrops counters
+ * Connections the kernel dropped because an accept queue was full.
+ * @return false if /proc/net/netstat can't be read
+ */
+bool listen_drops(uint64_t &overflows, uint64_t &drops);
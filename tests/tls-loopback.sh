@@ -0,0 +1,111 @@
+#!/bin/sh
+# Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# tls-loopback: TLS termination against a self-signed certificate.
+#
+# Runs a short and a large echo through the server over loopback, once with
+# kernel TLS and once with --no-ktls relaying in userspace, and checks that
+# the log names the path that was taken. The kernel TLS run is skipped where
+# the tls ULP isn't available.
+#
+# Usage: tests/tls-loopback.sh [NetCatServer binary] [port]
+
+NCS=${1:-bin/Release/NetCatServer}
+PORT=${2:-17995}
+
+DIR=$(mktemp -d) || exit 1
+SERVER=
+cleanup()
+{
+    [ -n "$SERVER" ] && kill -INT "$SERVER" 2>/dev/null && wait "$SERVER"
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -keyout "$DIR/key.pem" -out "$DIR/cert.pem" 2>/dev/null || { echo "FAIL: openssl req"; exit 1; }
+
+# One line the handler copies back, so it doesn't wait for EOF: under kernel
+# TLS the client's close_notify makes the handler's read() fail instead
+BIG=262144
+head -c $((BIG / 4 * 3)) /dev/urandom | base64 -w 0 | head -c $BIG > "$DIR/big"
+
+failed=0
+
+# run <name> <expected path in the log> [server options...]
+run()
+{
+    name=$1
+    expect=$2
+    shift 2
+    bad=0
+
+    "$NCS" -b 127.0.0.1 -p "$PORT" -i -o --tls-cert "$DIR/cert.pem" --tls-key "$DIR/key.pem" "$@" \
+        "head -n 1" 2>"$DIR/log" &
+    SERVER=$!
+
+    tries=50
+    until grep -q "Bound to" "$DIR/log" 2>/dev/null; do
+        tries=$((tries - 1))
+        if [ $tries = 0 ] || ! kill -0 $SERVER 2>/dev/null; then
+            echo "FAIL $name: server didn't start"; cat "$DIR/log"
+            failed=1; SERVER=; return
+        fi
+        sleep 0.1
+    done
+
+    for size in 6 $BIG; do
+        { head -c $size "$DIR/big"; echo; } > "$DIR/in"
+        # -ign_eof keeps reading until the handler is done, or gives up after 10s
+        timeout 10 openssl s_client -connect 127.0.0.1:"$PORT" -quiet -ign_eof \
+            -ciphersuites TLS_AES_128_GCM_SHA256 < "$DIR/in" > "$DIR/out" 2>/dev/null
+        if ! cmp -s "$DIR/in" "$DIR/out"; then
+            echo "FAIL $name: sent $(wc -c < "$DIR/in") bytes, got $(wc -c < "$DIR/out") back"
+            bad=1
+        fi
+    done
+
+    kill -INT $SERVER; wait $SERVER; SERVER=
+
+    if ! grep -q "TLS: .*, $expect" "$DIR/log"; then
+        echo "FAIL $name: expected $expect"; grep "TLS" "$DIR/log"
+        bad=1
+    fi
+
+    if [ $bad = 0 ]; then
+        echo "ok $name"
+    else
+        failed=1
+    fi
+}
+
+modprobe tls 2>/dev/null
+if grep -qw tls /proc/sys/net/ipv4/tcp_available_ulp 2>/dev/null; then
+    run ktls "kernel TLS"
+else
+    echo "skip ktls: no tls ULP"
+fi
+run userspace userspace --no-ktls
+
+exit $failed
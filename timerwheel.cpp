@@ -0,0 +1,209 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+
+#include "timerwheel.h"
+
+// ------------------ TimerNode ------------------
+void TimerNode::unlink()
+{
+    prev->next = next;
+    next->prev = prev;
+    prev = next = this;
+}
+
+void TimerNode::link_before(TimerNode &pos)
+{
+    prev = pos.prev;
+    next = &pos;
+    pos.prev->next = this;
+    pos.prev = this;
+}
+
+// ------------------ Timer ------------------
+void Timer::cancel()
+{
+    if (wheel && armed())
+        wheel->cancel(*this);
+}
+
+// ------------------ TimerWheel ------------------
+TimerWheel::TimerWheel(unsigned wheel_tick_ms) :
+    tick_ms(wheel_tick_ms), started(false), current(0), cascaded(UINT64_MAX), count(0)
+{
+    for (unsigned l = 0; l < levels; ++l)
+        occupied[l] = 0;
+}
+
+void TimerWheel::arm(Timer &timer, uint64_t now_ms, uint64_t delay_ms)
+{
+    if (timer.armed())
+        cancel(timer);
+
+    if (!started)
+    {
+        current = now_ms / tick_ms;
+        started = true;
+    }
+
+    timer.wheel = this;
+    timer.expires = (now_ms + delay_ms + tick_ms - 1) / tick_ms;
+    insert(timer);
+    ++count;
+}
+
+void TimerWheel::cancel(Timer &timer)
+{
+    timer.unlink();
+    --count;
+
+    if (!wheel[timer.level][timer.slot].linked())
+        occupied[timer.level] &= ~(uint64_t(1) << timer.slot);
+}
+
+void TimerWheel::insert(Timer &timer)
+{
+    if (timer.expires < current)
+        timer.expires = current;
+
+    uint64_t delta = timer.expires - current;
+    unsigned level = 0;
+    while (level < levels - 1 && delta >= (uint64_t(1) << (bits * (level + 1))))
+        ++level;
+
+    // Beyond the top level: clamp to the furthest reachable slot
+    if (delta >= (uint64_t(1) << (bits * levels)))
+        timer.expires = current + (uint64_t(1) << (bits * levels)) - 1;
+
+    unsigned slot = static_cast<unsigned>((timer.expires >> (bits * level)) & mask);
+    timer.level = static_cast<uint8_t>(level);
+    timer.slot = static_cast<uint8_t>(slot);
+    timer.link_before(wheel[level][slot]);
+    occupied[level] |= uint64_t(1) << slot;
+}
+
+void TimerWheel::cascade(unsigned level, unsigned slot)
+{
+    TimerNode &head = wheel[level][slot];
+    occupied[level] &= ~(uint64_t(1) << slot);
+
+    while (head.linked())
+    {
+        Timer &timer = static_cast<Timer&>(*head.next);
+        timer.unlink();
+        insert(timer);
+    }
+}
+
+void TimerWheel::advance(uint64_t now_ms)
+{
+    uint64_t now = now_ms / tick_ms;
+
+    if (count == 0 || !started)
+    {
+        current = now + 1;
+        started = true;
+        return;
+    }
+
+    while (current <= now)
+    {
+        unsigned idx = static_cast<unsigned>(current & mask);
+
+        // Pull the next round down from the higher levels
+        if (idx == 0 && cascaded != current)
+        {
+            cascaded = current;
+            for (unsigned l = 1; l < levels; ++l)
+            {
+                unsigned slot = static_cast<unsigned>((current >> (bits * l)) & mask);
+                cascade(l, slot);
+                if (slot != 0)
+                    break;
+            }
+        }
+
+        // Skip ahead to the next occupied slot or the next cascade
+        uint64_t pending = occupied[0] >> idx;
+        if (pending == 0)
+        {
+            // Never past now: timers armed before the next advance()
+            // are relative to the real time
+            current = std::min((current | mask) + 1, now + 1);
+            continue;
+        }
+        unsigned skip = __builtin_ctzll(pending);
+        if (current + skip > now)
+            break;
+        current += skip;
+        idx += skip;
+
+        // Detach the slot first: callbacks may arm and cancel timers
+        TimerNode due;
+        TimerNode &head = wheel[0][idx];
+        occupied[0] &= ~(uint64_t(1) << idx);
+        if (head.linked())
+        {
+            due.next = head.next;
+            due.prev = head.prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            head.next = head.prev = &head;
+        }
+
+        ++current;
+
+        while (due.linked())
+        {
+            Timer &timer = static_cast<Timer&>(*due.next);
+            timer.unlink();
+            --count;
+            if (timer.callback)
+                timer.callback();
+        }
+    }
+}
+
+int TimerWheel::next_timeout(uint64_t now_ms) const
+{
+    if (count == 0)
+        return -1;
+
+    unsigned idx = static_cast<unsigned>(current & mask);
+    uint64_t pending = occupied[0] >> idx;
+
+    // A cascade into the current round is still outstanding
+    uint64_t next;
+    if (idx == 0 && cascaded != current)
+        next = current;
+    else if (pending)
+        next = current + __builtin_ctzll(pending);
+    else
+        next = (current | mask) + 1;
+
+    uint64_t next_ms = next * tick_ms;
+    if (next_ms <= now_ms)
+        return 0;
+    return static_cast<int>(next_ms - now_ms);
+}
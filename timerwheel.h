@@ -0,0 +1,124 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+/**
+ * @file timerwheel.h
+ * @brief hierarchical timing wheel
+ *
+ * Four levels of 64 slots each. Timers are intrusive list nodes, so arming
+ * and cancelling are O(1) regardless of how many are live; a timer is only
+ * touched again when its slot on a higher level cascades down, at most
+ * three times over its lifetime. With 10ms ticks the wheel spans ~46 hours;
+ * longer delays are clamped.
+ */
+
+class TimerWheel;
+
+struct TimerNode
+{
+    TimerNode *prev;
+    TimerNode *next;
+
+    TimerNode() : prev(this), next(this) {}
+
+    bool linked() const { return next != this; }
+    void unlink();
+    void link_before(TimerNode &pos);
+};
+
+class Timer : private TimerNode
+{
+    friend class TimerWheel;
+
+    TimerWheel *wheel;
+    uint64_t expires;   // in ticks
+    uint8_t level;
+    uint8_t slot;
+
+public:
+    std::function<void()> callback;
+
+    Timer() : wheel(nullptr), expires(0), level(0), slot(0) {}
+    explicit Timer(std::function<void()> fn) : wheel(nullptr), expires(0), level(0), slot(0), callback(std::move(fn)) {}
+    ~Timer() { cancel(); }
+
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+    bool armed() const { return linked(); }
+    void cancel();
+};
+
+class TimerWheel
+{
+public:
+    explicit TimerWheel(unsigned tick_ms = 10);
+
+    /**
+     * @brief (re-)arm a timer
+     * @param timer the timer, cancelled first if armed
+     * @param now_ms the current time
+     * @param delay_ms time until the callback runs, rounded up to a tick
+     */
+    void arm(Timer &timer, uint64_t now_ms, uint64_t delay_ms);
+    void cancel(Timer &timer);
+
+    /**
+     * @brief run the callbacks of all timers due at now_ms
+     */
+    void advance(uint64_t now_ms);
+
+    /**
+     * @brief a timeout for the event loop
+     * @return ms until the wheel needs to advance again, -1 if empty
+     * This is the next expiry on the lowest level or, failing that,
+     * the next cascade.
+     */
+    int next_timeout(uint64_t now_ms) const;
+
+    size_t size() const { return count; }
+
+private:
+    static const unsigned levels = 4;
+    static const unsigned bits = 6;
+    static const unsigned slots = 1 << bits;
+    static const uint64_t mask = slots - 1;
+
+    unsigned tick_ms;
+    bool started;
+    uint64_t current;   // next tick to process
+    uint64_t cascaded;  // last tick the higher levels were cascaded at
+    size_t count;
+
+    TimerNode wheel[levels][slots];
+    uint64_t occupied[levels];
+
+    void insert(Timer &timer);
+    void cascade(unsigned level, unsigned slot);
+};
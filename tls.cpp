@@ -0,0 +1,362 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "metrics.h"
+#include "reactor.h"
+#include "tls.h"
+
+// One TLS record per read
+static const size_t record_size = 16384;
+
+const uint64_t TlsContext::bounds_us[Histogram::nbuckets] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000,
+};
+
+// The first queued OpenSSL error, or errno
+static std::string ssl_error(const std::string &what)
+{
+    unsigned long err = ERR_get_error();
+    ERR_clear_error();
+    if (!err)
+        return what + ": " + (errno ? std::strerror(errno) : "connection closed");
+
+    char buf[256];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    return what + ": " + buf;
+}
+
+static void close_fd(int &fd)
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
+TlsContext::TlsContext(const std::string &cert, const std::string &key, unsigned tickets, bool ktls) :
+    failures(0), ctx(SSL_CTX_new(TLS_server_method())), resumed(0), offloaded(0), handshakes(bounds_us, 1000000)
+{
+    if (!ctx)
+        throw TlsError(ssl_error("SSL_CTX_new"));
+
+    auto fail = [this](const std::string &what) {
+        std::string msg = ssl_error(what);
+        SSL_CTX_free(ctx);
+        throw TlsError(msg);
+    };
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()) != 1)
+        fail(cert);
+    if (SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1)
+        fail(key);
+    if (SSL_CTX_check_private_key(ctx) != 1)
+        fail(key);
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+    // Tickets are encrypted with a key made up per process; TLS 1.2
+    // clients without ticket support use the session cache
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>("ncs"), 3);
+    SSL_CTX_set_num_tickets(ctx, tickets);
+    if (!tickets)
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+}
+
+TlsContext::~TlsContext()
+{
+    SSL_CTX_free(ctx);
+}
+
+void TlsContext::record_handshake(uint64_t us, bool was_resumed, bool was_offloaded)
+{
+    handshakes.record(us);
+    if (was_resumed)
+        ++resumed;
+    if (was_offloaded)
+        ++offloaded;
+}
+
+void TlsContext::collect(std::ostream &os) const
+{
+    Metrics::sample(os, "ncs_tls_handshakes_total", "counter", "Completed TLS handshakes", handshakes.count());
+    Metrics::sample(os, "ncs_tls_handshake_failures_total", "counter", "Failed or timed out TLS handshakes", failures);
+    Metrics::sample(os, "ncs_tls_resumed_total", "counter", "TLS handshakes that resumed a session", resumed);
+    Metrics::sample(os, "ncs_tls_offloaded_total", "counter", "TLS connections handed to kernel TLS", offloaded);
+
+    handshakes.collect(os, "ncs_tls_handshake_seconds", "Time from accepting to completing the TLS handshake");
+}
+
+// -------------------------------------------------------------------
+TlsSession::TlsSession(Reactor &session_reactor, int session_sock, TlsContext &session_context) :
+    bytes_in(0), bytes_out(0), reactor(session_reactor), sock(session_sock), context(session_context), ssl(nullptr),
+    started(), ktls(false), in_done(false), out_done(false), notified(false), handshaking(false), relaying(false)
+{
+    plain[0] = plain[1] = -1;
+}
+
+TlsSession::~TlsSession()
+{
+    if (handshaking || relaying)
+        reactor.remove(sock);
+    if (relaying)
+        reactor.remove(plain[0]);
+
+    close_fd(plain[0]);
+    close_fd(plain[1]);
+
+    // Doesn't close the socket
+    SSL_free(ssl);
+}
+
+bool TlsSession::handshake()
+{
+    ssl = SSL_new(context.get());
+    if (!ssl || SSL_set_fd(ssl, sock) != 1)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+    SSL_set_accept_state(ssl);
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    // The client speaks first
+    reactor.add(sock, EPOLLIN, [this](uint32_t) {
+        this->step();
+    });
+    handshaking = true;
+    return true;
+}
+
+void TlsSession::step()
+{
+    ERR_clear_error();
+    errno = 0;
+    int r = SSL_do_handshake(ssl);
+    if (r != 1)
+    {
+        int err = SSL_get_error(ssl, r);
+        if (err == SSL_ERROR_WANT_READ)
+            reactor.modify(sock, EPOLLIN);
+        else if (err == SSL_ERROR_WANT_WRITE)
+            reactor.modify(sock, EPOLLOUT);
+        else
+            fail("handshake");
+        return;
+    }
+
+    reactor.remove(sock);
+    handshaking = false;
+
+    // The handler expects a blocking socket
+    ktls = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    if (ktls)
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t us = (now.tv_sec - started.tv_sec) * 1000000ull + now.tv_nsec / 1000 - started.tv_nsec / 1000;
+    context.record_handshake(us, SSL_session_reused(ssl), ktls);
+
+    if (on_handshake)
+        on_handshake(true);
+}
+
+void TlsSession::fail(const char *what)
+{
+    reactor.remove(sock);
+    handshaking = false;
+    failure = ssl_error(what);
+    ++context.failures;
+
+    if (on_handshake)
+        on_handshake(false);
+}
+
+std::string TlsSession::describe() const
+{
+    std::string desc = std::string(SSL_get_version(ssl)) + " " + SSL_get_cipher_name(ssl);
+    if (SSL_session_reused(ssl))
+        desc += ", resumed";
+    return desc;
+}
+
+bool TlsSession::open()
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, plain) < 0)
+        return false;
+    // The handler's end must stay blocking
+    fcntl(plain[0], F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+void TlsSession::start(bool close_child_end)
+{
+    if (close_child_end)
+        close_fd(plain[1]);
+
+    // Edge triggered, as in Relay: both directions run until they block
+    // on any change. Adding reports the current state, which also picks
+    // up data OpenSSL buffered during the handshake.
+    auto pump = [this](uint32_t) {
+        this->pump_in();
+        this->pump_out();
+        this->notify();
+    };
+    reactor.add(plain[0], EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, pump);
+    reactor.add(sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, pump);
+    relaying = true;
+}
+
+void TlsSession::pump_in()
+{
+    char buf[record_size];
+
+    while (!in_done)
+    {
+        // Get rid of the last record before decrypting more
+        if (!to_child.empty())
+        {
+            ssize_t n = send(plain[0], to_child.data(), to_child.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0)
+            {
+                bytes_in += n;
+                to_child.erase(0, n);
+            }
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (n < 0 && errno == EAGAIN)
+                break;
+            else
+                // The handler closed its end
+                finish_in();
+            continue;
+        }
+
+        ERR_clear_error();
+        int n = SSL_read(ssl, buf, sizeof(buf));
+        if (n > 0)
+        {
+            to_child.assign(buf, n);
+            continue;
+        }
+
+        int err = SSL_get_error(ssl, n);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            break;
+
+        // close_notify, EOF or a broken record
+        finish_in();
+    }
+}
+
+void TlsSession::pump_out()
+{
+    char buf[record_size];
+
+    while (!out_done)
+    {
+        if (!to_peer.empty())
+        {
+            ERR_clear_error();
+            int n = SSL_write(ssl, to_peer.data(), to_peer.size());
+            if (n > 0)
+            {
+                bytes_out += n;
+                to_peer.erase(0, n);
+                continue;
+            }
+
+            int err = SSL_get_error(ssl, n);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                break;
+
+            // The peer went away; so does anything the handler still writes
+            shutdown(plain[0], SHUT_RD);
+            finish_out();
+            continue;
+        }
+
+        ssize_t n = read(plain[0], buf, sizeof(buf));
+        if (n > 0)
+            to_peer.assign(buf, n);
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && errno == EAGAIN)
+            break;
+        else
+        {
+            // The handler closed its end: say goodbye properly
+            ERR_clear_error();
+            SSL_shutdown(ssl);
+            finish_out();
+        }
+    }
+}
+
+void TlsSession::finish_in()
+{
+    in_done = true;
+    to_child.clear();
+    shutdown(plain[0], SHUT_WR);
+}
+
+void TlsSession::finish_out()
+{
+    out_done = true;
+    to_peer.clear();
+    shutdown(sock, SHUT_WR);
+}
+
+void TlsSession::notify()
+{
+    if (!done() || notified)
+        return;
+
+    reactor.remove(sock);
+    reactor.remove(plain[0]);
+    close_fd(plain[0]);
+    relaying = false;
+    notified = true;
+
+    if (on_done)
+        on_done();
+}
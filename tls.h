@@ -0,0 +1,189 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+#include "metrics.h"
+
+/**
+ * @file tls.h
+ * @brief TLS termination with kernel TLS offload
+ *
+ * The server does the handshake itself, without blocking the event loop.
+ * If OpenSSL manages to install kernel TLS for both directions the socket
+ * is then handed to the handler as usual and the kernel en- and decrypts,
+ * so handlers read and write plaintext without a proxy in between. Where
+ * the kernel or the cipher doesn't allow that, the handler gets one end
+ * of a socket pair instead and the server relays through OpenSSL.
+ *
+ * With kernel TLS receive, records other than application data reach the
+ * handler's read() as an error: the peer's close_notify, or a TLS 1.3
+ * KeyUpdate, makes it fail with EIO instead of returning 0 at the end of
+ * the stream. Handlers that rely on seeing EOF need --no-ktls.
+ */
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+class Reactor;
+
+/**
+ * @brief The TlsError class
+ */
+class TlsError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+// Certificates, session tickets and the statistics of all handshakes
+class TlsContext
+{
+public:
+    /**
+     * @param cert PEM certificate chain
+     * @param key PEM private key
+     * @param tickets session tickets sent per TLS 1.3 handshake, 0 disables them
+     * @param ktls try to offload to the kernel
+     */
+    TlsContext(const std::string &cert, const std::string &key, unsigned tickets, bool ktls);
+    ~TlsContext();
+
+    TlsContext(const TlsContext &) = delete;
+    TlsContext &operator=(const TlsContext &) = delete;
+
+    ssl_ctx_st *get() const { return ctx; }
+
+    void record_handshake(uint64_t us, bool resumed, bool offloaded);
+    void collect(std::ostream &os) const;
+
+    uint64_t failures;
+
+private:
+    ssl_ctx_st *ctx;
+
+    static const uint64_t bounds_us[Histogram::nbuckets];
+
+    uint64_t resumed;
+    uint64_t offloaded;
+    Histogram handshakes;               // in µs
+};
+
+// One connection: the handshake, then possibly relaying in userspace
+class TlsSession
+{
+public:
+    /**
+     * @param reactor the event loop to handshake and relay from
+     * @param sock the connected socket. It stays owned by the caller.
+     * @param context certificates and statistics
+     */
+    TlsSession(Reactor &reactor, int sock, TlsContext &context);
+    ~TlsSession();
+
+    TlsSession(const TlsSession &) = delete;
+    TlsSession &operator=(const TlsSession &) = delete;
+
+    /**
+     * @brief start the handshake
+     * @return false on failure, with errno set
+     */
+    bool handshake();
+
+    /**
+     * @brief called once the handshake succeeded or failed
+     * The session may be destroyed from within the callback.
+     */
+    std::function<void(bool ok)> on_handshake;
+
+    /**
+     * @brief the kernel took over both directions
+     * The socket is plaintext now and the session can go.
+     */
+    bool offloaded() const { return ktls; }
+
+    // e.g. "TLSv1.3 TLS_AES_256_GCM_SHA384, resumed"; after the handshake
+    std::string describe() const;
+
+    // Why the handshake failed
+    std::string error() const { return failure; }
+
+    /**
+     * @brief create the socket pair for relaying
+     * @return false on failure, with errno set
+     */
+    bool open();
+
+    // The handler's end of the socket pair
+    int child_fd() const { return plain[1]; }
+
+    /**
+     * @brief start relaying
+     * Call in the parent after fork().
+     * @param close_child_end false if the server relays the handler's end itself
+     */
+    void start(bool close_child_end);
+
+    bool done() const { return in_done && out_done; }
+
+    /**
+     * @brief called once both directions are finished
+     * The session may be destroyed from within the callback.
+     */
+    std::function<void()> on_done;
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+private:
+    Reactor &reactor;
+    int sock;
+    TlsContext &context;
+    ssl_st *ssl;
+    timespec started;
+    bool ktls;
+    std::string failure;
+
+    int plain[2];           // ours, the handler's
+    bool in_done;           // peer -> handler
+    bool out_done;          // handler -> peer
+    bool notified;
+    bool handshaking;       // the socket is watched for the handshake
+    bool relaying;          // the socket and our end are watched for relaying
+    std::string to_child;   // decrypted, not yet written to the handler
+    std::string to_peer;    // from the handler, not yet taken by SSL_write
+
+    void step();
+    void fail(const char *what);
+    void pump_in();
+    void pump_out();
+    void finish_in();
+    void finish_out();
+    void notify();
+};
@@ -0,0 +1,159 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+
+#include "trace.h"
+
+namespace Trace {
+
+static const char magic[8] = {'N', 'C', 'S', 'T', 'R', 'A', 'C', 'E'};
+
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+static const size_t buffer_records = 128;
+
+static std::string errstr(const std::string &what)
+{
+    return what + ": " + std::strerror(errno);
+}
+
+// ------------------ Writer ------------------
+Writer::Writer(const std::string &path) :
+    last_flush(std::time(NULL))
+{
+    fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw TraceError(errstr(path));
+
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size == 0)
+    {
+        Header hdr;
+        std::memcpy(hdr.magic, magic, sizeof(magic));
+        hdr.version = 1;
+        hdr.record_size = sizeof(Record);
+        if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+            throw TraceError(errstr(path));
+    }
+
+    buffer.reserve(buffer_records);
+}
+
+Writer::~Writer()
+{
+    flush();
+    close(fd);
+}
+
+void Writer::append(const Record &record)
+{
+    buffer.push_back(record);
+
+    if (buffer.size() >= buffer_records || std::time(NULL) != last_flush)
+        flush();
+}
+
+void Writer::flush()
+{
+    last_flush = std::time(NULL);
+
+    if (buffer.empty())
+        return;
+
+    // Short writes would misalign every following record
+    const char *data = reinterpret_cast<const char*>(buffer.data());
+    size_t size = buffer.size() * sizeof(Record);
+    while (size > 0)
+    {
+        ssize_t n = write(fd, data, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        data += n;
+        size -= n;
+    }
+    buffer.clear();
+}
+
+// ------------------ Reader ------------------
+Reader::Reader(const std::string &path) :
+    pos(0)
+{
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw TraceError(errstr(path));
+
+    Header hdr;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || std::memcmp(hdr.magic, magic, sizeof(magic)))
+    {
+        close(fd);
+        throw TraceError(path + ": Not a NetCatServer trace");
+    }
+    if (hdr.version != 1 || hdr.record_size != sizeof(Record))
+    {
+        close(fd);
+        throw TraceError(path + ": Unsupported trace version");
+    }
+}
+
+Reader::~Reader()
+{
+    close(fd);
+}
+
+bool Reader::next(Record &record)
+{
+    if (pos == buffer.size())
+    {
+        buffer.resize(buffer_records);
+        ssize_t n = read(fd, buffer.data(), buffer.size() * sizeof(Record));
+        if (n <= 0)
+            return false;
+        // A trailing partial record is dropped
+        buffer.resize(n / sizeof(Record));
+        pos = 0;
+        if (buffer.empty())
+            return false;
+    }
+
+    record = buffer[pos++];
+    return true;
+}
+
+}
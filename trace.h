@@ -0,0 +1,115 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <ctime>
+
+/**
+ * @file trace.h
+ * @brief compact binary trace of connection events
+ *
+ * A trace file is a 16 byte header followed by fixed-size records in host
+ * byte order. Records are written when a connection's handler is reaped,
+ * so they appear in order of termination rather than arrival.
+ */
+
+namespace Trace {
+
+struct Record
+{
+    uint64_t accepted_ns;   /**< CLOCK_REALTIME at accept() */
+    uint64_t duration_ns;   /**< accept() to reap */
+    uint64_t bytes_in;      /**< peer -> server */
+    uint64_t bytes_out;     /**< server -> peer, acknowledged */
+    int32_t status;         /**< wait() status of the handler */
+    uint16_t family;
+    uint16_t port;          /**< peer port, host byte order */
+    uint8_t addr[16];       /**< peer address, network byte order */
+};
+
+static_assert(sizeof(Record) == 56, "Trace::Record must stay packed");
+
+/**
+ * @brief The TraceError class
+ */
+class TraceError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+/**
+ * @brief buffered trace file writer
+ * Records are kept in memory and written out when the buffer fills up,
+ * with the first record of a new second, or on flush(). The writer has
+ * no timer of its own; a quiet owner has to flush() to get the rest out.
+ */
+class Writer
+{
+    int fd;
+    std::vector<Record> buffer;
+    std::time_t last_flush;
+
+public:
+    /**
+     * @brief open a trace for appending, creating it if neccessary
+     * @param path the trace file
+     * @throws TraceError
+     */
+    explicit Writer(const std::string &path);
+    ~Writer();
+
+    void append(const Record &record);
+    void flush();
+};
+
+/**
+ * @brief sequential trace file reader
+ */
+class Reader
+{
+    int fd;
+    std::vector<Record> buffer;
+    size_t pos;
+
+public:
+    /**
+     * @brief open a trace for reading
+     * @param path the trace file
+     * @throws TraceError
+     */
+    explicit Reader(const std::string &path);
+    ~Reader();
+
+    /**
+     * @brief read the next record
+     * @return false at the end of the trace
+     */
+    bool next(Record &record);
+};
+
+}
@@ -0,0 +1,450 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+
+#include "probes.h"
+#include "zygote.h"
+
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+
+using std::cerr;
+using std::endl;
+
+static_assert(std::is_trivially_copyable<ChildSched>::value, "ChildSched is sent as is");
+
+// A request is this, then argc and envc NUL terminated strings; the fds
+// travel alongside as SCM_RIGHTS
+struct Header
+{
+    uint32_t argc;
+    uint32_t envc;
+    int32_t stdio[3];       // index into the passed fds, -1 to inherit
+    uint32_t pin;
+    cpu_set_t cpus;
+    ChildSched sched;
+    sigset_t sigmask;
+};
+
+// -------------------------------------------------------------------
+// Zygote side, everything here runs in a copy of the server as it was
+// at startup. No atexit handlers or destructors of the server must run.
+
+// A spare: wait for a request, then become the handler
+static void __attribute__((noreturn)) spare_main(int sock, int done)
+{
+    // Only one spare reads at a time, so the peeked size is the one received
+    char probe;
+    ssize_t size;
+    while ((size = recv(sock, &probe, 1, MSG_PEEK | MSG_TRUNC)) < 0 && errno == EINTR);
+    if (size <= 0)
+    {
+        // The server is gone, so should be the zygote
+        if (write(done, "q", 1) < 0) {}
+        _exit(0);
+    }
+
+    std::vector<char> buf(static_cast<size_t>(size));
+    union {
+        cmsghdr align;
+        char data[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    iovec iov = {buf.data(), buf.size()};
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+    // Let the zygote clone the next spare while this one execs
+    close(done);
+
+    if (n != size || static_cast<size_t>(n) < sizeof(Header) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+        _exit(127);
+
+    int fds[3] = {-1, -1, -1};
+    size_t nfds = 0;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        {
+            nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            std::memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+        }
+
+    Header hdr;
+    std::memcpy(&hdr, buf.data(), sizeof(hdr));
+
+    std::vector<char*> strings;
+    for (size_t i = sizeof(hdr); i < buf.size(); i += std::strlen(&buf[i]) + 1)
+        strings.push_back(&buf[i]);
+    if (buf.back() != '\0' || strings.size() != size_t(hdr.argc) + hdr.envc || !hdr.argc)
+        _exit(127);
+    std::vector<char*> argv(strings.begin(), strings.begin() + hdr.argc);
+    std::vector<char*> envp(strings.begin() + hdr.argc, strings.end());
+    argv.push_back(nullptr);
+    envp.push_back(nullptr);
+
+    // Everything else is set up like Client::run() does it
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &hdr.sigmask, NULL);
+
+    if (hdr.pin)
+        sched_setaffinity(0, sizeof(hdr.cpus), &hdr.cpus);
+
+    if (!hdr.sched.apply())
+    {
+        cerr << "\033[31mError: ";
+        perror("scheduling");
+        cerr << "\033[0m";
+    }
+
+    cerr << "\033[36m[\033[35m" << getpid() << "\033[36m] Calling: \033[35m";
+    cerr << argv[0];
+    for (size_t i=1; i<argv.size()-1; ++i)
+        cerr << " " << argv[i];
+    cerr << "\033[0m" << endl;
+
+    dup2(2, 200);
+    fcntl(200, F_SETFD, FD_CLOEXEC);
+
+    for (int i = 0; i < 3; ++i)
+        if (hdr.stdio[i] >= 0 && static_cast<size_t>(hdr.stdio[i]) < nfds)
+            dup2(fds[hdr.stdio[i]], i);
+
+    NCS_PROBE2(exec, getpid(), argv[0]);
+    execvpe(argv[0], argv.data(), envp.data());
+
+    // restore stderr
+    dup2(200, 2);
+
+    cerr << "\033[31mError: ";
+    perror("exec");
+    cerr << "\033[0m";
+
+    _exit(1);
+}
+
+// Close everything but stdio and keep; whatever the server had open when
+// the zygote was forked, systemd's sockets included, may lack O_CLOEXEC
+// and would end up in every handler
+static void close_other_fds(int keep)
+{
+    if ((keep == 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0) &&
+        syscall(SYS_close_range, keep + 1, ~0U, 0) == 0)
+        return;
+
+    // Before Linux 5.9
+    std::vector<int> fds;
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir)
+        return;
+    while (dirent *entry = readdir(dir))
+    {
+        int fd = std::atoi(entry->d_name);
+        if (fd > 2 && fd != keep && fd != dirfd(dir))
+            fds.push_back(fd);
+    }
+    closedir(dir);
+    for (int fd : fds)
+        close(fd);
+}
+
+// A zygote: keep one spare ready until the server goes away
+static void __attribute__((noreturn)) zygote_main(int sock)
+{
+    close_other_fds(sock);
+
+    // The server shuts us down by closing the socket
+    signal(SIGINT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;)
+    {
+        int done[2];
+        if (pipe2(done, O_CLOEXEC) < 0)
+            _exit(1);
+
+        // A child of the server rather than of the zygote, so the server
+        // gets its SIGCHLD and reaps it
+        long pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+        if (pid == 0)
+        {
+            close(done[0]);
+            spare_main(sock, done[1]);
+        }
+        close(done[1]);
+
+        if (pid < 0)
+        {
+            // Out of processes for now; the server forks itself meanwhile
+            close(done[0]);
+            timespec pause = {0, 10000000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        pid_t spare = static_cast<pid_t>(pid);
+        if (send(sock, &spare, sizeof(spare), MSG_NOSIGNAL) < 0)
+            _exit(0);
+
+        // Until the spare has its request, or the server is gone
+        char c;
+        ssize_t n;
+        while ((n = read(done[0], &c, 1)) < 0 && errno == EINTR);
+        close(done[0]);
+        if (n != 0)
+            _exit(0);
+    }
+}
+
+// -------------------------------------------------------------------
+// Server side
+Zygote::Zygote(unsigned count) :
+    spawned(0), misses(0), failures(0), next(0), reserved(nullptr), alive(0)
+{
+    for (unsigned i = 0; i < count; ++i)
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        {
+            for (Process &p : processes)
+                close(p.sock);
+            throw ZygoteError(std::string("socketpair: ") + std::strerror(errno));
+        }
+
+        // Only its own socket stays open in there, or earlier zygotes
+        // would never see EOF
+        pid_t pid = ::fork();
+        if (pid == 0)
+            zygote_main(sv[1]);
+        close(sv[1]);
+
+        if (pid < 0)
+        {
+            close(sv[0]);
+            for (Process &p : processes)
+                close(p.sock);
+            throw ZygoteError(std::string("fork: ") + std::strerror(errno));
+        }
+
+        processes.push_back({pid, sv[0], 0});
+        ++alive;
+    }
+}
+
+Zygote::~Zygote()
+{
+    for (Process &p : processes)
+        if (p.sock >= 0)
+            close(p.sock);
+}
+
+void Zygote::lost(Process &p)
+{
+    cerr << "\033[31mZygote [\033[35m" << p.pid << "\033[31m] is gone\033[0m" << endl;
+
+    // Its last spare exits too; know it when it's reaped
+    pid_t spare;
+    if (!p.spare && recv(p.sock, &spare, sizeof(spare), MSG_DONTWAIT) == sizeof(spare) && spare > 0)
+        p.spare = spare;
+
+    close(p.sock);
+    p.sock = -1;
+    --alive;
+}
+
+// Read the announcement of p's next spare
+bool Zygote::take_spare(Process &p)
+{
+    pid_t pid;
+    ssize_t n = recv(p.sock, &pid, sizeof(pid), MSG_DONTWAIT);
+    if (n == sizeof(pid) && pid > 0)
+    {
+        p.spare = pid;
+        return true;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return false;
+
+    lost(p);
+    return false;
+}
+
+// The next zygote in turn with a spare ready, without waiting for one
+Zygote::Process *Zygote::ready()
+{
+    std::vector<pollfd> pfds;
+    std::vector<Process*> waiting;
+
+    for (size_t i = 0; i < processes.size(); ++i)
+    {
+        Process &p = processes[(next + i) % processes.size()];
+        if (p.sock < 0)
+            continue;
+        if (p.spare > 0)
+            return &p;
+        pfds.push_back({p.sock, POLLIN, 0});
+        waiting.push_back(&p);
+    }
+
+    if (pfds.empty() || poll(pfds.data(), pfds.size(), 0) <= 0)
+        return nullptr;
+
+    for (size_t i = 0; i < pfds.size(); ++i)
+        if (pfds[i].revents && take_spare(*waiting[i]))
+            return waiting[i];
+    return nullptr;
+}
+
+pid_t Zygote::reserve()
+{
+    reserved = ready();
+    if (!reserved)
+    {
+        ++misses;
+        return -1;
+    }
+    return reserved->spare;
+}
+
+pid_t Zygote::spawn(const Request &request)
+{
+    Process *p = reserved;
+    reserved = nullptr;
+    if (!p || p->sock < 0 || p->spare <= 0)
+    {
+        ++failures;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    Header hdr = Header();
+
+    // The same fd is passed once however often it's used
+    int fds[3];
+    size_t nfds = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        hdr.stdio[i] = -1;
+        if (request.stdio[i] < 0)
+            continue;
+        for (size_t j = 0; j < nfds && hdr.stdio[i] < 0; ++j)
+            if (fds[j] == request.stdio[i])
+                hdr.stdio[i] = static_cast<int32_t>(j);
+        if (hdr.stdio[i] < 0)
+        {
+            hdr.stdio[i] = static_cast<int32_t>(nfds);
+            fds[nfds++] = request.stdio[i];
+        }
+    }
+
+    hdr.argc = static_cast<uint32_t>(request.argv.size());
+    for (char **env = request.envp; *env; ++env)
+        ++hdr.envc;
+    hdr.pin = request.pin;
+    hdr.cpus = request.cpus;
+    hdr.sched = request.sched;
+    hdr.sigmask = request.sigmask;
+
+    std::string body(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    for (const std::string &arg : request.argv)
+        body.append(arg.c_str(), arg.size() + 1);
+    for (char **env = request.envp; *env; ++env)
+        body.append(*env, std::strlen(*env) + 1);
+
+    union {
+        cmsghdr align;
+        char data[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    iovec iov = {&body[0], body.size()};
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds)
+    {
+        msg.msg_control = control.data;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        std::memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+    }
+
+    if (sendmsg(p->sock, &msg, MSG_NOSIGNAL) < 0)
+    {
+        int err = errno;
+        if (err == EPIPE || err == ECONNRESET)
+            lost(*p);
+        ++failures;
+        errno = err;
+        return -1;
+    }
+
+    pid_t pid = p->spare;
+    p->spare = 0;
+    next = (static_cast<size_t>(p - processes.data()) + 1) % processes.size();
+    ++spawned;
+    return pid;
+}
+
+bool Zygote::reaped(pid_t pid)
+{
+    for (Process &p : processes)
+    {
+        if (p.pid == pid)
+        {
+            if (p.sock >= 0)
+                lost(p);
+            p.pid = 0;
+            return true;
+        }
+        if (p.spare == pid)
+        {
+            // It never got a request; the zygote clones another one
+            p.spare = 0;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,140 @@
+// Copyright (c) 2014 Taeyeon Mori <orochimarufan.x3@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "scheduling.h"
+
+/**
+ * @file zygote.h
+ * @brief spawn handlers from small helper processes
+ *
+ * fork() copies the page tables of the whole server, so it gets slower as
+ * the server grows. Zygotes are forked at startup, before anything big is
+ * allocated, and each keeps one spare process cloned with CLONE_PARENT: a
+ * child of the server, waiting on the zygote's socket. A spawn sends the
+ * expanded argv, the environment and the handler's stdio fds
+ * (SCM_RIGHTS) to a zygote with a spare ready; the spare picks them up
+ * and execs while the zygote clones the next one. The server never waits
+ * for a spare: when none is ready it forks like it always did. It reaps
+ * handlers either way, and a pool of zygotes keeps spares coming during
+ * bursts.
+ */
+
+/**
+ * @brief The ZygoteError class
+ */
+class ZygoteError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+class Zygote
+{
+public:
+    /**
+     * @brief what the handler is to run with
+     */
+    struct Request
+    {
+        std::vector<std::string> argv;
+        char **envp;
+        int stdio[3];       // for stdin, stdout and stderr, -1 to inherit the server's
+        bool pin;           // apply cpus
+        cpu_set_t cpus;
+        ChildSched sched;
+        sigset_t sigmask;
+    };
+
+    /**
+     * @brief fork the zygotes
+     * Call as early as possible: they stay as big as the server is now.
+     * @param count number of zygotes
+     * @throws ZygoteError
+     */
+    explicit Zygote(unsigned count);
+
+    /**
+     * The zygotes and their spares exit once their socket is closed.
+     */
+    ~Zygote();
+
+    Zygote(const Zygote &) = delete;
+    Zygote &operator=(const Zygote &) = delete;
+
+    /**
+     * @brief whether any zygote is left
+     */
+    bool available() const { return alive > 0; }
+
+    /**
+     * @brief pick the spare the next spawn() goes to
+     * Doesn't wait for one to be cloned.
+     * @return its pid, the handler's to be, or -1 if none is ready
+     */
+    pid_t reserve();
+
+    /**
+     * @brief start a handler in the reserved spare
+     * @return its pid, a child of the server, or -1 with errno set
+     */
+    pid_t spawn(const Request &request);
+
+    /**
+     * @brief account for a child the server doesn't know
+     * @return true if it was a zygote or a spare
+     */
+    bool reaped(pid_t pid);
+
+    unsigned size() const { return alive; }
+
+    uint64_t spawned;
+    uint64_t misses;        // spawns without a spare ready
+    uint64_t failures;      // requests that couldn't be sent
+
+private:
+    struct Process
+    {
+        pid_t pid;
+        int sock;           // -1 once the zygote is gone
+        pid_t spare;        // ready to take a request, 0 if not announced yet
+    };
+
+    std::vector<Process> processes;
+    size_t next;
+    Process *reserved;
+    unsigned alive;
+
+    bool take_spare(Process &p);
+    Process *ready();
+    void lost(Process &p);
+};